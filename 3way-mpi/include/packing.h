@@ -0,0 +1,38 @@
+#ifndef __PACKING_H
+#define __PACKING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PACK_NONE 0   // Batches travel as they are held, 4 bytes a value or 8 in a widened batch.
+#define PACK_NARROW 1 // 4 bytes a value, or 8 for a batch with a value outside 32 bits.
+#define PACK_FOR 2    // Frame of reference: each value less the batch minimum, in as few bits as the range needs.
+
+#define PACK_WIDE_BATCH 0   // Encoding of a packed batch: plain 64-bit values.
+#define PACK_NARROW_BATCH 1 // 32-bit values.
+#define PACK_FOR_BATCH 2    // Bit-packed offsets from base.
+
+// Leads every packed batch, so the receiver needs nothing else to unpack it.
+struct pack_header
+{
+    int32_t encoding;
+    int32_t count;
+    int32_t bits;  // Bits per offset, for PACK_FOR_BATCH.
+    int32_t unused;
+    int64_t base;  // Smallest value, for PACK_FOR_BATCH.
+};
+
+// Traffic counters for one node.
+struct pack_stats
+{
+    long batches;
+    long promoted;   // Batches that needed 64-bit values.
+    long raw_bytes;  // What the batches would have taken as 64-bit values.
+    long bytes;      // What they took.
+};
+
+size_t pack_bound (int);
+size_t pack_values (const void *, int, int, int, unsigned char *, struct pack_stats *);
+int unpack_values (const unsigned char *, void *, int);
+
+#endif
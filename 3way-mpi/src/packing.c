@@ -0,0 +1,157 @@
+/* Compact encodings for batches sent between nodes. Most line scores and
+   diffs fit in 32 bits, and within a batch they usually span a much
+   narrower range still, so a batch is sent as the smallest exact form
+   that holds all of its values: a frame of reference (offsets from the
+   batch minimum, bit-packed), 32-bit values, or, for a batch with any
+   value past 32 bits, the original 64-bit values. */
+
+#include <string.h>
+
+#include "../include/packing.h"
+
+static int fits_narrow (long v)
+{
+    return v >= INT32_MIN && v <= INT32_MAX;
+}
+
+// values[i] of a batch held as long[], or as int32_t[] unless wide is set.
+static inline long value_at (const void *values, int wide, int i)
+{
+    return wide ? ((const long *) values)[i] : ((const int32_t *) values)[i];
+}
+
+// Bytes a packed batch of n values can take at most.
+size_t pack_bound (int n)
+{
+    return sizeof (struct pack_header) + (size_t) n * sizeof (int64_t) + sizeof (uint64_t);
+}
+
+// Pack values[0, n) into out, which has room for pack_bound(n) bytes,
+// choosing the encoding per batch as mode allows. values are long[] with
+// wide set, int32_t[] otherwise. Returns the bytes used.
+size_t pack_values (const void *values, int wide, int n, int mode, unsigned char *out, struct pack_stats *stats)
+{
+    struct pack_header h;
+    unsigned char *body = out + sizeof (struct pack_header);
+    size_t body_len;
+    long lo = n > 0 ? value_at (values, wide, 0) : 0, hi = lo;
+
+    for (int i = 1; i < n; i++)
+    {
+        long v = value_at (values, wide, i);
+        if (v < lo)
+            lo = v;
+        if (v > hi)
+            hi = v;
+    }
+
+    memset (&h, 0, sizeof (h));
+    h.count = n;
+    h.encoding = fits_narrow (lo) && fits_narrow (hi) ? PACK_NARROW_BATCH : PACK_WIDE_BATCH;
+
+    /* Offsets from the minimum need as many bits as the range does. */
+    if (mode == PACK_FOR)
+    {
+        uint64_t range = (uint64_t) hi - (uint64_t) lo;
+        int bits = range == 0 ? 0 : 64 - __builtin_clzl (range);
+        if (bits < 32)
+        {
+            h.encoding = PACK_FOR_BATCH;
+            h.bits = bits;
+            h.base = lo;
+        }
+    }
+
+    switch (h.encoding)
+    {
+    case PACK_FOR_BATCH:
+    {
+        /* Offsets go into 64-bit words from the low bits up, so one may
+           straddle two words. */
+        size_t words = ((size_t) n * h.bits + 63) / 64;
+        uint64_t *w = (uint64_t *) body;
+        memset (w, 0, words * sizeof (uint64_t));
+        for (int i = 0; i < n && h.bits > 0; i++)
+        {
+            uint64_t d = (uint64_t) value_at (values, wide, i) - (uint64_t) lo;
+            size_t pos = (size_t) i * h.bits;
+            w[pos / 64] |= d << (pos % 64);
+            if (pos % 64 + h.bits > 64)
+                w[pos / 64 + 1] |= d >> (64 - pos % 64);
+        }
+        body_len = words * sizeof (uint64_t);
+        break;
+    }
+    case PACK_NARROW_BATCH:
+    {
+        int32_t *v = (int32_t *) body;
+        for (int i = 0; i < n; i++)
+            v[i] = (int32_t) value_at (values, wide, i);
+        body_len = (size_t) n * sizeof (int32_t);
+        break;
+    }
+    default:
+        /* Only a batch held as 64-bit can need 64-bit values. */
+        memcpy (body, values, (size_t) n * sizeof (int64_t));
+        body_len = (size_t) n * sizeof (int64_t);
+        break;
+    }
+
+    memcpy (out, &h, sizeof (h));
+    if (stats != NULL)
+    {
+        stats->batches++;
+        stats->promoted += h.encoding == PACK_WIDE_BATCH;
+        stats->raw_bytes += (long) n * (long) sizeof (int64_t);
+        stats->bytes += (long) (sizeof (h) + body_len);
+    }
+    return sizeof (h) + body_len;
+}
+
+// Store v as values[i], of a batch held as long[] or, unless wide is set,
+// int32_t[]. A batch held in 32 bits only ever gets values that fit.
+static inline void value_put (void *values, int wide, int i, long v)
+{
+    if (wide)
+        ((long *) values)[i] = v;
+    else
+        ((int32_t *) values)[i] = (int32_t) v;
+}
+
+// Unpack a batch made by pack_values() into values, long[] with wide set
+// and int32_t[] otherwise. Returns its count.
+int unpack_values (const unsigned char *in, void *values, int wide)
+{
+    struct pack_header h;
+    const unsigned char *body = in + sizeof (struct pack_header);
+
+    memcpy (&h, in, sizeof (h));
+    switch (h.encoding)
+    {
+    case PACK_FOR_BATCH:
+    {
+        const uint64_t *w = (const uint64_t *) body;
+        uint64_t mask = h.bits == 0 ? 0 : (~(uint64_t) 0 >> (64 - h.bits));
+        for (int i = 0; i < h.count; i++)
+        {
+            size_t pos = (size_t) i * h.bits;
+            uint64_t d = h.bits == 0 ? 0 : w[pos / 64] >> (pos % 64);
+            if (pos % 64 + h.bits > 64)
+                d |= w[pos / 64 + 1] << (64 - pos % 64);
+            value_put (values, wide, i, (long) ((uint64_t) h.base + (d & mask)));
+        }
+        break;
+    }
+    case PACK_NARROW_BATCH:
+    {
+        const int32_t *v = (const int32_t *) body;
+        for (int i = 0; i < h.count; i++)
+            value_put (values, wide, i, v[i]);
+        break;
+    }
+    default:
+        memcpy (values, body, (size_t) h.count * sizeof (int64_t));
+        break;
+    }
+    return h.count;
+}
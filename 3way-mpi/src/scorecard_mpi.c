@@ -1,31 +1,96 @@
 /* Standard libraries. */
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 /* Parallel libraries. */
 #include <mpi.h>
 
+/* Custom libraries. */
+#include "../include/summary.h"
+#include "../include/telemetry.h"
+#include "../include/packing.h"
+
 /* Custom definitions. */
 #define WIKI_FILE_PATH "/homes/dan/625/wiki_dump.txt"
 #define MAX_ENTRIES_PER_READ 10000
+#define SCHEDULE_STATIC 0             // Each node takes one contiguous slice of batches.
+#define SCHEDULE_DYNAMIC 1            // Nodes ask the main node for CHUNK_SIZE batches at a time.
+#define SCHEDULE_GUIDED 2             // As dynamic, with chunks shrinking toward CHUNK_SIZE near the end.
+#define TAG_REQUEST 0                 // Worker to main node: the chunk just finished, {start, count}.
+#define TAG_ASSIGN 1                  // Main node to worker: the next chunk, count 0 to stop.
+#define TELEMETRY_INTERVAL_MS 1000    // Default time between telemetry samples.
+#define PREFIX_NONE 0                 // Records are diffs.
+#define PREFIX_TEXT 1                 // Records are running sums, as "line: sum" text.
+#define PREFIX_BINARY 2               // Records are running sums, as native 64-bit integers.
 
 /* For measuring performance. */
 double overall_elapsed;
 
-/* Custom op for reduce. */
-MPI_Op op;
+/* Custom op and type for reducing summaries. */
+MPI_Op summary_op;
+MPI_Datatype summary_type;
 
 int NUM_COMPUTE_NODES;        // Number of individual nodes performing computations using MPI.
-int NUM_BATCHES_READ;         // Number of batches read in from wiki file.
-long **line_scores;           // Data structure to hold batch reads.
+int NUM_BATCHES_READ;         // Number of batches read in from wiki file, counting a final partial one.
+int NUM_LINES_READ;           // Number of complete lines read in from wiki file.
+long TRAILING_SCORE;          // Score of an unterminated last line, 0 if the file ends in a newline.
+void **line_scores;           // Data structure to hold batch reads: int32_t[], or long[] where batch_wide is set. Slot MAX_ENTRIES_PER_READ holds the next batch's first score.
+char *batch_wide;             // Batches held as 64-bit: a score, the next batch's first or, in prefix mode, a running sum needs it.
+long batches_widened;         // How many, on the main node.
+int SUMMARY_MODE;             // Aggregate only, with no per-line records, set by -s option.
+int SUMMARY_K;                // Number of largest jumps kept in summary mode, taken from -s option.
+struct summary partial;       // This node's aggregate over the batches it owns.
+struct summary totals;        // All nodes' aggregates, reduced onto the main node.
+int SCHEDULE;                 // How batches are shared out, set by -S option.
+int CHUNK_SIZE;               // Batches per request, or the smallest guided chunk, set by -c option.
+MPI_Comm control_comm;        // Requests and assignments, kept apart from batch traffic.
+double work_ms;               // Time this node spent diffing batches.
+double idle_ms;               // Time this node spent in the scoring phase doing anything else.
+int batches_done;             // Batches this node diffed.
+int SHARED_WINDOWS;           // Ranks on one host share their host's batches in place, set by -w option.
+MPI_Comm host_comm;           // Ranks on this host.
+MPI_Comm leader_comm;         // First rank of each host, MPI_COMM_NULL elsewhere.
+MPI_Win host_window;          // This host's batches, in memory shared by its ranks.
+int NUM_HOSTS;                // Number of hosts, counted by their leaders.
+char *telemetry_spec;         // Where the main node sends progress samples, set by -T option, NULL for none.
+int telemetry_interval;       // Milliseconds between samples, set by -t option.
+struct telemetry_counters progress; // Main node's view: bytes read, lines scored and back, records written.
+int PACKING;                  // Encoding of batches sent between nodes, set by -z option.
+unsigned char *pack_buf;      // One packed batch, pack_bound(MAX_ENTRIES_PER_READ + 1) bytes.
+struct pack_stats traffic;    // Batches this node sent, and their bytes.
+struct pack_stats all_traffic; // Every node's, summed onto the main node.
+int PREFIX_MODE;              // Write running sums of the scores instead of diffs, set by -P option.
+FILE *report_out;             // Where TIME and DATA lines go: stdout, or stderr under binary records.
 
 /* Function prototypes. */
-void input_scores();
+void input_scores(char *);
 void output_scores();
 void compute_scores(int pID);
-void *calc_line_diffs(void *);
+void compute_batch(int);
+void link_batches();
+void schedule_batches();
+void work_batches();
+int next_chunk(int, int);
+void report_ranks(int);
+void split_range(int, int, int, int, int *, int *);
+void share_batches(int);
+void lines_scored(int, int);
+void carry_sums(int, int, MPI_Comm);
+void send_batch(int, int, int, MPI_Comm);
+void recv_batch(int, int, int, MPI_Comm);
+void batch_range(int, int *, int *);
+int batch_entries(int);
+size_t batch_size(int);
+long score_at(int, int);
+void set_score(int, int, long);
+void widen_batch(int);
+void distribute_batches(int);
+void collect_batches(int);
+void merge_summaries(void *, void *, int *, MPI_Datatype *);
 FILE *try_open_file(char *);
 int try_close_file(FILE *f);
 
@@ -33,113 +98,718 @@ void init_vars()
 {
     /* Initialize timer vars. */
     NUM_BATCHES_READ = 0;
+    NUM_LINES_READ = 0;
+    TRAILING_SCORE = 0;
     overall_elapsed = 0;
+    batches_widened = 0;
+    work_ms = 0;
+    idle_ms = 0;
+    batches_done = 0;
 }
 
-void subem(long *invec, long *inoutvec, int *len, MPI_Datatype *dtype)
+/* Custom reduce op: fold each summary in invec into the one in inoutvec. */
+void merge_summaries(void *invec, void *inoutvec, int *len, MPI_Datatype *dtype)
 {
+    (void)dtype;
+    struct summary *in = (struct summary *)invec;
+    struct summary *inout = (struct summary *)inoutvec;
+
     for (int i = 0; i < *len; i++)
     {
-        inoutvec[i] = invec[i] - invec[i + 1];
+        summary_merge(&inout[i], &in[i]);
     }
 }
 
-void compute_scores(int pID)
+/* Batches [startPos, endPos) belong to node pID. The last node takes the remainder. */
+void batch_range(int pID, int *startPos, int *endPos)
 {
-    int startPos, endPos;
-
-    startPos = pID * (NUM_BATCHES_READ / NUM_COMPUTE_NODES);
-    endPos = startPos + (NUM_BATCHES_READ / NUM_COMPUTE_NODES);
+    *startPos = pID * (NUM_BATCHES_READ / NUM_COMPUTE_NODES);
+    *endPos = *startPos + (NUM_BATCHES_READ / NUM_COMPUTE_NODES);
 
     if (pID == NUM_COMPUTE_NODES - 1)
-        endPos = NUM_BATCHES_READ;
+        *endPos = NUM_BATCHES_READ;
+}
+
+/* Part [*startPos, *endPos) of batches [lo, hi) split into parts pieces. The last piece takes the remainder. */
+void split_range(int part, int parts, int lo, int hi, int *startPos, int *endPos)
+{
+    *startPos = lo + part * ((hi - lo) / parts);
+    *endPos = *startPos + ((hi - lo) / parts);
+
+    if (part == parts - 1)
+        *endPos = hi;
+}
+
+/* Static schedule over shared-memory windows. Batches are split between
+   hosts, and each host's slice lives once, in a window its ranks all map.
+   Only the host leaders exchange messages: the main node copies its own
+   host's slice into its window and sends each other leader its slice
+   straight into theirs. Every rank then diffs its part of its host's
+   slice in place, and the leaders send the results back. */
+void share_batches(int pID)
+{
+    int host_rank, host_size, host_index = 0;
+    int hostStart, hostEnd, startPos, endPos;
+    char *base;
+    MPI_Aint size = 0;
+    int disp;
+
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &host_comm);
+    MPI_Comm_rank(host_comm, &host_rank);
+    MPI_Comm_size(host_comm, &host_size);
+    MPI_Comm_split(MPI_COMM_WORLD, host_rank == 0 ? 0 : MPI_UNDEFINED, pID, &leader_comm);
+    if (host_rank == 0)
+    {
+        MPI_Comm_size(leader_comm, &NUM_HOSTS);
+        MPI_Comm_rank(leader_comm, &host_index);
+    }
+    MPI_Bcast(&NUM_HOSTS, 1, MPI_INT, 0, host_comm);
+    MPI_Bcast(&host_index, 1, MPI_INT, 0, host_comm);
+
+    /* Ranks ordered by where their part falls among all the batches, for the prefix scan. */
+    MPI_Comm order_comm;
+    MPI_Comm_split(MPI_COMM_WORLD, 0, host_index * NUM_COMPUTE_NODES + host_rank, &order_comm);
+
+    /* The leader's segment holds the whole slice, each batch at its own
+       width; the others attach to it. */
+    split_range(host_index, NUM_HOSTS, 0, NUM_BATCHES_READ, &hostStart, &hostEnd);
+    for (int i = hostStart; i < hostEnd && host_rank == 0; i++)
+        size += (MPI_Aint)batch_size(i);
+    MPI_Win_allocate_shared(size, 1, MPI_INFO_NULL, host_comm, &base, &host_window);
+    MPI_Win_shared_query(host_window, 0, &size, &disp, &base);
+
+    if (pID != 0)
+        line_scores = (void **)calloc(NUM_BATCHES_READ, sizeof(void *));
+
+    MPI_Win_fence(0, host_window);
+    if (pID == 0)
+    {
+        for (int i = hostStart; i < hostEnd; i++)
+        {
+            memcpy(base, line_scores[i], batch_size(i));
+            free(line_scores[i]);
+            line_scores[i] = base;
+            base += batch_size(i);
+        }
+        for (int host = 1; host < NUM_HOSTS; host++)
+        {
+            split_range(host, NUM_HOSTS, 0, NUM_BATCHES_READ, &startPos, &endPos);
+            for (int i = startPos; i < endPos; i++)
+            {
+                send_batch(i, 1, host, leader_comm);
+            }
+        }
+    }
+    else
+    {
+        for (int i = hostStart; i < hostEnd; i++)
+        {
+            line_scores[i] = base;
+            base += batch_size(i);
+            if (host_rank == 0)
+                recv_batch(i, 1, 0, leader_comm);
+        }
+    }
+    MPI_Win_fence(0, host_window);
+
+    split_range(host_rank, host_size, hostStart, hostEnd, &startPos, &endPos);
+    for (int i = startPos; i < endPos; i++)
+    {
+        compute_batch(i);
+    }
+    if (PREFIX_MODE != PREFIX_NONE)
+        carry_sums(startPos, endPos, order_comm);
+    MPI_Comm_free(&order_comm);
+    MPI_Win_fence(0, host_window);
+    if (pID == 0)
+        lines_scored(hostStart, hostEnd);
+
+    if (SUMMARY_MODE)
+    {
+        MPI_Reduce(&partial, &totals, 1, summary_type, summary_op, 0, MPI_COMM_WORLD);
+        if (pID == 0)
+            __atomic_store_n(&progress.lines_scored, (long)NUM_LINES_READ, __ATOMIC_RELAXED);
+    }
+    else if (pID == 0)
+    {
+        for (int host = 1; host < NUM_HOSTS; host++)
+        {
+            split_range(host, NUM_HOSTS, 0, NUM_BATCHES_READ, &startPos, &endPos);
+            for (int i = startPos; i < endPos; i++)
+            {
+                recv_batch(i, 0, host, leader_comm);
+                lines_scored(i, i + 1);
+            }
+        }
+    }
+    else if (host_rank == 0)
+    {
+        for (int i = hostStart; i < hostEnd; i++)
+        {
+            send_batch(i, 0, 0, leader_comm);
+        }
+    }
+}
+
+/* Send batch i to node, tagged i. With next set it also carries the next
+   batch's first score, as read batches do; results go without it. */
+void send_batch(int i, int next, int node, MPI_Comm comm)
+{
+    int n = batch_entries(i);
+
+    /* Unpacked, a batch goes at the width it is held in. */
+    if (PACKING == PACK_NONE)
+    {
+        int count = next ? MAX_ENTRIES_PER_READ + 1 : n;
+        MPI_Send(line_scores[i], count, batch_wide[i] ? MPI_LONG : MPI_INT32_T, node, i, comm);
+        traffic.batches++;
+        traffic.promoted += batch_wide[i];
+        traffic.raw_bytes += (long)count * sizeof(long);
+        traffic.bytes += (long)count * (batch_wide[i] ? sizeof(long) : sizeof(int32_t));
+        return;
+    }
+
+    /* Packed values are contiguous, so a short batch's next score is
+       moved up behind its last line for the call and then put back. */
+    long saved = score_at(i, n);
+    if (next)
+        set_score(i, n, score_at(i, MAX_ENTRIES_PER_READ));
+    size_t bytes = pack_values(line_scores[i], batch_wide[i], n + next, PACKING, pack_buf, &traffic);
+    set_score(i, n, saved);
+
+    MPI_Send(pack_buf, (int)bytes, MPI_BYTE, node, i, comm);
+}
+
+/* Receive batch i from node into line_scores[i], which is already allocated. */
+void recv_batch(int i, int next, int node, MPI_Comm comm)
+{
+    int n = batch_entries(i);
+
+    if (PACKING == PACK_NONE)
+    {
+        MPI_Recv(line_scores[i], next ? MAX_ENTRIES_PER_READ + 1 : n, batch_wide[i] ? MPI_LONG : MPI_INT32_T, node, i,
+                 comm, MPI_STATUS_IGNORE);
+        return;
+    }
+
+    MPI_Recv(pack_buf, (int)pack_bound(MAX_ENTRIES_PER_READ + 1), MPI_BYTE, node, i, comm, MPI_STATUS_IGNORE);
+    unpack_values(pack_buf, line_scores[i], batch_wide[i]);
+    if (next)
+        set_score(i, MAX_ENTRIES_PER_READ, score_at(i, n));
+}
+
+/* Main node only: batches [startPos, endPos) are scored and their results are here. */
+void lines_scored(int startPos, int endPos)
+{
+    for (int i = startPos; i < endPos; i++)
+    {
+        telemetry_add(progress.lines_scored, batch_entries(i));
+    }
+}
+
+/* Prefix mode, second pass. Batches [startPos, endPos) each hold running
+   sums of their own lines; add everything before them. An exclusive scan
+   over comm, whose ranks are in batch order, gives the sum of all earlier
+   ranks' batches, and it is carried through this rank's in order. */
+void carry_sums(int startPos, int endPos, MPI_Comm comm)
+{
+    long total = 0, carry = 0;
+    int order;
+    double start = MPI_Wtime();
+
+    for (int i = startPos; i < endPos; i++)
+    {
+        total += score_at(i, batch_entries(i) - 1);
+    }
+    MPI_Exscan(&total, &carry, 1, MPI_LONG, MPI_SUM, comm);
+
+    /* The first rank's result is left undefined; nothing comes before it. */
+    MPI_Comm_rank(comm, &order);
+    if (order == 0)
+        carry = 0;
 
+    /* link_batches() widened every batch whose sums pass 32 bits. */
     for (int i = startPos; i < endPos; i++)
     {
-        if (pID != 0)
+        int n = batch_entries(i);
+        if (batch_wide[i])
+        {
+            long *sums = (long *)line_scores[i];
+            for (int j = 0; j < n; j++)
+            {
+                sums[j] += carry;
+            }
+        }
+        else
+        {
+            int32_t *sums = (int32_t *)line_scores[i];
+            for (int j = 0; j < n; j++)
+            {
+                sums[j] = (int32_t)(sums[j] + carry);
+            }
+        }
+        carry = score_at(i, n - 1);
+    }
+
+    work_ms += (MPI_Wtime() - start) * 1000;
+}
+
+/* Number of lines in batch i. Only the last batch can be short. */
+int batch_entries(int i)
+{
+    int left = NUM_LINES_READ - i * MAX_ENTRIES_PER_READ;
+    return left < MAX_ENTRIES_PER_READ ? left : MAX_ENTRIES_PER_READ;
+}
+
+/* Bytes batch i takes, next score included, at the width it is held in. */
+size_t batch_size(int i)
+{
+    return (MAX_ENTRIES_PER_READ + 1) * (batch_wide[i] ? sizeof(long) : sizeof(int32_t));
+}
+
+/* Score j of batch i, whatever its width. */
+long score_at(int i, int j)
+{
+    return batch_wide[i] ? ((long *)line_scores[i])[j] : ((int32_t *)line_scores[i])[j];
+}
+
+/* Set score j of batch i. A 32-bit batch is only given values that fit. */
+void set_score(int i, int j, long v)
+{
+    if (batch_wide[i])
+        ((long *)line_scores[i])[j] = v;
+    else
+        ((int32_t *)line_scores[i])[j] = (int32_t)v;
+}
+
+/* Main node only: move batch i to 64-bit scores. Going from the top down,
+   each long lands on 32-bit slots that have already been moved. */
+void widen_batch(int i)
+{
+    line_scores[i] = realloc(line_scores[i], (MAX_ENTRIES_PER_READ + 1) * sizeof(long));
+    long *wide = (long *)line_scores[i];
+    int32_t *narrow = (int32_t *)line_scores[i];
+    for (int j = MAX_ENTRIES_PER_READ; j >= 0; j--)
+    {
+        wide[j] = narrow[j];
+    }
+    batch_wide[i] = 1;
+    batches_widened++;
+}
+
+/* Main node only, before any batch is sent: give every batch the first
+   score of the batch after it, so each can be diffed on its own, and
+   widen each batch whose results would not fit in 32 bits. Scores are
+   never negative, so diffs of 32-bit scores fit; that leaves a next score
+   past 32 bits or, in prefix mode, a running sum past them. */
+void link_batches()
+{
+    long running = 0;
+
+    for (int i = 0; i < NUM_BATCHES_READ; i++)
+    {
+        long next = (i + 1 < NUM_BATCHES_READ) ? score_at(i + 1, 0) : TRAILING_SCORE;
+        for (int j = 0; j < batch_entries(i); j++)
         {
-            MPI_Reduce(line_scores[i], line_scores[i], MAX_ENTRIES_PER_READ - 1, MPI_LONG, op, 0, MPI_COMM_WORLD);
+            running += score_at(i, j);
+        }
+        if (!batch_wide[i] && (next > INT32_MAX || (PREFIX_MODE != PREFIX_NONE && running > INT32_MAX)))
+            widen_batch(i);
+        set_score(i, MAX_ENTRIES_PER_READ, next);
+    }
+}
+
+/* Send each node the batches it owns, each with the first score of the batch after it. */
+void distribute_batches(int pID)
+{
+    int startPos, endPos;
+
+    if (pID == 0)
+    {
+        for (int node = 1; node < NUM_COMPUTE_NODES; node++)
+        {
+            batch_range(node, &startPos, &endPos);
+            for (int i = startPos; i < endPos; i++)
+            {
+                send_batch(i, 1, node, MPI_COMM_WORLD);
+            }
+        }
+    }
+    else
+    {
+        /* Only the batches this node owns are allocated. */
+        line_scores = (void **)calloc(NUM_BATCHES_READ, sizeof(void *));
+        batch_range(pID, &startPos, &endPos);
+        for (int i = startPos; i < endPos; i++)
+        {
+            line_scores[i] = malloc(batch_size(i));
+            recv_batch(i, 1, 0, MPI_COMM_WORLD);
+        }
+    }
+}
+
+/* Diff batch i in place and fold it into this node's summary. In prefix
+   mode, turn it into running sums of its own lines instead. */
+void compute_batch(int i)
+{
+    int n = batch_entries(i);
+    double start = MPI_Wtime();
+
+    /* A 32-bit batch's sums and diffs fit in 32 bits; link_batches() saw to that. */
+    if (batch_wide[i])
+    {
+        long *scores = (long *)line_scores[i];
+        if (PREFIX_MODE != PREFIX_NONE)
+        {
+            for (int j = 1; j < n; j++)
+            {
+                scores[j] += scores[j - 1];
+            }
+        }
+        else
+        {
+            /* The last line is diffed against the next batch's first score. */
+            for (int j = 0; j < n - 1; j++)
+            {
+                scores[j] -= scores[j + 1];
+            }
+            scores[n - 1] -= scores[MAX_ENTRIES_PER_READ];
+            if (SUMMARY_MODE)
+                summary_add(&partial, scores, (long)i * MAX_ENTRIES_PER_READ, 0, n);
+        }
+    }
+    else
+    {
+        int32_t *scores = (int32_t *)line_scores[i];
+        if (PREFIX_MODE != PREFIX_NONE)
+        {
+            for (int j = 1; j < n; j++)
+            {
+                scores[j] += scores[j - 1];
+            }
         }
         else
         {
-            for (int j = 0; j < MAX_ENTRIES_PER_READ - 1; j++)
+            for (int j = 0; j < n - 1; j++)
+            {
+                scores[j] -= scores[j + 1];
+            }
+            scores[n - 1] -= scores[MAX_ENTRIES_PER_READ];
+            if (SUMMARY_MODE)
+                summary_add_narrow(&partial, scores, (long)i * MAX_ENTRIES_PER_READ, 0, n);
+        }
+    }
+
+    work_ms += (MPI_Wtime() - start) * 1000;
+    batches_done++;
+}
+
+void compute_scores(int pID)
+{
+    int startPos, endPos;
+
+    batch_range(pID, &startPos, &endPos);
+    for (int i = startPos; i < endPos; i++)
+    {
+        compute_batch(i);
+        if (pID == 0)
+            lines_scored(i, i + 1);
+    }
+
+    /* Slices are in rank order, so the scan runs over every node. */
+    if (PREFIX_MODE != PREFIX_NONE)
+        carry_sums(startPos, endPos, MPI_COMM_WORLD);
+}
+
+/* Size of the chunk starting at batch next. Guided chunks are half of an
+   even share of what is left, so they shrink as the end nears and the
+   last few are spread across the nodes. */
+int next_chunk(int next, int workers)
+{
+    int left = NUM_BATCHES_READ - next;
+    int size = CHUNK_SIZE;
+
+    if (SCHEDULE == SCHEDULE_GUIDED && left / (2 * workers) > size)
+        size = left / (2 * workers);
+    return size < left ? size : left;
+}
+
+/* Main node in the dynamic schedules: hands out chunks in batch order to
+   whichever node asks first, and takes each finished chunk back into place
+   when that node asks again. Every node is sent a stop once nothing is left. */
+void schedule_batches()
+{
+    int workers = NUM_COMPUTE_NODES - 1;
+    int next = 0, stopped = 0;
+    int chunk[2];
+    MPI_Status status;
+
+    while (stopped < workers)
+    {
+        MPI_Recv(chunk, 2, MPI_INT, MPI_ANY_SOURCE, TAG_REQUEST, control_comm, &status);
+        int node = status.MPI_SOURCE;
+        lines_scored(chunk[0], chunk[0] + chunk[1]);
+
+        if (!SUMMARY_MODE)
+        {
+            for (int i = chunk[0]; i < chunk[0] + chunk[1]; i++)
+            {
+                recv_batch(i, 0, node, MPI_COMM_WORLD);
+            }
+        }
+
+        chunk[0] = next;
+        chunk[1] = next_chunk(next, workers);
+        MPI_Send(chunk, 2, MPI_INT, node, TAG_ASSIGN, control_comm);
+        if (chunk[1] == 0)
+        {
+            stopped++;
+            continue;
+        }
+
+        for (int i = chunk[0]; i < chunk[0] + chunk[1]; i++)
+        {
+            send_batch(i, 1, node, MPI_COMM_WORLD);
+        }
+        next += chunk[1];
+    }
+}
+
+/* Other nodes in the dynamic schedules: ask for a chunk, diff it, and
+   return it with the next request, until told to stop. */
+void work_batches()
+{
+    int chunk[2] = {0, 0};
+
+    line_scores = (void **)calloc(NUM_BATCHES_READ, sizeof(void *));
+
+    for (;;)
+    {
+        MPI_Send(chunk, 2, MPI_INT, 0, TAG_REQUEST, control_comm);
+        if (!SUMMARY_MODE)
+        {
+            for (int i = chunk[0]; i < chunk[0] + chunk[1]; i++)
             {
-                line_scores[i][j] -= line_scores[i][j + 1];
+                send_batch(i, 0, 0, MPI_COMM_WORLD);
             }
         }
-        
+        for (int i = chunk[0]; i < chunk[0] + chunk[1]; i++)
+        {
+            free(line_scores[i]);
+            line_scores[i] = NULL;
+        }
+
+        MPI_Recv(chunk, 2, MPI_INT, 0, TAG_ASSIGN, control_comm, MPI_STATUS_IGNORE);
+        if (chunk[1] == 0)
+            break;
+
+        for (int i = chunk[0]; i < chunk[0] + chunk[1]; i++)
+        {
+            line_scores[i] = malloc(batch_size(i));
+            recv_batch(i, 1, 0, MPI_COMM_WORLD);
+        }
+        for (int i = chunk[0]; i < chunk[0] + chunk[1]; i++)
+        {
+            compute_batch(i);
+        }
+    }
+}
+
+/* Gather every node's batch count, work and idle time onto the main node and print them. */
+void report_ranks(int pID)
+{
+    double mine[3] = {batches_done, work_ms, idle_ms};
+    double *all = NULL;
+
+    if (pID == 0)
+        all = (double *)malloc(3 * NUM_COMPUTE_NODES * sizeof(double));
+    MPI_Gather(mine, 3, MPI_DOUBLE, all, 3, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+
+    if (pID == 0)
+    {
+        for (int node = 0; node < NUM_COMPUTE_NODES; node++)
+        {
+            fprintf(report_out, "DATA, RANK %d, %d batches, %.3f ms work, %.3f ms idle\n", node, (int)all[3 * node],
+                    all[3 * node + 1], all[3 * node + 2]);
+        }
+        fflush(report_out);
+        free(all);
+    }
+}
+
+/* Bring the results back to the main node: the diffed batches, or in
+   summary mode just the per-node summaries, merged by MPI_Reduce. */
+void collect_batches(int pID)
+{
+    int startPos, endPos;
+
+    if (SUMMARY_MODE)
+    {
+        MPI_Reduce(&partial, &totals, 1, summary_type, summary_op, 0, MPI_COMM_WORLD);
+        if (pID == 0)
+            __atomic_store_n(&progress.lines_scored, (long)NUM_LINES_READ, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (pID == 0)
+    {
+        for (int node = 1; node < NUM_COMPUTE_NODES; node++)
+        {
+            batch_range(node, &startPos, &endPos);
+            for (int i = startPos; i < endPos; i++)
+            {
+                recv_batch(i, 0, node, MPI_COMM_WORLD);
+                lines_scored(i, i + 1);
+            }
+        }
+    }
+    else
+    {
+        batch_range(pID, &startPos, &endPos);
+        for (int i = startPos; i < endPos; i++)
+        {
+            send_batch(i, 0, 0, MPI_COMM_WORLD);
+        }
     }
 }
 
-void input_scores()
+void input_scores(char *path)
 {
-    FILE *file = try_open_file(WIKI_FILE_PATH);
+    FILE *file = try_open_file(path);
     if (file == NULL)
     {
-        printf("Attempt to open file at - " WIKI_FILE_PATH " - failed! Program exiting!\n");
+        printf("Attempt to open file at - %s - failed! Program exiting!\n", path);
         exit(EXIT_FAILURE);
     }
 
     int ch = 0;
     int line_counter = 0;
     long score_counter = 0;
+    long batch_bytes = 0; // Bytes read since progress was last told.
 
-    /* Malloc to add space for first batch. */
-    line_scores = (long **)malloc(sizeof(long *));
-    line_scores[NUM_BATCHES_READ] = (long *)malloc(MAX_ENTRIES_PER_READ * sizeof(long));
+    /* Malloc to add space for first batch. Batches start out 32-bit. */
+    line_scores = (void **)malloc(sizeof(void *));
+    batch_wide = (char *)calloc(1, sizeof(char));
+    line_scores[NUM_BATCHES_READ] = malloc(batch_size(NUM_BATCHES_READ));
 
     while (!feof(file))
     {
         int ch = fgetc(file);
+        batch_bytes += ch != EOF;
         if (ch == '\n')
         {
-            line_scores[NUM_BATCHES_READ][(line_counter++) % MAX_ENTRIES_PER_READ] = score_counter;
+            if (score_counter > INT32_MAX && !batch_wide[NUM_BATCHES_READ])
+                widen_batch(NUM_BATCHES_READ);
+            set_score(NUM_BATCHES_READ, (line_counter++) % MAX_ENTRIES_PER_READ, score_counter);
             score_counter = 0;
             if (line_counter % MAX_ENTRIES_PER_READ == 0)
             {
                 ++NUM_BATCHES_READ;
+                telemetry_add(progress.bytes_read, batch_bytes);
+                batch_bytes = 0;
 
                 /* Peek at the next char. */
                 int c = fgetc(file);
                 if (c != EOF)
                 {
                     /* Prep a new batch. */
-                    line_scores = (long **)realloc(line_scores, ((NUM_BATCHES_READ) + 1) * sizeof(long *));
-                    line_scores[NUM_BATCHES_READ] = (long *)malloc(MAX_ENTRIES_PER_READ * sizeof(long));
+                    line_scores = (void **)realloc(line_scores, ((NUM_BATCHES_READ) + 1) * sizeof(void *));
+                    batch_wide = (char *)realloc(batch_wide, ((NUM_BATCHES_READ) + 1) * sizeof(char));
+                    batch_wide[NUM_BATCHES_READ] = 0;
+                    line_scores[NUM_BATCHES_READ] = malloc(batch_size(NUM_BATCHES_READ));
                 }
                 ungetc(c, file);
             }
         }
-        else
+        else if (ch != EOF)
         {
             score_counter += ch;
         }
     }
 
+    /* A final partial batch counts as a batch too. An unterminated last
+       line is not a record, but the line before it is diffed against it. */
+    NUM_LINES_READ = line_counter;
+    TRAILING_SCORE = score_counter;
+    telemetry_add(progress.bytes_read, batch_bytes);
+    if (line_counter % MAX_ENTRIES_PER_READ != 0)
+    {
+        ++NUM_BATCHES_READ;
+    }
+
     /* Close file stream. */
     try_close_file(file);
 }
 
 void output_scores()
 {
+    long *record = (long *)malloc(MAX_ENTRIES_PER_READ * sizeof(long));
+
     for (int i = 0; i < NUM_BATCHES_READ; i++)
     {
-        for (int j = 0; j < MAX_ENTRIES_PER_READ; j++)
+        if (PREFIX_MODE == PREFIX_BINARY)
         {
-            printf("%d-%d: %ld\n", (MAX_ENTRIES_PER_READ * i) + j, (MAX_ENTRIES_PER_READ * i) + j + 1, line_scores[i][j]);
-            fflush(stdout);
+            /* Records are 64-bit whatever width the batch is held in. */
+            for (int j = 0; j < batch_entries(i); j++)
+            {
+                record[j] = score_at(i, j);
+            }
+            fwrite(record, sizeof(long), batch_entries(i), stdout);
+        }
+        else if (PREFIX_MODE == PREFIX_TEXT)
+        {
+            for (int j = 0; j < batch_entries(i); j++)
+            {
+                printf("%d: %ld\n", (MAX_ENTRIES_PER_READ * i) + j, score_at(i, j));
+            }
+        }
+        else
+        {
+            for (int j = 0; j < batch_entries(i); j++)
+            {
+                printf("%d-%d: %ld\n", (MAX_ENTRIES_PER_READ * i) + j, (MAX_ENTRIES_PER_READ * i) + j + 1, score_at(i, j));
+                fflush(stdout);
+            }
         }
+        telemetry_add(progress.records_written, batch_entries(i));
     }
+    fflush(stdout);
+    free(record);
 }
 
 void output_performance()
 {
-    printf("TIME, OVERALL, %f", overall_elapsed);
-    fflush(stdout);
+    fprintf(report_out, "TIME, OVERALL, %f ms\n", overall_elapsed);
+    fprintf(report_out, "DATA, VERSION, MPI\n");
+    fprintf(report_out, "DATA, NODES, %d\n", NUM_COMPUTE_NODES);
+    fprintf(report_out, "DATA, SCHEDULE, %s, chunk %d\n",
+            SCHEDULE == SCHEDULE_STATIC ? "static" : SCHEDULE == SCHEDULE_DYNAMIC ? "dynamic" : "guided", CHUNK_SIZE);
+    if (SUMMARY_MODE)
+        fprintf(report_out, "DATA, SUMMARY TOP K, %d\n", SUMMARY_K);
+    if (SHARED_WINDOWS)
+        fprintf(report_out, "DATA, SHARED WINDOWS, %d hosts\n", NUM_HOSTS);
+    if (PREFIX_MODE != PREFIX_NONE)
+        fprintf(report_out, "DATA, PREFIX, %s\n", PREFIX_MODE == PREFIX_BINARY ? "binary" : "text");
+    fprintf(report_out, "DATA, TRAFFIC, %s, %ld batches, %ld promoted to 64-bit, %ld bytes, %ld as 64-bit, %.2fx\n",
+            PACKING == PACK_NONE ? "none" : PACKING == PACK_NARROW ? "narrow" : "for", all_traffic.batches,
+            all_traffic.promoted, all_traffic.bytes, all_traffic.raw_bytes,
+            all_traffic.bytes > 0 ? (double)all_traffic.raw_bytes / all_traffic.bytes : 1.0);
+
+    /* The main node holds every batch, each at its own width. */
+    long held = 0;
+    for (int i = 0; i < NUM_BATCHES_READ; i++)
+        held += (long)batch_size(i);
+    long held_wide = (long)NUM_BATCHES_READ * (MAX_ENTRIES_PER_READ + 1) * sizeof(long);
+    fprintf(report_out, "DATA, FOOTPRINT, %d batches, %ld widened to 64-bit, %ld bytes of scores, %ld as 64-bit, %.2fx\n",
+            NUM_BATCHES_READ, batches_widened, held, held_wide, held > 0 ? (double)held_wide / held : 1.0);
+    fflush(report_out);
 }
 
 FILE *try_open_file(char *path)
 {
+    /* "-" reads from standard input. mpirun forwards it to rank 0, the only reader. */
+    if (strcmp(path, "-") == 0)
+        return stdin;
     return fopen(path, "r");
 }
 
@@ -154,11 +824,11 @@ int main(int argc, char *argv[])
     gettimeofday(&start, NULL);
 
     /* Get MPI all setup. */
-    int i, rc;
-    int rank;
-    MPI_Status Status;
+    int rc, opt;
+    int rank, provided;
 
-    rc = MPI_Init(&argc, &argv);
+    /* The telemetry thread makes no MPI calls, so funneled is enough. */
+    rc = MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
     if (rc != MPI_SUCCESS)
     {
         printf("Error starting MPI program. Terminating.\n");
@@ -168,45 +838,231 @@ int main(int argc, char *argv[])
     MPI_Comm_size(MPI_COMM_WORLD, &NUM_COMPUTE_NODES);
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 
-    MPI_Op_create((MPI_User_function *)subem, 0, &op);
+    /* Summaries are merged with a commutative custom op over one opaque struct each. */
+    MPI_Type_contiguous(sizeof(struct summary), MPI_BYTE, &summary_type);
+    MPI_Type_commit(&summary_type);
+    MPI_Op_create(merge_summaries, 1, &summary_op);
+    MPI_Comm_dup(MPI_COMM_WORLD, &control_comm);
+
+    /* Parse options. Every node sees the same command line. */
+    SUMMARY_MODE = 0;
+    SUMMARY_K = 0;
+    SCHEDULE = SCHEDULE_STATIC;
+    CHUNK_SIZE = 1;
+    SHARED_WINDOWS = 0;
+    telemetry_spec = NULL;
+    telemetry_interval = TELEMETRY_INTERVAL_MS;
+    PACKING = PACK_NONE;
+    PREFIX_MODE = PREFIX_NONE;
+    while ((opt = getopt(argc, argv, "s:S:c:wT:t:z:P:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            SUMMARY_MODE = 1;
+            SUMMARY_K = (int)strtol(optarg, (char **)NULL, 10);
+            if (SUMMARY_K < 0 || SUMMARY_K > SUMMARY_MAX_TOP)
+            {
+                if (rank == 0)
+                    printf("Invalid top K - %s - given! Program exiting!\n", optarg);
+                MPI_Finalize();
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'S':
+            if (strcmp(optarg, "static") == 0)
+                SCHEDULE = SCHEDULE_STATIC;
+            else if (strcmp(optarg, "dynamic") == 0)
+                SCHEDULE = SCHEDULE_DYNAMIC;
+            else if (strcmp(optarg, "guided") == 0)
+                SCHEDULE = SCHEDULE_GUIDED;
+            else
+            {
+                if (rank == 0)
+                    printf("Invalid schedule - %s - given! Program exiting!\n", optarg);
+                MPI_Finalize();
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'c':
+            CHUNK_SIZE = (int)strtol(optarg, (char **)NULL, 10);
+            if (CHUNK_SIZE < 1)
+            {
+                if (rank == 0)
+                    printf("Invalid chunk size - %s - given! Program exiting!\n", optarg);
+                MPI_Finalize();
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'w':
+            SHARED_WINDOWS = 1;
+            break;
+        case 'T':
+            telemetry_spec = optarg;
+            break;
+        case 'z':
+            if (strcmp(optarg, "none") == 0)
+                PACKING = PACK_NONE;
+            else if (strcmp(optarg, "narrow") == 0)
+                PACKING = PACK_NARROW;
+            else if (strcmp(optarg, "for") == 0)
+                PACKING = PACK_FOR;
+            else
+            {
+                if (rank == 0)
+                    printf("Invalid packing - %s - given! Program exiting!\n", optarg);
+                MPI_Finalize();
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'P':
+            if (strcmp(optarg, "text") == 0)
+                PREFIX_MODE = PREFIX_TEXT;
+            else if (strcmp(optarg, "binary") == 0)
+                PREFIX_MODE = PREFIX_BINARY;
+            else
+            {
+                if (rank == 0)
+                    printf("Invalid prefix format - %s - given! Program exiting!\n", optarg);
+                MPI_Finalize();
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 't':
+            telemetry_interval = (int)strtol(optarg, (char **)NULL, 10);
+            if (telemetry_interval < 1)
+            {
+                if (rank == 0)
+                    printf("Invalid telemetry interval - %s - given! Program exiting!\n", optarg);
+                MPI_Finalize();
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            if (rank == 0)
+                printf("Usage: %s [-s top_k] [-S static|dynamic|guided] [-c chunk] [-w] [-T stderr|unix:<path>|<file>] [-t ms] [-z none|narrow|for] [-P text|binary] [path]\n", argv[0]);
+            MPI_Finalize();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Windows are split up front, so they only go with the static schedule. */
+    if (SHARED_WINDOWS && SCHEDULE != SCHEDULE_STATIC)
+    {
+        if (rank == 0)
+            printf("Shared windows need the static schedule! Program exiting!\n");
+        MPI_Finalize();
+        exit(EXIT_FAILURE);
+    }
+
+    if (PREFIX_MODE != PREFIX_NONE && SUMMARY_MODE)
+    {
+        if (rank == 0)
+            printf("Summary mode does not take prefix sums! Program exiting!\n");
+        MPI_Finalize();
+        exit(EXIT_FAILURE);
+    }
+
+    /* Binary records would be mixed in with the report on stdout. */
+    report_out = PREFIX_MODE == PREFIX_BINARY ? stderr : stdout;
+
+    /* Grab file path from cmdline argument. Default to wiki_dump. */
+    char *path = WIKI_FILE_PATH;
+    if (optind < argc)
+    {
+        path = argv[optind];
+    }
 
     /* Perform some standard initialization. */
     init_vars();
 
+    /* The main node sees every stage, so it alone samples progress. */
+    struct telemetry *telemetry = NULL;
+    if (rank == 0 && telemetry_spec != NULL)
+    {
+        telemetry = telemetry_start(telemetry_spec, telemetry_interval, &progress, NULL, NULL);
+        if (telemetry == NULL)
+        {
+            printf("Attempt to open telemetry output - %s - failed! Program exiting!\n", telemetry_spec);
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+    }
+
     /* Main thread inputs scores. */
     if (rank == 0)
     {
-        input_scores();
+        input_scores(path);
+        link_batches();
     }
 
-    /* All threads wait for main thread to complete. */
-    MPI_Barrier(MPI_COMM_WORLD);
-
-    /* Broadcast num of batches read to all threads, used to initalize 2D arrays. */
+    /* Broadcast batch and line counts, and each batch's width, to all threads, used to size their batches. */
     MPI_Bcast(&NUM_BATCHES_READ, 1, MPI_INT, 0, MPI_COMM_WORLD);
-
-    /* Initialize 2D arrays on all threads that are not main thread. */
+    MPI_Bcast(&NUM_LINES_READ, 1, MPI_INT, 0, MPI_COMM_WORLD);
     if (rank != 0)
+        batch_wide = (char *)calloc(NUM_BATCHES_READ + 1, sizeof(char));
+    MPI_Bcast(batch_wide, NUM_BATCHES_READ, MPI_CHAR, 0, MPI_COMM_WORLD);
+
+    pack_buf = (unsigned char *)malloc(pack_bound(MAX_ENTRIES_PER_READ + 1));
+
+    /* With one node there is nobody to hand work to, so it scores everything itself. */
+    double phase_start = MPI_Wtime();
+    summary_init(&partial, SUMMARY_K);
+    if (SHARED_WINDOWS)
     {
-        line_scores = (long **)malloc(NUM_BATCHES_READ * sizeof(long *));
-        for (int i = 0; i < NUM_BATCHES_READ; i++)
-        {
-            line_scores[i] = (long *)malloc(MAX_ENTRIES_PER_READ * sizeof(long));
-        }
+        share_batches(rank);
+    }
+    else if (SCHEDULE == SCHEDULE_STATIC || NUM_COMPUTE_NODES == 1)
+    {
+        distribute_batches(rank);
+        compute_scores(rank);
+        collect_batches(rank);
     }
-    
-    MPI_Barrier(MPI_COMM_WORLD);
+    else
+    {
+        if (rank == 0)
+            schedule_batches();
+        else
+            work_batches();
+
+        /* Chunks come back in any order, so the main node carries the sums through them in batch order. */
+        if (PREFIX_MODE != PREFIX_NONE && rank == 0)
+            carry_sums(0, NUM_BATCHES_READ, MPI_COMM_SELF);
+
+        if (SUMMARY_MODE)
+            MPI_Reduce(&partial, &totals, 1, summary_type, summary_op, 0, MPI_COMM_WORLD);
+        if (SUMMARY_MODE && rank == 0)
+            __atomic_store_n(&progress.lines_scored, (long)NUM_LINES_READ, __ATOMIC_RELAXED);
+    }
+    idle_ms = (MPI_Wtime() - phase_start) * 1000 - work_ms;
 
-    compute_scores(rank);
+    /* Counters are all longs, so the four add up as one array. */
+    MPI_Reduce(&traffic, &all_traffic, sizeof(struct pack_stats) / sizeof(long), MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
 
     if (rank == 0)
     {
         gettimeofday(&end, NULL);
         overall_elapsed = ((end.tv_sec - start.tv_sec) * 1000) + ((end.tv_usec - start.tv_usec) / 1000);
 
-        output_scores();
+        if (SUMMARY_MODE)
+            summary_print(&totals, stdout);
+        else
+            output_scores();
+        if (telemetry != NULL)
+            telemetry_stop(telemetry);
         output_performance();
     }
+    report_ranks(rank);
+
+    MPI_Op_free(&summary_op);
+    MPI_Type_free(&summary_type);
+    MPI_Comm_free(&control_comm);
+    if (SHARED_WINDOWS)
+    {
+        MPI_Win_free(&host_window);
+        if (leader_comm != MPI_COMM_NULL)
+            MPI_Comm_free(&leader_comm);
+        MPI_Comm_free(&host_comm);
+    }
 
     MPI_Finalize();
 
@@ -0,0 +1,46 @@
+#ifndef __AFFINITY_H
+#define __AFFINITY_H
+
+#include <pthread.h>
+#include <sched.h>
+
+/* Placement strategies selectable with the -a option. */
+#define AFFINITY_NONE 0    // Let the scheduler float threads (default).
+#define AFFINITY_COMPACT 1 // Fill one NUMA node before moving to the next.
+#define AFFINITY_SPREAD 2  // Round-robin across NUMA nodes.
+#define AFFINITY_LIST 3    // Explicit cpulist, assigned to input, output, then workers.
+
+// CPUs this process may run on, as detected from sched_getaffinity()
+// and the sysfs topology files.
+struct cpu_topology
+{
+    int num_cpus;                // Number of CPUs in the affinity mask.
+    int num_nodes;               // Number of NUMA nodes those CPUs span.
+    int cpus[CPU_SETSIZE];       // Allowed CPU ids in (node, package, core) order.
+    int node_of[CPU_SETSIZE];    // NUMA node of each CPU id.
+    int package_of[CPU_SETSIZE]; // Physical package (socket) of each CPU id.
+    int core_of[CPU_SETSIZE];    // Core id within the package of each CPU id.
+};
+
+// Where each pipeline stage and compute worker runs. A CPU of -1 means
+// the thread is left unpinned.
+struct placement
+{
+    int mode;
+    int input_cpu;
+    int compute_cpu;
+    int output_cpu;
+    int num_workers;
+    int worker_cpus[CPU_SETSIZE];
+};
+
+int detect_topology (struct cpu_topology *);
+int parse_affinity_mode (const char *);
+int plan_placement (struct cpu_topology *, int, const char *, int, struct placement *);
+int pin_attr_to_cpu (pthread_attr_t *, int);
+int pin_self_to_cpu (int);
+int cpu_node (struct cpu_topology *, int);
+const char *affinity_mode_name (int);
+void format_placement (struct cpu_topology *, struct placement *, char *, int);
+
+#endif
@@ -1,51 +1,107 @@
 /* Standard libraries. */
+#include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 /* Parallel libraries. */
 #include <omp.h>
-#include <pthread.h>
-#include <semaphore.h>
 
 /* Custom libraries. */
-#include "../include/queue.h"
+#include "../include/affinity.h"
+#include "../include/shards.h"
+#include "../include/sink.h"
 
 /* Custom definitions. */
 #define MAX_ENTRIES_PER_READ 10000
-
-/* For measuring performance. */
+#define MAX_IN_FLIGHT 8              // Batch slots; bounds how far reading runs ahead of writing.
+#define READ_CHUNK_SIZE (1 << 20)    // Bytes requested per read() call.
+#define INITIAL_TEXT_SIZE (4 << 20)  // Starting size of a batch's text buffer.
+#define SCORE_GRAIN 64               // Lines scored per task.
+#define FORMAT_BLOCK 256             // Lines diffed and formatted per task.
+#define NUM_FORMAT_BLOCKS ((MAX_ENTRIES_PER_READ + FORMAT_BLOCK - 1) / FORMAT_BLOCK)
+#define MAX_RECORD_LEN 48            // Longest "%d-%d: %ld\n" record, rounded up.
+#define PIPE_BUFFER_SIZE (1 << 20)   // Pipe capacity requested when streaming, so each read() gets more.
+
+/* For measuring performance. Summed over tasks, so they can exceed OVERALL. */
 double overall_elapsed, input_elapsed, compute_elapsed, output_elapsed;
 
 int NUM_COMPUTE_THREADS;        // Number of threads to compute in parallel, taken from first cmdline arg, default is 1.
-struct Queue *input_queue;      // Stores datasets that are ready to be computed with.
-struct Queue *output_queue;     // Stores datasets that are ready to be output to stdout.
-pthread_mutex_t inq_lock;       // Mutex lock to protect input_queue when multiple threads are enq/deq.
-pthread_mutex_t outq_lock;      // Mutex lock to protect output_queue when multiple threads are enq/deq.
-int input_complete_flag;        // Signals entire file has been read.
-int computation_complete_flag;  // Signals all score diffs have been calculated.
+int AFFINITY_MODE;              // Thread placement strategy, taken from -a option, default is none.
+char *affinity_list;            // Explicit cpulist when AFFINITY_MODE is AFFINITY_LIST.
+struct cpu_topology topology;   // CPUs and NUMA nodes available to this process.
+struct placement placement;     // CPU chosen for each OMP thread.
+int num_batches;                // Batches that held at least one line.
+char *sink_specs[MAX_TEE_SINKS]; // Result destinations, one per -o option, default is stdout.
+int num_sink_specs;
+struct sink *results;           // Where write tasks send records. Teed when -o is repeated.
+FILE *metrics_out;              // Where TIME and DATA lines go, set by -M option, default is stdout.
+struct shard_set shards;        // Input files, from the paths, directories and globs given.
+int RESTART_NUMBERING;          // Number each shard's lines from 0, set by -n restart; default continues on.
+char *shard_dir;                // Directory for one output file per shard, set by -O option.
 
 /* Data structure to hold batch reads. */
 struct dataset
 {
-    int line_start;
+    int shard;                                     // Index of the input file in shards.
+    int shard_end;                                 // Set on a shard's last batch, which may be empty.
+    int number_base;                               // Added to line_start when numbering records.
+    int line_start;                                // First line's index within its shard.
     int num_entries;
+    int tail_line;                                 // Set if the line after the last record is scored too.
+    char *text;                                    // Raw bytes of this batch's lines.
+    size_t text_cap;                               // Allocated size of text.
+    size_t line_offsets[MAX_ENTRIES_PER_READ + 1]; // Start of each line in text, plus one past the last.
     long line_scores[MAX_ENTRIES_PER_READ];
+    long line_diffs[MAX_ENTRIES_PER_READ];
+    char *out;                                     // Formatted records, FORMAT_BLOCK lines per slot.
+    size_t out_lens[NUM_FORMAT_BLOCKS];            // Bytes used in each slot of out.
+};
+
+/* Reader state carried from one read task to the next. */
+struct reader
+{
+    int fd;
+    int shard;          // Index of the shard being read.
+    int eof;            // Set once read() has returned 0.
+    int streaming;      // Input is a pipe, socket or terminal rather than a regular file.
+    int done;           // Set once every shard has been handed out; later batches come back empty.
+    int line_counter;   // Lines of the current shard handed out so far.
+    int number_base;    // Number given to the current shard's first line.
+    char *carry;        // Bytes read past the end of the last full batch.
+    size_t carry_len;
+    size_t carry_cap;
 };
 
+struct dataset *slots[MAX_IN_FLIGHT]; // Batch buffers, reused round-robin.
+char slot_deps[MAX_IN_FLIGHT];        // Dependence objects, one per slot.
+char reader_dep;                      // Orders read tasks.
+char writer_dep;                      // Orders write tasks.
+struct reader reader;
+
 /* Function prototypes. */
 void init_vars();
 void cleanup_vars();
 void output_performance();
-void *input_scores(void *);
-void *compute_scores(void *);
-void *output_scores(void *);
-void calc_line_diffs(int, struct dataset *); // Parallel function using OMP.
-FILE *try_open_file(char *);
-int try_close_file(FILE *);
-void safe_add_batch_to_queue(struct Queue *, pthread_mutex_t, struct dataset *);
-struct dataset *safe_remove_batch_from_queue(struct Queue *, pthread_mutex_t);
+void run_pipeline();
+void input_scores(struct dataset *);
+void compute_scores(struct dataset *);
+void calc_line_diffs(struct dataset *, struct dataset *);
+void output_scores(struct dataset *);
+long score_line(const unsigned char *, size_t);
+int format_long(char *, long);
+int try_open_file(char *);
+int try_close_file(int);
+void open_shard(int);
+struct sink *open_shard_output(struct shard *);
+int input_ready(int);
+void ensure_capacity(char **, size_t *, size_t);
+double now_ms();
 
 void init_vars()
 {
@@ -55,229 +111,548 @@ void init_vars()
     compute_elapsed = 0;
     output_elapsed = 0;
 
-    /* Initialize locks. */
-    pthread_mutex_init(&inq_lock, NULL);
-    pthread_mutex_init(&outq_lock, NULL);
-
-    /* Initialize queues. */
-    input_queue = create_queue();
-    output_queue = create_queue();
-
-    /* Initialize flags. */
-    input_complete_flag = 0;
-    computation_complete_flag = 0;
+    num_batches = 0;
+    memset(&reader, 0, sizeof(reader));
 }
 
 void cleanup_vars()
 {
-    free(input_queue);
-    free(output_queue);
-    pthread_mutex_destroy(&inq_lock);
-    pthread_mutex_destroy(&outq_lock);
+    for (int i = 0; i < MAX_IN_FLIGHT; i++)
+    {
+        free(slots[i]->text);
+        free(slots[i]->out);
+        free(slots[i]);
+    }
+    free(reader.carry);
+    for (int i = 0; i < shards.count; i++)
+        if (shards.shards[i].out != NULL)
+            sink_free(shards.shards[i].out);
+    shards_free(&shards);
+    sink_free(results);
+    if (metrics_out != stdout && metrics_out != stderr)
+        fclose(metrics_out);
 }
 
 void output_performance()
 {
-    printf ("TIME, OVERALL, %f ms\n", overall_elapsed);
-    printf ("TIME, INPUT, %f ms\n", input_elapsed);
-    printf ("TIME, COMPUTE, %f ms\n", compute_elapsed);
-    printf ("TIME, OUTPUT, %f ms\n", output_elapsed);
-
-    printf("DATA, VERSION, OpenMP\n");
-    printf("DATA, NUM OF CORES, %s\n", getenv("cpus-per-task"));
-    printf("DATA, COMP THREADS, %d\n", NUM_COMPUTE_THREADS);
+    fprintf(metrics_out, "TIME, OVERALL, %f ms\n", overall_elapsed);
+    fprintf(metrics_out, "TIME, INPUT, %f ms\n", input_elapsed);
+    fprintf(metrics_out, "TIME, COMPUTE, %f ms\n", compute_elapsed);
+    fprintf(metrics_out, "TIME, OUTPUT, %f ms\n", output_elapsed);
+
+    fprintf(metrics_out, "DATA, VERSION, OpenMP\n");
+    fprintf(metrics_out, "DATA, NUM OF CORES, %d\n", topology.num_cpus);
+    fprintf(metrics_out, "DATA, NUMA NODES, %d\n", topology.num_nodes);
+    fprintf(metrics_out, "DATA, COMP THREADS, %d\n", NUM_COMPUTE_THREADS);
+
+    char where[4096];
+    format_placement(&topology, &placement, where, sizeof(where));
+    fprintf(metrics_out, "DATA, AFFINITY, %s\n", affinity_mode_name(AFFINITY_MODE));
+    fprintf(metrics_out, "DATA, PLACEMENT, %s\n", where);
+    fprintf(metrics_out, "DATA, BATCHES IN FLIGHT, %d\n", MAX_IN_FLIGHT);
+    fprintf(metrics_out, "DATA, BATCHES, %d\n", num_batches);
+
+    shards_report(&shards, overall_elapsed, metrics_out);
+    if (shard_dir != NULL)
+    {
+        for (int i = 0; i < shards.count; i++)
+            if (shards.shards[i].out != NULL)
+                sink_report(shards.shards[i].out, metrics_out);
+    }
+    else
+        sink_report(results, metrics_out);
 
-    fflush(stdout);
+    fflush(metrics_out);
 }
 
-void *compute_scores(void *n)
+double now_ms()
 {
-    /* Initialize OMP. */
-    omp_set_num_threads(NUM_COMPUTE_THREADS);
+    return omp_get_wtime() * 1000.0;
+}
 
-    struct timeval compute_start, compute_end;
+/* Build the task graph. Runs on one thread inside the parallel region.
+ *
+ * For batch k in slot s = k % MAX_IN_FLIGHT the chain is
+ *   read(k) -> score(k) -> diff/format(k) -> write(k) -> read(k + MAX_IN_FLIGHT)
+ * with read tasks ordered on reader_dep and write tasks on writer_dep.
+ * diff/format(k) also reads slot k + 1, since a batch's last diff needs the
+ * next batch's first score. Before reusing a slot this thread waits for the
+ * slot's previous write, which bounds the number of batches in flight.
+ *
+ * A stream waits for each read before going on. A batch cut short when input
+ * paused carries its own tail line, so it is diffed and written at once
+ * instead of behind a read that may block for a long time.
+ */
+void run_pipeline()
+{
+    int k;
+    int waited = 0; // Set if the previous read was waited for, so its batch can be inspected.
 
-    while (!input_complete_flag || input_queue->count > 0)
+    for (k = 0; ; k++)
     {
-        struct dataset *b = safe_remove_batch_from_queue(input_queue, inq_lock);
+        int s = k % MAX_IN_FLIGHT;
+        int prev = (k + MAX_IN_FLIGHT - 1) % MAX_IN_FLIGHT;
 
-        if (b != NULL)
+        if (k >= MAX_IN_FLIGHT)
         {
-            /* Start compute timer. */
-            gettimeofday(&compute_start, NULL);
+            /* Wait for batch k - MAX_IN_FLIGHT to be written, running tasks meanwhile. */
+            #pragma omp taskwait depend(inout: slot_deps[s])
+        }
 
-            #pragma omp parallel
-            {
-                calc_line_diffs(omp_get_thread_num(), b);
-            }
+        /* Once input is exhausted, the batches already queued cover the rest. */
+        int done;
+        #pragma omp atomic read
+        done = reader.done;
+        if (done)
+            break;
 
-            safe_add_batch_to_queue(output_queue, outq_lock, b);
+        struct dataset *b = slots[s];
+        int tail = waited && slots[prev]->tail_line;
 
-            /* Stop compute timer and add time elapsed. */
-            gettimeofday(&compute_end, NULL);
-            compute_elapsed += ((compute_end.tv_sec - compute_start.tv_sec) * 1000) + ((compute_end.tv_usec - compute_start.tv_usec) / 1000);
-        }
-    }
+        if (tail)
+        {
+            struct dataset *p = slots[prev];
 
-    computation_complete_flag = 1;
+            #pragma omp task depend(inout: slot_deps[prev]) firstprivate(p)
+            calc_line_diffs(p, p);
 
-    pthread_exit(NULL);
-}
+            #pragma omp task depend(inout: slot_deps[prev]) depend(inout: writer_dep) firstprivate(p)
+            output_scores(p);
 
-/* Parallel function using OMP. */
-void calc_line_diffs(int myID, struct dataset *b)
-{
-    int startPos, endPos, i;
-    int local_score_diffs[MAX_ENTRIES_PER_READ - 1];
-
-    #pragma omp private(myID, startPos, endPos, i, local_score_diffs)
-    {
-        startPos = myID * (MAX_ENTRIES_PER_READ / NUM_COMPUTE_THREADS);
-        endPos = startPos + (MAX_ENTRIES_PER_READ / NUM_COMPUTE_THREADS);
+            /* Input is idle anyway; get these records out before the read blocks. */
+            #pragma omp taskwait depend(in: slot_deps[prev])
+        }
 
-        /* Protect against going outside bounds of array. */
-        if (myID == NUM_COMPUTE_THREADS - 1)
-            endPos = b->num_entries - 1;
+        #pragma omp task depend(inout: reader_dep) depend(out: slot_deps[s]) firstprivate(b)
+        input_scores(b);
 
-        for (int i = startPos; i < endPos; i++)
-            local_score_diffs[i] = b->line_scores[i] - b->line_scores[i + 1];
+        #pragma omp task depend(inout: slot_deps[s]) firstprivate(b)
+        compute_scores(b);
 
-        /* Wait for all OMP threads to finish diffs. */
-        #pragma omp barrier
+        int streaming;
+        #pragma omp atomic read
+        streaming = reader.streaming;
+        if (streaming)
+        {
+            #pragma omp taskwait depend(in: reader_dep)
+        }
+        waited = streaming;
 
-        for (i = startPos; i < endPos; i++)
+        if (k > 0 && !tail)
         {
-            b->line_scores[i] = local_score_diffs[i];
+            struct dataset *p = slots[prev];
+
+            #pragma omp task depend(inout: slot_deps[prev]) depend(in: slot_deps[s]) firstprivate(p, b)
+            calc_line_diffs(p, b);
+
+            #pragma omp task depend(inout: slot_deps[prev]) depend(inout: writer_dep) firstprivate(p)
+            output_scores(p);
         }
     }
-}
 
-void *input_scores(void *f)
-{
-    FILE *file = (FILE *)f;
+    /* Last batch created has no successor, so its last line diffs against an empty line. */
+    if (k > 0)
+    {
+        int last = (k - 1) % MAX_IN_FLIGHT;
+        struct dataset *p = slots[last];
 
-    int ch = 0;
-    int line_counter = 0;
-    long score_counter = 0;
+        #pragma omp task depend(inout: slot_deps[last]) firstprivate(p)
+        calc_line_diffs(p, NULL);
 
-    struct dataset *batch = (struct dataset *)malloc(sizeof(struct dataset));
-    batch->line_start = 0;
-    batch->num_entries = 0;
+        #pragma omp task depend(inout: slot_deps[last]) depend(inout: writer_dep) firstprivate(p)
+        output_scores(p);
+    }
 
-    struct timeval input_start, input_end;
-    gettimeofday(&input_start, NULL);
+    #pragma omp taskwait
+}
 
-    while (!feof(f))
+/* Read task. Fills b with the next MAX_ENTRIES_PER_READ lines and records
+   where each starts. Leaves b empty once the file is exhausted. */
+void input_scores(struct dataset *b)
+{
+    double start = now_ms();
+    size_t filled, scanned = 0;
+
+    b->shard = reader.shard;
+    b->shard_end = 0;
+    b->number_base = reader.number_base;
+    b->line_start = reader.line_counter;
+    b->num_entries = 0;
+    b->tail_line = 0;
+    b->line_offsets[0] = 0;
+
+    /* Start with whatever the previous read ran past. */
+    ensure_capacity(&b->text, &b->text_cap, reader.carry_len + READ_CHUNK_SIZE + 1);
+    memcpy(b->text, reader.carry, reader.carry_len);
+    filled = reader.carry_len;
+    reader.carry_len = 0;
+
+    while (1)
     {
-        int ch = fgetc(f);
-        if (ch == EOF && batch->num_entries > 0)
+        while (b->num_entries < MAX_ENTRIES_PER_READ)
         {
-            /* Add partial batch to queue. */
-            safe_add_batch_to_queue(input_queue, inq_lock, batch);
+            char *nl = (char *)memchr(b->text + scanned, '\n', filled - scanned);
+            if (nl == NULL)
+            {
+                scanned = filled;
+                break;
+            }
+            scanned = (size_t)(nl - b->text) + 1;
+            b->line_offsets[++b->num_entries] = scanned;
         }
-        else if (ch == '\n')
+
+        /* When a stream has nothing more ready, pass on the lines already
+           complete rather than wait for a full batch. */
+        int stalled = reader.streaming && !reader.eof && b->num_entries > 1 && !input_ready(reader.fd);
+
+        if (b->num_entries == MAX_ENTRIES_PER_READ || stalled)
         {
-            batch->line_scores[(line_counter++) % MAX_ENTRIES_PER_READ] = score_counter;
-            batch->num_entries += 1;
-            score_counter = 0;
-            if (line_counter % MAX_ENTRIES_PER_READ == 0)
+            /* A paused batch keeps its last line as a tail for the final diff,
+               and that line also starts the next batch. */
+            if (stalled)
             {
-                /* Add full batch to queue. */
-                safe_add_batch_to_queue(input_queue, inq_lock, batch);
-
-                /* Prep a new batch. */
-                batch = (struct dataset *)malloc(sizeof(struct dataset));
-                batch->line_start = line_counter;
-                batch->num_entries = 0;
-
-                /* Add time to read batch. */
-                gettimeofday(&input_end, NULL);
-                input_elapsed += ((input_end.tv_sec - input_start.tv_sec) * 1000) + ((input_end.tv_usec - input_start.tv_usec) / 1000);
-                gettimeofday(&input_start, NULL);
+                b->num_entries--;
+                b->tail_line = 1;
             }
+
+            /* Keep bytes past the last line for the next read task. */
+            ensure_capacity(&reader.carry, &reader.carry_cap, filled - b->line_offsets[b->num_entries]);
+            reader.carry_len = filled - b->line_offsets[b->num_entries];
+            memcpy(reader.carry, b->text + b->line_offsets[b->num_entries], reader.carry_len);
+            break;
+        }
+
+        if (reader.eof)
+            break;
+
+        ensure_capacity(&b->text, &b->text_cap, filled + READ_CHUNK_SIZE + 1);
+        ssize_t n = read(reader.fd, b->text + filled, READ_CHUNK_SIZE);
+        if (n < 0)
+            perror("read");
+        if (n <= 0)
+        {
+            reader.eof = 1;
+
+            /* Treat an unterminated last line as a complete line. */
+            if (filled > b->line_offsets[b->num_entries])
+                b->text[filled++] = '\n';
+            continue;
+        }
+        filled += (size_t)n;
+        shards.shards[reader.shard].bytes += n;
+    }
+
+    reader.line_counter += b->num_entries;
+    if (reader.eof && reader.carry_len == 0 && !reader.done)
+    {
+        /* This batch ends the shard, even if it is empty. Move on to the next. */
+        b->shard_end = 1;
+        shards.shards[reader.shard].lines = reader.line_counter;
+        try_close_file(reader.fd);
+
+        if (reader.shard + 1 < shards.count)
+        {
+            if (!RESTART_NUMBERING)
+                reader.number_base += reader.line_counter;
+            open_shard(reader.shard + 1);
         }
         else
         {
-            score_counter += ch;
+            #pragma omp atomic write
+            reader.done = 1;
         }
     }
+    if (b->num_entries > 0)
+    {
+        #pragma omp atomic
+        num_batches++;
+    }
 
-    /* Add time to read last batch. */
-    gettimeofday(&input_end, NULL);
-    input_elapsed += ((input_end.tv_sec - input_start.tv_sec) * 1000) + ((input_end.tv_usec - input_start.tv_usec) / 1000);
+    double elapsed = now_ms() - start;
+    #pragma omp atomic
+    input_elapsed += elapsed;
+}
 
-    /* Signal to compute threads that input is complete. */
-    input_complete_flag = 1;
+/* Score task. Splits the batch's lines into child tasks. */
+void compute_scores(struct dataset *b)
+{
+    double start = now_ms();
 
-    /* Close file stream. */
-    try_close_file(file);
+    #pragma omp taskloop grainsize(SCORE_GRAIN)
+    for (int i = 0; i < b->num_entries + b->tail_line; i++)
+    {
+        size_t begin = b->line_offsets[i];
+        b->line_scores[i] = score_line((unsigned char *)b->text + begin, b->line_offsets[i + 1] - begin - 1);
+    }
 
-    pthread_exit(NULL);
+    double elapsed = now_ms() - start;
+    #pragma omp atomic
+    compute_elapsed += elapsed;
 }
 
-void *output_scores(void *v)
+/* Diff/format task. Computes b's diffs, using next's first score for the
+   last line (0 if there is no next batch or b ends its shard, b's own tail
+   line if next is b), and renders the records. Shards are scored as if
+   each were run on its own. */
+void calc_line_diffs(struct dataset *b, struct dataset *next)
 {
-    struct timeval output_start, output_end;
+    double start = now_ms();
+    long next_first = next == b ? b->line_scores[b->num_entries]
+                    : (next != NULL && !b->shard_end && next->num_entries > 0) ? next->line_scores[0] : 0;
+    int num_blocks = (b->num_entries + FORMAT_BLOCK - 1) / FORMAT_BLOCK;
 
-    while (!computation_complete_flag || output_queue->count != 0)
+    #pragma omp taskloop grainsize(1)
+    for (int block = 0; block < num_blocks; block++)
     {
-        struct dataset *b = safe_remove_batch_from_queue(output_queue, outq_lock);
+        int startPos = block * FORMAT_BLOCK;
+        int endPos = startPos + FORMAT_BLOCK;
 
-        if (b != NULL)
-        {
-            /* Start output timer. */
-            gettimeofday(&output_start, NULL);
+        /* Protect against going outside bounds of array. */
+        if (endPos > b->num_entries)
+            endPos = b->num_entries;
+        int diffEnd = endPos < b->num_entries - 1 ? endPos : b->num_entries - 1;
 
-            for (int i = b->line_start; i < b->line_start + MAX_ENTRIES_PER_READ; i++)
-            {
-                printf("%d-%d: %ld\n", i, i + 1, b->line_scores[i % MAX_ENTRIES_PER_READ]);
-            }
+        const long *scores = b->line_scores;
+        long *diffs = b->line_diffs;
 
-            /* Cleanup. No longer need dataset. */
-            free(b);
+        #pragma omp simd
+        for (int i = startPos; i < diffEnd; i++)
+            diffs[i] = scores[i] - scores[i + 1];
 
-            /* Stop output timer and add time elapsed. */
-            gettimeofday(&output_end, NULL);
-            output_elapsed += ((output_end.tv_sec - output_start.tv_sec) * 1000) + ((output_end.tv_usec - output_start.tv_usec) / 1000);
+        if (endPos == b->num_entries)
+            diffs[endPos - 1] = scores[endPos - 1] - next_first;
+
+        char *p = b->out + (size_t)startPos * MAX_RECORD_LEN;
+        for (int i = startPos; i < endPos; i++)
+        {
+            int line = b->number_base + b->line_start + i;
+            p += format_long(p, line);
+            *p++ = '-';
+            p += format_long(p, (long)line + 1);
+            *p++ = ':';
+            *p++ = ' ';
+            p += format_long(p, diffs[i]);
+            *p++ = '\n';
         }
+        b->out_lens[block] = (size_t)(p - (b->out + (size_t)startPos * MAX_RECORD_LEN));
     }
 
-    /* Stop output timer. */
-    gettimeofday(&output_end, NULL);
+    double elapsed = now_ms() - start;
+    #pragma omp atomic
+    compute_elapsed += elapsed;
+}
+
+/* Write task. Ordered behind the previous batch's write. Records were
+   formatted by the diff tasks, so the slots go to the kernel as they are. */
+void output_scores(struct dataset *b)
+{
+    double start = now_ms();
+    int num_blocks = (b->num_entries + FORMAT_BLOCK - 1) / FORMAT_BLOCK;
+    struct iovec iov[NUM_FORMAT_BLOCKS];
 
-    pthread_exit(NULL);
+    for (int block = 0; block < num_blocks; block++)
+    {
+        iov[block].iov_base = b->out + (size_t)block * FORMAT_BLOCK * MAX_RECORD_LEN;
+        iov[block].iov_len = b->out_lens[block];
+    }
+
+    /* With -O each shard gets its own file, opened when its first batch arrives. */
+    struct shard *sh = &shards.shards[b->shard];
+    struct sink *dst = results;
+    if (shard_dir != NULL)
+    {
+        if (sh->out == NULL)
+            sh->out = open_shard_output(sh);
+        dst = sh->out;
+    }
+    sink_writev(dst, iov, num_blocks);
+
+    if (b->shard_end)
+    {
+        if (shard_dir != NULL)
+            sink_close(dst);
+        shard_finish(sh);
+    }
+
+    double elapsed = now_ms() - start;
+    #pragma omp atomic
+    output_elapsed += elapsed;
 }
 
-FILE *try_open_file(char *path)
+long score_line(const unsigned char *p, size_t n)
 {
-    return fopen(path, "r");
+    long score = 0;
+
+    #pragma omp simd reduction(+:score)
+    for (size_t i = 0; i < n; i++)
+        score += p[i];
+
+    return score;
 }
 
-int try_close_file(FILE *f)
+/* Write v in decimal without a terminator. Returns the number of bytes. */
+int format_long(char *dst, long v)
 {
-    return fclose(f);
+    char tmp[24];
+    int n = 0, len = 0;
+    unsigned long u = (unsigned long)v;
+
+    if (v < 0)
+    {
+        dst[len++] = '-';
+        u = 0UL - u;
+    }
+
+    do
+    {
+        tmp[n++] = (char)('0' + u % 10);
+        u /= 10;
+    } while (u != 0);
+
+    while (n > 0)
+        dst[len++] = tmp[--n];
+
+    return len;
+}
+
+int try_open_file(char *path)
+{
+    if (strcmp(path, "-") == 0)
+        return STDIN_FILENO;
+    return open(path, O_RDONLY);
 }
 
-void safe_add_batch_to_queue(struct Queue *q, pthread_mutex_t l, struct dataset *b)
+int try_close_file(int fd)
 {
-    /* Grab lock to protect queue, enqueue, release lock. */
-    pthread_mutex_lock(&l);
-    enqueue(q, (void *)b);
-    pthread_mutex_unlock(&l);
+    return close(fd);
+}
+
+/* Make shard index the one the read tasks take lines from. */
+void open_shard(int index)
+{
+    struct shard *sh = &shards.shards[index];
+
+    /* Try opening file. If file does not exist, exit. */
+    int fd = try_open_file(sh->path);
+    if (fd < 0)
+    {
+        printf("Attempt to open file at - %s - failed! Program exiting!\n", sh->path);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Streams get partial batches as lines arrive, and a bigger pipe to read from. */
+    struct stat st;
+    int streaming = fstat(fd, &st) == 0 && !S_ISREG(st.st_mode);
+    if (streaming)
+        fcntl(fd, F_SETPIPE_SZ, PIPE_BUFFER_SIZE);
+
+    /* The task-building thread checks this between reads. */
+    #pragma omp atomic write
+    reader.streaming = streaming;
+
+    reader.fd = fd;
+    reader.shard = index;
+    reader.eof = 0;
+    reader.line_counter = 0;
+    shard_start(sh);
+}
+
+/* Open <shard_dir>/<file name>.scores for a shard's records. */
+struct sink *open_shard_output(struct shard *sh)
+{
+    const char *name = strrchr(sh->path, '/');
+    name = name != NULL ? name + 1 : strcmp(sh->path, "-") == 0 ? "stdin" : sh->path;
+
+    /* The sink keeps the name for its report, so the shard owns the string. */
+    size_t len = strlen(shard_dir) + strlen(name) + sizeof("/.scores");
+    sh->out_path = (char *)malloc(len);
+    snprintf(sh->out_path, len, "%s/%s.scores", shard_dir, name);
+
+    struct sink *s = sink_open(sh->out_path);
+    if (s == NULL)
+    {
+        printf("Attempt to open file at - %s - failed! Program exiting!\n", sh->out_path);
+        exit(EXIT_FAILURE);
+    }
+    return s;
 }
 
-struct dataset *safe_remove_batch_from_queue(struct Queue *q, pthread_mutex_t l)
+/* Does fd have bytes (or EOF) waiting, so read() would not block? */
+int input_ready(int fd)
 {
-    /* Grab lock to protect queue, dequeue, release lock. */
-    pthread_mutex_lock(&l);
-    struct dataset *b = (struct dataset *)dequeue(q);
-    pthread_mutex_unlock(&l);
+    struct pollfd p = { fd, POLLIN, 0 };
+    return poll(&p, 1, 0) != 0;
+}
 
-    return b;
+void ensure_capacity(char **buf, size_t *cap, size_t needed)
+{
+    if (needed <= *cap)
+        return;
+
+    /* Lines can be megabytes long, so grow geometrically. */
+    size_t new_cap = *cap * 2;
+    if (new_cap < needed)
+        new_cap = needed;
+    *buf = (char *)realloc(*buf, new_cap);
+    *cap = new_cap;
 }
 
 int main(int argc, char *argv[])
 {
+    /* Parse options. Positional arguments follow as before. */
+    int opt;
+    AFFINITY_MODE = AFFINITY_NONE;
+    num_sink_specs = 0;
+    metrics_out = stdout;
+    RESTART_NUMBERING = 0;
+    shard_dir = NULL;
+    while ((opt = getopt(argc, argv, "a:o:M:n:O:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'a':
+            AFFINITY_MODE = parse_affinity_mode(optarg);
+            affinity_list = optarg;
+            break;
+        case 'o':
+            if (num_sink_specs == MAX_TEE_SINKS)
+            {
+                printf("At most %d outputs can be given! Program exiting!\n", MAX_TEE_SINKS);
+                exit(EXIT_FAILURE);
+            }
+            sink_specs[num_sink_specs++] = optarg;
+            break;
+        case 'M':
+            if (strcmp(optarg, "stderr") == 0)
+                metrics_out = stderr;
+            else if (strcmp(optarg, "stdout") != 0)
+                metrics_out = fopen(optarg, "w");
+            if (metrics_out == NULL)
+            {
+                printf("Attempt to open file at - %s - failed! Program exiting!\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'n':
+            if (strcmp(optarg, "restart") == 0)
+                RESTART_NUMBERING = 1;
+            else if (strcmp(optarg, "continue") != 0)
+            {
+                printf("Invalid numbering - %s - given! Program exiting!\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'O':
+            shard_dir = optarg;
+            break;
+        default:
+            printf("Usage: %s [-a none|compact|spread|<cpulist>] [-o stdout|null|<file>]... [-M stdout|stderr|<file>] [-n continue|restart] [-O dir] [threads] [path|dir|glob]...\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
     /* Initialize number of compute threads. */
     if (argc > 1)
     {
@@ -287,95 +662,103 @@ int main(int argc, char *argv[])
     {
         NUM_COMPUTE_THREADS = 1;
     }
-    
-    /* Grab file path from cmdline argument. Default to wiki_dump. */
-    char *path = "/homes/dan/625/wiki_dump.txt";
+    if (NUM_COMPUTE_THREADS < 1)
+        NUM_COMPUTE_THREADS = 1;
+
+    /* Grab file paths, directories or globs from cmdline arguments. Default to wiki_dump. */
+    shards_init(&shards);
     if (argc > 2)
     {
-        path = argv[2];
+        for (int i = 2; i < argc; i++)
+        {
+            if (shards_add(&shards, argv[i]) != 0)
+            {
+                printf("No input files found for - %s - given! Program exiting!\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    else
+    {
+        shards_add(&shards, "/homes/dan/625/wiki_dump.txt");
     }
-
-    /* Perform variable initialization. */
-    init_vars();
-
-    /* Start overall timer. */
-    struct timeval overall_start, overall_end;
-    gettimeofday(&overall_start, NULL);
-
-    /* Try opening file. If file does not exist, exit. */
-    FILE *f = try_open_file(path);
-    if (f == NULL)
+    if (shards.count == 0)
     {
-        printf("Attempt to open file at - %s - failed! Program exiting!\n", path);
+        printf("No input files given! Program exiting!\n");
         exit(EXIT_FAILURE);
     }
 
-    /* Thread initialization. */
-    void *in_status, *comp_status, *out_status;
-    int in_ret_code, comp_ret_code, out_ret_code;
-    pthread_t input_thread, compute_thread, output_thread;
-    pthread_attr_t attr;
-
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-
-    /* Begin I/O and computation threads. */
-    in_ret_code = pthread_create(&input_thread, &attr, input_scores, (void *)f);
-    comp_ret_code = pthread_create(&compute_thread, &attr, compute_scores, NULL);
-    out_ret_code = pthread_create(&output_thread, &attr, output_scores, NULL);
+    /* Perform variable initialization. */
+    init_vars();
 
-    /* Standard error checking. */
-    if (in_ret_code)
+    /* Open the result sinks. Several -o options write the same records to each. */
+    struct sink *opened[MAX_TEE_SINKS];
+    if (num_sink_specs == 0)
+        sink_specs[num_sink_specs++] = "stdout";
+    for (int i = 0; i < num_sink_specs; i++)
     {
-        printf("ERROR: Return code from pthread_create(&input_thread) is %d.\n", in_ret_code);
-        exit(EXIT_FAILURE);
+        opened[i] = sink_open(sink_specs[i]);
+        if (opened[i] == NULL)
+        {
+            printf("Attempt to open file at - %s - failed! Program exiting!\n", sink_specs[i]);
+            exit(EXIT_FAILURE);
+        }
     }
+    results = num_sink_specs == 1 ? opened[0] : sink_tee(opened, num_sink_specs);
 
-    if (comp_ret_code)
+    /* Work out where each OMP thread should run. */
+    detect_topology(&topology);
+    if (plan_placement(&topology, AFFINITY_MODE, affinity_list, NUM_COMPUTE_THREADS, &placement) != 0)
     {
-        printf("ERROR: Return code from pthread_create(&compute_thread) is %d.\n", comp_ret_code);
+        printf("Invalid affinity - %s - given! Program exiting!\n", affinity_list);
         exit(EXIT_FAILURE);
     }
 
-    if (out_ret_code)
-    {
-        printf("ERROR: Return code from pthread_create(&output_thread) is %d.\n", out_ret_code);
-        exit(EXIT_FAILURE);
-    }
+    /* Start overall timer. */
+    struct timeval overall_start, overall_end;
+    gettimeofday(&overall_start, NULL);
 
-    /* Wait for all threads to finish. Block main thread. */
-    in_ret_code = pthread_join(input_thread, NULL);
-    comp_ret_code = pthread_join(compute_thread, NULL);
-    out_ret_code = pthread_join(output_thread, NULL);
+    /* Later shards are opened by the read task that reaches them. */
+    open_shard(0);
 
-    /* Standard error checking. */
-    if (in_ret_code)
+    /* One parallel region for the whole run. The OpenMP runtime balances
+       the tasks across threads and overlaps reading, compute and writing. */
+    #pragma omp parallel num_threads(NUM_COMPUTE_THREADS)
     {
-        printf("ERROR: Return code from pthread_create(&input_thread) is %d.\n", in_ret_code);
-        exit(EXIT_FAILURE);
-    }
+        pin_self_to_cpu(placement.worker_cpus[omp_get_thread_num()]);
 
-    if (comp_ret_code)
-    {
-        printf("ERROR: Return code from pthread_create(&compute_thread) is %d.\n", comp_ret_code);
-        exit(EXIT_FAILURE);
-    }
+        /* Each thread first-touches its share of the batch slots. */
+        #pragma omp for schedule(static, 1)
+        for (int i = 0; i < MAX_IN_FLIGHT; i++)
+        {
+            struct dataset *b = (struct dataset *)malloc(sizeof(struct dataset));
+            memset(b, 0, sizeof(struct dataset));
+            b->text_cap = INITIAL_TEXT_SIZE;
+            b->text = (char *)malloc(b->text_cap);
+            memset(b->text, 0, b->text_cap);
+            b->out = (char *)malloc((size_t)MAX_ENTRIES_PER_READ * MAX_RECORD_LEN);
+            memset(b->out, 0, (size_t)MAX_ENTRIES_PER_READ * MAX_RECORD_LEN);
+            slots[i] = b;
+        }
 
-    if (out_ret_code)
-    {
-        printf("ERROR: Return code from pthread_create(&output_thread) is %d.\n", out_ret_code);
-        exit(EXIT_FAILURE);
+        #pragma omp single
+        run_pipeline();
     }
 
+    /* Flush what the sinks still hold. The read tasks closed the files. */
+    double flush_start = now_ms();
+    sink_close(results);
+    output_elapsed += now_ms() - flush_start;
+
     /* Stop overall timer and calculate time elapsed. */
     gettimeofday(&overall_end, NULL);
     overall_elapsed = ((overall_end.tv_sec - overall_start.tv_sec) * 1000) + ((overall_end.tv_usec - overall_start.tv_usec) / 1000);
 
-    /* Perform cleanup. */
-    cleanup_vars();
-
     /* Output TIME and DATA measurements. */
     output_performance();
 
+    /* Perform cleanup. */
+    cleanup_vars();
+
     return 0;
-}
\ No newline at end of file
+}
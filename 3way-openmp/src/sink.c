@@ -0,0 +1,268 @@
+/* Output sinks for the output stage. Records are staged in a page-aligned
+   buffer and written out in SINK_BUFFER_SIZE pieces, or handed over in
+   place with sink_writev(). File sinks reserve space with fallocate()
+   ahead of the writes so the file system can lay the file out in large
+   extents, and are trimmed to size on close. */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "../include/sink.h"
+
+static double now_ms ()
+{
+    struct timeval tv;
+    gettimeofday (&tv, NULL);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+static struct sink *sink_new (int kind, int fd, const char *name)
+{
+    struct sink *s = (struct sink *) calloc (1, sizeof (struct sink));
+    s->kind = kind;
+    s->fd = fd;
+    s->name = name;
+
+    if (kind == SINK_STDOUT || kind == SINK_FILE)
+    {
+        if (posix_memalign ((void **) &s->buf, 4096, SINK_BUFFER_SIZE) != 0)
+        {
+            free (s);
+            return NULL;
+        }
+    }
+
+    return s;
+}
+
+// Open a sink from its spec: "stdout" or "-", "null", or a file path.
+// Returns NULL if the file cannot be created.
+struct sink *sink_open (const char *spec)
+{
+    if (strcmp (spec, "stdout") == 0 || strcmp (spec, "-") == 0)
+        return sink_new (SINK_STDOUT, STDOUT_FILENO, "stdout");
+    if (strcmp (spec, "null") == 0)
+        return sink_new (SINK_NULL, -1, "null");
+
+    int fd = open (spec, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return NULL;
+    return sink_new (SINK_FILE, fd, spec);
+}
+
+// A sink that copies to each of sinks[0, n). Takes ownership of them.
+struct sink *sink_tee (struct sink **sinks, int n)
+{
+    struct sink *s = sink_new (SINK_TEE, -1, "tee");
+
+    s->num_children = n < MAX_TEE_SINKS ? n : MAX_TEE_SINKS;
+    memcpy (s->children, sinks, s->num_children * sizeof (struct sink *));
+    return s;
+}
+
+// Keep a file sink's reservation ahead of the next len bytes so extents
+// are allocated in bulk.
+static void reserve (struct sink *s, long len)
+{
+    if (s->kind != SINK_FILE || s->written + len <= s->reserved)
+        return;
+
+    off_t want = s->reserved + SINK_PREALLOC_STEP;
+    while (want < s->written + len)
+        want += SINK_PREALLOC_STEP;
+    if (fallocate (s->fd, FALLOC_FL_KEEP_SIZE, s->reserved, want - s->reserved) == 0)
+        s->reserved = want;
+    else
+        s->reserved = (off_t) 1 << 62; // Not supported here; stop trying.
+}
+
+static void write_all (struct sink *s, const char *p, size_t len)
+{
+    double start = now_ms ();
+
+    reserve (s, (long) len);
+
+    while (len > 0)
+    {
+        ssize_t w = write (s->fd, p, len);
+        if (w <= 0)
+        {
+            perror ("write");
+            exit (EXIT_FAILURE);
+        }
+        p += w;
+        len -= (size_t) w;
+        s->written += w;
+    }
+
+    s->write_ms += now_ms () - start;
+}
+
+// Write iov[0, n) in order, resuming after partial writes. iov is modified.
+static void writev_all (struct sink *s, struct iovec *iov, int n)
+{
+    double start = now_ms ();
+
+    while (n > 0)
+    {
+        int count = n < IOV_MAX ? n : IOV_MAX;
+        ssize_t w = writev (s->fd, iov, count);
+
+        if (w < 0)
+        {
+            perror ("writev");
+            exit (EXIT_FAILURE);
+        }
+
+        s->written += w;
+        while (n > 0 && (size_t) w >= iov->iov_len)
+        {
+            w -= (ssize_t) iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + w;
+            iov->iov_len -= (size_t) w;
+        }
+    }
+
+    s->write_ms += now_ms () - start;
+}
+
+static void flush_buffer (struct sink *s)
+{
+    if (s->buf_len == 0)
+        return;
+
+    write_all (s, s->buf, s->buf_len);
+    s->buf_len = 0;
+}
+
+void sink_write (struct sink *s, const void *data, size_t len)
+{
+    const char *p = (const char *) data;
+
+    switch (s->kind)
+    {
+    case SINK_NULL:
+        s->bytes += (long) len;
+        return;
+
+    case SINK_TEE:
+        for (int i = 0; i < s->num_children; i++)
+            sink_write (s->children[i], data, len);
+        s->bytes += (long) len;
+        return;
+    }
+
+    while (len > 0)
+    {
+        size_t take = SINK_BUFFER_SIZE - s->buf_len;
+        if (take > len)
+            take = len;
+
+        memcpy (s->buf + s->buf_len, p, take);
+        s->buf_len += take;
+        s->bytes += (long) take;
+        p += take;
+        len -= take;
+
+        if (s->buf_len == SINK_BUFFER_SIZE)
+            flush_buffer (s);
+    }
+}
+
+// Write iov[0, n) in order without copying it into the staging buffer.
+void sink_writev (struct sink *s, const struct iovec *iov, int n)
+{
+    struct iovec local[IOV_MAX];
+    long len = 0;
+
+    for (int i = 0; i < n; i++)
+        len += (long) iov[i].iov_len;
+
+    switch (s->kind)
+    {
+    case SINK_NULL:
+        s->bytes += len;
+        return;
+
+    case SINK_TEE:
+        for (int i = 0; i < s->num_children; i++)
+            sink_writev (s->children[i], iov, n);
+        s->bytes += len;
+        return;
+    }
+
+    /* Earlier buffered bytes go first. */
+    flush_buffer (s);
+    s->bytes += len;
+
+    while (n > 0)
+    {
+        int count = n < IOV_MAX ? n : IOV_MAX;
+        memcpy (local, iov, count * sizeof (struct iovec));
+
+        long piece = 0;
+        for (int i = 0; i < count; i++)
+            piece += (long) local[i].iov_len;
+        reserve (s, piece);
+
+        writev_all (s, local, count);
+        iov += count;
+        n -= count;
+    }
+}
+
+// Flush whatever is staged and release the descriptor. Stats stay valid
+// until sink_free().
+void sink_close (struct sink *s)
+{
+    if (s->kind == SINK_TEE)
+    {
+        /* Report the slowest child's time, since every byte goes through each of them. */
+        for (int i = 0; i < s->num_children; i++)
+        {
+            sink_close (s->children[i]);
+            if (s->children[i]->write_ms > s->write_ms)
+                s->write_ms = s->children[i]->write_ms;
+        }
+        return;
+    }
+
+    flush_buffer (s);
+
+    /* Give back any reserved blocks past the end of the data. */
+    if (s->kind == SINK_FILE)
+    {
+        if (ftruncate (s->fd, s->written) != 0)
+            perror ("ftruncate");
+        close (s->fd);
+        s->fd = -1;
+    }
+}
+
+void sink_free (struct sink *s)
+{
+    for (int i = 0; i < s->num_children; i++)
+        sink_free (s->children[i]);
+    free (s->buf);
+    free (s);
+}
+
+// Print bytes and write throughput for s and, for a tee, each child.
+void sink_report (const struct sink *s, FILE *out)
+{
+    double mbps = s->write_ms > 0 ? s->bytes / (s->write_ms * 1000.0) : 0.0;
+
+    fprintf (out, "DATA, SINK, %s, %ld bytes, %.3f ms writing, %.1f MB/s\n", s->name, s->bytes, s->write_ms, mbps);
+    for (int i = 0; i < s->num_children; i++)
+        sink_report (s->children[i], out);
+}
@@ -0,0 +1,25 @@
+#ifndef __DAEMON_H
+#define __DAEMON_H
+
+#define DAEMON_MAX_REQUEST (1 << 20) // Longest working directory and argument list a client may send.
+#define DAEMON_READ_TIMEOUT_S 5      // How long a connected client has to send its request.
+#define DAEMON_MAX_JOBS 8            // Jobs a daemon runs at once; later clients wait to be taken.
+
+// One client's run, as received by the daemon. fds are the client's
+// standard input, output and error.
+struct daemon_job
+{
+    int conn;
+    int fds[3];
+    char *cwd;
+    int argc;
+    char **argv;
+    char *buf;   // Backing store for cwd and argv.
+};
+
+int daemon_listen (const char *);
+int daemon_accept (int, struct daemon_job *);
+void daemon_reply (struct daemon_job *, int);
+int daemon_submit (const char *, int, char **);
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef __KERNELS_H
+#define __KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "metrics.h"
+
+// Bounds on one text record: the "%d-%d:" prefix plus one " value" field
+// per column. A record is at most RECORD_PREFIX_LEN + n * MAX_FIELD_LEN.
+#define RECORD_PREFIX_LEN 24
+#define MAX_FIELD_LEN 22
+
+// How a column's values are written.
+#define FMT_DECIMAL 0 // long, in decimal.
+#define FMT_HEX 1     // long, as 16 hex digits.
+#define FMT_FIXED 2   // double, with three decimals.
+#define FMT_NARROW 3  // int32_t, in decimal.
+
+#define SELECT_CHUNK 256 // Values tested at a time by select_rows().
+
+// Working space rolling_stats() needs for a range of len values, read-back included.
+#define ROLLING_SCRATCH_BYTES(len) ((size_t) (len) * 4 * sizeof (long))
+
+// Builds of the hot kernels in kernels_isa.c, picked at startup.
+#define ISA_BASE 0   // Baseline x86-64, with SSE2.
+#define ISA_AVX2 1   // AVX2.
+#define ISA_AVX512 2 // AVX-512 F and BW.
+#define NUM_ISAS 3
+
+struct column
+{
+    const void *values; // long[], int32_t[] or double[] indexed by line within the batch.
+    int format;
+};
+
+// One build's kernels. The functions of the same names below call the
+// build in use.
+struct kernel_set
+{
+    scan_kernel_fn scan[ALL_METRICS + 1]; // Indexed by metric set; entry 0 is unused.
+    void (*diff_scores) (const long *, long *, int, int, int, long);
+    void (*diff_narrow) (const int32_t *, int32_t *, int, int, int, long);
+    long (*sum_scores) (const long *, int, int);
+    long (*sum_narrow) (const int32_t *, int, int);
+    int (*format_long) (char *, long);
+    size_t (*format_records) (char *, int, const struct column *, int, int, int);
+    size_t (*format_selected) (char *, int, const struct column *, int, const int *, int);
+    size_t (*format_sums) (char *, int, const long *, int, int);
+};
+
+extern const struct kernel_set kernels_base;
+extern const struct kernel_set kernels_avx2;
+extern const struct kernel_set kernels_avx512;
+
+int kernels_detect (void);
+int kernels_use (int);
+int kernels_parse_isa (const char *);
+const char *kernels_isa_name (int);
+int kernels_isa (void);
+scan_kernel_fn select_scan_kernel (int);
+
+void diff_scores (const long *, long *, int, int, int, long);
+void diff_scores_narrow (const int32_t *, int32_t *, int, int, int, long);
+void lag_diffs (const long *, const long *, long *, int, int, int, int);
+void lag_diffs_narrow (const int32_t *, const long *, long *, int, int, int, int);
+void rolling_stats (const long *, int, int, int, int, void *, double *, long *, long *, double *);
+int format_long (char *, long);
+size_t format_records (char *, int, const struct column *, int, int, int);
+size_t format_selected (char *, int, const struct column *, int, const int *, int);
+int select_rows (const long *, int, int, long, long, int, int *);
+int select_rows_narrow (const int32_t *, int, int, long, long, int, int *);
+long sum_scores (const long *, int, int);
+long sum_scores_narrow (const int32_t *, int, int);
+void prefix_scores (const long *, long *, int, int, long);
+void prefix_scores_narrow (const int32_t *, long *, int, int, long);
+size_t format_sums (char *, int, const long *, int, int);
+
+#endif
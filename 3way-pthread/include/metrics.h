@@ -0,0 +1,36 @@
+#ifndef __METRICS_H
+#define __METRICS_H
+
+#include <stddef.h>
+
+// Per-line metrics. Each one is a bit so a run can ask for several; the
+// selected set picks one specialized scan loop that computes them all in a
+// single pass over each line's bytes.
+#define METRIC_SUM 0x01        // Sum of the line's bytes (the original score).
+#define METRIC_CODEPOINTS 0x02 // Sum of the line's UTF-8 code point values.
+#define METRIC_CHARS 0x04      // Number of UTF-8 characters (non-continuation bytes).
+#define METRIC_WORDS 0x08      // Number of whitespace-separated words.
+#define METRIC_HASH 0x10       // 64-bit FNV-1a hash of the line.
+#define NUM_METRICS 5
+#define ALL_METRICS ((1 << NUM_METRICS) - 1)
+
+struct metric_info
+{
+    const char *name;
+    int flag;
+    int diffable; // Diffed against the next line. Otherwise emitted as is, in hex.
+};
+
+extern const struct metric_info metric_table[NUM_METRICS];
+
+// Scores lines [lo, hi) of text into columns[m][line] for each metric m in
+// the kernel's set. Columns of metrics outside the set are not touched.
+// With wide set every column is long[]; otherwise all but the hash's are
+// int32_t[], and the kernel returns nonzero if a score did not fit in
+// [0, INT32_MAX], leaving the caller to widen and score again.
+typedef int (*scan_kernel_fn) (const char *, const size_t *, void *const *, int, int, int);
+
+int parse_metrics (const char *);
+void format_metrics (int, char *, int);
+
+#endif
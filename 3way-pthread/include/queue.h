@@ -21,5 +21,6 @@ struct Queue *create_queue ();
 
 void enqueue (struct Queue *, void *);
 void *dequeue (struct Queue *);
+int queue_count (struct Queue *);
 
 #endif
\ No newline at end of file
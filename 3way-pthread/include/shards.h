@@ -0,0 +1,34 @@
+#ifndef __SHARDS_H
+#define __SHARDS_H
+
+#include <stdio.h>
+
+struct sink;
+
+// One input file. Times run from its first read to its last record written.
+struct shard
+{
+    char *path;          // "-" for standard input.
+    long lines;
+    long bytes;
+    double start_ms;
+    double end_ms;
+    struct sink *out;    // Per-shard output, if the caller keeps one.
+    char *out_path;      // Its file name.
+};
+
+struct shard_set
+{
+    int count;
+    int cap;
+    struct shard *shards;
+};
+
+void shards_init (struct shard_set *);
+int shards_add (struct shard_set *, int, const char *);
+void shards_free (struct shard_set *);
+void shard_start (struct shard *);
+void shard_finish (struct shard *);
+void shards_report (const struct shard_set *, double, FILE *);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef __SINK_H
+#define __SINK_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define SINK_STDOUT 0 // Buffered writes to standard output.
+#define SINK_FILE 1   // Buffered, block-aligned writes to a file preallocated ahead of them.
+#define SINK_NULL 2   // Counts bytes and drops them, to time the pipeline without output.
+#define SINK_TEE 3    // Copies everything to each of its children.
+
+#define MAX_TEE_SINKS 8
+#define SINK_BUFFER_SIZE (4 << 20)    // Bytes gathered before each write().
+#define SINK_PREALLOC_STEP (64 << 20) // Bytes reserved with fallocate() at a time.
+
+struct sink
+{
+    int kind;
+    int fd;
+    const char *name;     // "stdout", "null", "tee" or the file path.
+    char *buf;            // Page-aligned staging buffer, SINK_BUFFER_SIZE bytes.
+    size_t buf_len;
+    long bytes;           // Bytes accepted from the caller.
+    off_t written;        // Bytes handed to write() so far.
+    off_t reserved;       // File bytes preallocated so far.
+    double write_ms;      // Time spent in write() and fallocate().
+    long pwrite_us;       // Time spent in pwritev(), summed over the writing threads until close.
+    int error;            // errno of the first write that failed, 0 if none. Later writes are dropped.
+    int num_children;
+    struct sink *children[MAX_TEE_SINKS];
+};
+
+struct sink *sink_open (int, const char *, int);
+struct sink *sink_tee (struct sink **, int);
+void sink_write (struct sink *, const void *, size_t);
+void sink_writev (struct sink *, const struct iovec *, int);
+off_t sink_claim (struct sink *, long);
+void sink_pwritev (struct sink *, struct iovec *, int, off_t);
+struct sink *sink_failed (struct sink *);
+void sink_close (struct sink *);
+void sink_free (struct sink *);
+void sink_report (const struct sink *, FILE *);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef __SUMMARY_H
+#define __SUMMARY_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Largest K accepted for the top-K list. Summaries are fixed-size so they
+// can be merged in place and sent as a single MPI element.
+#define SUMMARY_MAX_TOP 1024
+
+// Log-scale histogram: bucket SUMMARY_ZERO holds 0, and bucket
+// SUMMARY_ZERO + b (or - b for negative diffs) holds magnitudes in
+// [2^(b-1), 2^b).
+#define SUMMARY_ZERO 64
+#define SUMMARY_BUCKETS (2 * SUMMARY_ZERO + 1)
+
+struct top_entry
+{
+    long value;
+    long line;
+};
+
+// Aggregate of a set of diffs. Partial summaries over disjoint lines can be
+// merged in any order and give the same result.
+struct summary
+{
+    long count;
+    long sum;
+    long min;
+    long min_line;
+    long max;
+    long max_line;
+    long histogram[SUMMARY_BUCKETS];
+    int k;
+    int per_line;                          // Values belong to one line each, not to a line and the next.
+    int num_top;
+    struct top_entry top[SUMMARY_MAX_TOP]; // Min-heap: the smallest kept jump is top[0].
+};
+
+void summary_init (struct summary *, int);
+void summary_add (struct summary *, const long *, long, int, int);
+void summary_add_narrow (struct summary *, const int32_t *, long, int, int);
+void summary_merge (struct summary *, const struct summary *);
+void summary_print (const struct summary *, FILE *);
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef __TELEMETRY_H
+#define __TELEMETRY_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+#define TELEMETRY_STDERR 0 // One line per sample on standard error.
+#define TELEMETRY_FILE 1   // Appended to a file, moved to <file>.1 once it reaches TELEMETRY_ROTATE_BYTES.
+#define TELEMETRY_SOCKET 2 // Sent to every client of a listening Unix socket.
+
+#define TELEMETRY_ROTATE_BYTES (1 << 20)
+#define TELEMETRY_MAX_CLIENTS 8
+#define TELEMETRY_AVERAGE_WEIGHT 0.2 // Weight of the newest sample in the moving average rates.
+
+// Bump a counter from any thread. Relaxed, so it costs an uncontended add.
+#define telemetry_add(counter, n) __atomic_fetch_add (&(counter), (n), __ATOMIC_RELAXED)
+
+// Running totals, updated by the stages and read by the sampler.
+struct telemetry_counters
+{
+    long bytes_read;
+    long lines_scored;
+    long records_written;
+};
+
+struct telemetry
+{
+    int kind;
+    const char *path;            // File or socket path.
+    int dir;                     // Directory the path is relative to, AT_FDCWD for the working directory.
+    FILE *err;                   // Where "stderr" samples go.
+    int fd;                      // File, or the listening socket.
+    long file_bytes;             // Bytes in the current file, for rotation.
+    int clients[TELEMETRY_MAX_CLIENTS];
+    int num_clients;
+    int interval_ms;
+    struct telemetry_counters *counters;
+    const int *input_depth;      // Batches waiting for compute, or NULL if there is no such queue.
+    const int *output_depth;     // Batches waiting for output, or NULL.
+    double start_ms;
+    double last_ms;
+    struct telemetry_counters last;
+    double byte_rate_avg;
+    double line_rate_avg;
+    int samples;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_mutex_t publish_lock; // Held while a line is written.
+    pthread_cond_t cv;
+    pthread_t thread;
+};
+
+struct telemetry *telemetry_start (const char *, int, FILE *, int, struct telemetry_counters *, const int *, const int *);
+void telemetry_note (struct telemetry *, const char *);
+void telemetry_stop (struct telemetry *);
+
+#endif
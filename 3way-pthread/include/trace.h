@@ -0,0 +1,58 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+// Per-batch pipeline events, written at exit as Chrome trace-event JSON
+// for Perfetto or chrome://tracing. Built only with "make TRACE=1"; in
+// other builds the macros expand to nothing.
+
+#define TRACE_RING_EVENTS (1 << 16) // Events kept per thread; older ones are overwritten.
+#define TRACE_NAME_LEN 32
+
+#ifdef TRACE
+
+// One begin ('B'), end ('E') or instant ('i') event.
+struct trace_event
+{
+    unsigned long ticks;
+    const char *name;  // Must be a string literal, or outlive the run.
+    int batch;         // -1 if the event is not about one batch.
+    char phase;
+};
+
+// Events of one thread. Only that thread writes it, so recording takes no
+// lock; the rings are read once every thread has stopped.
+struct trace_ring
+{
+    char name[TRACE_NAME_LEN];
+    int tid;
+    unsigned long count;  // Events recorded; the last TRACE_RING_EVENTS are kept.
+    struct trace_ring *next;
+    struct trace_event events[TRACE_RING_EVENTS];
+};
+
+extern int trace_enabled;
+
+void trace_start ();
+void trace_thread_name (const char *, int);
+void trace_event (const char *, char, int);
+int trace_write (const char *);
+
+#define TRACE_START() trace_start ()
+#define TRACE_THREAD(name, id) trace_thread_name (name, id)
+#define TRACE_BEGIN(name, batch) (trace_enabled ? trace_event (name, 'B', batch) : (void) 0)
+#define TRACE_END(name, batch) (trace_enabled ? trace_event (name, 'E', batch) : (void) 0)
+#define TRACE_MARK(name, batch) (trace_enabled ? trace_event (name, 'i', batch) : (void) 0)
+#define TRACE_WRITE(path) trace_write (path)
+
+#else
+
+#define TRACE_START() ((void) 0)
+#define TRACE_THREAD(name, id) ((void) 0)
+#define TRACE_BEGIN(name, batch) ((void) 0)
+#define TRACE_END(name, batch) ((void) 0)
+#define TRACE_MARK(name, batch) ((void) 0)
+#define TRACE_WRITE(path) (-1)
+
+#endif
+
+#endif
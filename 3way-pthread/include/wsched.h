@@ -0,0 +1,100 @@
+#ifndef __WSCHED_H
+#define __WSCHED_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+// Ranges a pool thread runs for one client before it gives another
+// client with a loop under way its turn.
+#define WS_SLICE_TASKS 16
+
+// Capacity of each worker's deque. Ranges are split in half before being
+// pushed, so a deque rarely holds more than a few dozen entries.
+#define WS_DEQUE_SIZE 1024
+
+// A Chase-Lev deque of index ranges. The owning worker pushes and pops at
+// the bottom, thieves steal from the top. Each entry packs [lo, hi) into
+// one 64-bit word so it can be read and written atomically.
+struct ws_deque
+{
+    int64_t top;
+    char pad0[64 - sizeof (int64_t)];
+    int64_t bottom;
+    char pad1[64 - sizeof (int64_t)];
+    uint64_t ranges[WS_DEQUE_SIZE];
+};
+
+// Per-worker counters, reported in the run summary.
+struct ws_stats
+{
+    long tasks;          // Leaf ranges executed.
+    long items;          // Indices covered by those ranges.
+    long splits;         // Ranges split and pushed for others to steal.
+    long steal_attempts; // Times this worker looked in another deque.
+    long steals;         // Successful steals.
+    double busy_ms;      // Time spent running leaf ranges.
+    double active_ms;    // Time spent inside jobs, busy or looking for work.
+};
+
+// One pool thread. It works on one client's loop at a time, as the owner
+// of its deque in that client.
+struct ws_worker
+{
+    struct ws_pool *pool;
+    int id;
+    int cpu;
+    unsigned int seed;
+    pthread_t thread;
+} __attribute__ ((aligned (64)));
+
+// Work for one parallel loop. Ranges are split at their midpoint while
+// they hold more than one index and cost() reports more than grain_cost.
+// Without a cost function, the range length is compared to grain_cost.
+struct ws_job
+{
+    void (*run) (void *, int, int);
+    long (*cost) (void *, int, int);
+    void *ctx;
+    long grain_cost;
+    long remaining; // Indices not yet run. The job is done at zero.
+    int num_workers; // Workers 0 .. num_workers - 1 take part; the rest stay away.
+};
+
+// One user of a pool, such as one run of a daemon that runs several at
+// once. It has a deque and counters per worker and one loop at a time;
+// the thread that attached it runs its loops as worker 0.
+struct ws_client
+{
+    struct ws_pool *pool;
+    struct ws_deque *deques;   // One per worker of the pool.
+    struct ws_stats *stats;    // Each worker's counters for this client's loops.
+    struct ws_job job;
+    int active;                // Workers that take part in the next loop, at least 1.
+    unsigned int seed;         // Worker 0's, for picking steal victims.
+    int visitors;              // Pool threads inside one of its loops now. Under the pool's lock.
+    struct ws_client *next;    // Next client attached to the pool. Under the pool's lock.
+};
+
+struct ws_pool
+{
+    int num_workers;
+    struct ws_worker *workers;
+    struct ws_client *clients;  // Attached clients, in the order they attached.
+    struct ws_client *cursor;   // Client picked last; the next pick starts after it.
+    int num_clients;
+    int busy;                   // Clients with a loop under way that wants pool threads.
+    int shutdown;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;        // Signals a loop was started, or shutdown.
+    pthread_cond_t left;        // Signals a pool thread left a client.
+};
+
+struct ws_pool *ws_create (int, int *);
+struct ws_client *ws_attach (struct ws_pool *);
+void ws_parallel_for (struct ws_client *, int, int, long, long (*) (void *, int, int), void (*) (void *, int, int), void *);
+void ws_set_active (struct ws_client *, int);
+void ws_detach (struct ws_client *, struct ws_stats *);
+void ws_destroy (struct ws_pool *);
+int ws_worker_id ();
+
+#endif
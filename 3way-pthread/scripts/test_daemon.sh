@@ -0,0 +1,59 @@
+#!/bin/bash
+
+# Daemon check: a client that closes its stdout mid-job gets a failure,
+# and the daemon stays up to run the next job, whose records must match
+# a direct run's, as must those of jobs run side by side from another
+# directory. Run from 3way-pthread after "make all".
+
+cd "$(dirname "$0")/.." || exit 1
+
+work=$(mktemp -d)
+sock=$work/scorecard.sock
+trap 'kill $daemon 2>/dev/null; rm -rf "$work"' EXIT
+
+# Enough lines that the records overrun the pipe to head many times over.
+awk 'BEGIN { for (i = 0; i < 300000; i++) printf "line %d %s\n", i, substr("abcdefghijklmnopqrstuvwxyz", 1 + i % 26) }' > "$work/input.txt"
+
+./pthread -D "$sock" 2 > "$work/daemon.log" 2>&1 &
+daemon=$!
+for i in $(seq 50); do
+    [ -S "$sock" ] && break
+    sleep 0.1
+done
+
+./pthread -U "$sock" 2 "$work/input.txt" 2>/dev/null | head -1 > /dev/null
+closed=${PIPESTATUS[0]}
+if [ "$closed" -eq 0 ]; then
+    echo "FAIL: job whose stdout was closed reported success"
+    exit 1
+fi
+if ! kill -0 $daemon 2>/dev/null; then
+    echo "FAIL: daemon exited after a client closed its stdout"
+    exit 1
+fi
+
+./pthread -M /dev/null 2 "$work/input.txt" > "$work/direct.out"
+if ! ./pthread -U "$sock" -M /dev/null 2 "$work/input.txt" > "$work/daemon.out"; then
+    echo "FAIL: second job failed"
+    exit 1
+fi
+if ! cmp -s "$work/direct.out" "$work/daemon.out"; then
+    echo "FAIL: second job's records differ from a direct run's"
+    exit 1
+fi
+
+# Jobs at once, with a relative path that only resolves in the client's directory.
+self=$PWD/pthread
+runs=("-M /dev/null" "-m codepoints -l 2 -w 4,100 -M /dev/null" "-s 10")
+(cd "$work" && for i in "${!runs[@]}"; do
+    "$self" -U "$sock" ${runs[$i]} 2 input.txt > "side$i.out" &
+done; wait)
+for i in "${!runs[@]}"; do
+    ./pthread ${runs[$i]} 2 "$work/input.txt" | grep -v -E '^(DATA|TIME)' > "$work/direct.out"
+    if ! grep -v -E '^(DATA|TIME)' "$work/side$i.out" | cmp -s - "$work/direct.out"; then
+        echo "FAIL: job run alongside others with \"${runs[$i]}\" differs from a direct run"
+        exit 1
+    fi
+done
+
+echo "PASS: closed client answered with status $closed, next job and side-by-side jobs matched"
@@ -0,0 +1,48 @@
+#!/bin/bash
+
+# Window check: scores near 1e9 that differ by at most 1 must get the
+# rolling mean and stddev of a two-pass sum over each window, to within
+# the last printed digit. Run from 3way-pthread after "make all".
+
+cd "$(dirname "$0")/.." || exit 1
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# Each line is 900 U+10FFFF code points and an "a" or "b", so its
+# codepoints score is 1002699996 + 97 or + 98. The expected records are
+# worked out alongside, shifted by each window's first score.
+LC_ALL=C awk -v out="$work/input.txt" -v n=2000 -v w=16 'BEGIN {
+    pad = "\364\217\277\277"
+    while (length(pad) < 3600) pad = pad pad
+    pad = substr(pad, 1, 3600)
+    for (i = 0; i < n; i++) {
+        c = int(i / 3) % 2
+        print pad substr("ab", c + 1, 1) > out
+        v[i] = 1114111 * 900 + 97 + c
+        lo = i - w + 1 < 0 ? 0 : i - w + 1
+        t = 0
+        for (k = lo; k <= i; k++) t += v[k] - v[lo]
+        m = t / (i - lo + 1)
+        q = 0
+        for (k = lo; k <= i; k++) q += (v[k] - v[lo] - m) ^ 2
+        printf "%.3f %.3f\n", v[lo] + m, sqrt(q / (i - lo + 1))
+    }
+}' > "$work/expected.txt"
+
+for threads in 1 2; do
+    if ! ./pthread -M /dev/null -m codepoints -w 16 $threads "$work/input.txt" > "$work/records.txt"; then
+        echo "FAIL: run with $threads threads failed"
+        exit 1
+    fi
+    bad=$(awk '{ print $3, $6 }' "$work/records.txt" | paste -d' ' - "$work/expected.txt" | awk '
+        function abs(x) { return x < 0 ? -x : x }
+        abs($1 - $3) > 0.0015 || abs($2 - $4) > 0.0015 { bad++ }
+        END { print bad + 0 }')
+    if [ "$bad" -ne 0 ] || [ "$(wc -l < "$work/records.txt")" -ne 2000 ]; then
+        echo "FAIL: $bad of 2000 windows with $threads threads are off"
+        exit 1
+    fi
+done
+
+echo "PASS: rolling mean and stddev of large, nearly equal scores matched"
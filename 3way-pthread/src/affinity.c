@@ -0,0 +1,390 @@
+/* CPU topology detection and thread placement for the pipeline stages. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/affinity.h"
+
+// Read a single integer from a sysfs file. Returns fallback if missing.
+static int read_sysfs_int (const char *path, int fallback)
+{
+    int value = fallback;
+    FILE *f = fopen (path, "r");
+    if (f == NULL)
+        return fallback;
+    if (fscanf (f, "%d", &value) != 1)
+        value = fallback;
+    fclose (f);
+    return value;
+}
+
+// Parse a kernel cpulist ("0-3,8,10-11") into a set. Returns number of CPUs parsed.
+static int parse_cpulist (const char *list, cpu_set_t *set)
+{
+    int count = 0;
+    const char *p = list;
+
+    CPU_ZERO (set);
+    while (*p != '\0' && *p != '\n')
+    {
+        char *end;
+        long lo = strtol (p, &end, 10);
+        long hi = lo;
+        if (end == p)
+            return -1;
+        if (*end == '-')
+        {
+            p = end + 1;
+            hi = strtol (p, &end, 10);
+            if (end == p)
+                return -1;
+        }
+        for (long c = lo; c <= hi && c < CPU_SETSIZE; c++)
+        {
+            CPU_SET (c, set);
+            count++;
+        }
+        p = (*end == ',') ? end + 1 : end;
+    }
+
+    return count;
+}
+
+// Fill node_of[] from /sys/devices/system/node/node*/cpulist.
+static int detect_numa_nodes (struct cpu_topology *t)
+{
+    int num_nodes = 0;
+    char path[128], line[4096];
+
+    for (int node = 0; node < CPU_SETSIZE; node++)
+    {
+        snprintf (path, sizeof (path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *f = fopen (path, "r");
+        if (f == NULL)
+        {
+            /* Node ids can be sparse, but give up after a long gap. */
+            if (node > num_nodes + 64)
+                break;
+            continue;
+        }
+
+        cpu_set_t set;
+        if (fgets (line, sizeof (line), f) != NULL && parse_cpulist (line, &set) > 0)
+        {
+            for (int c = 0; c < CPU_SETSIZE; c++)
+                if (CPU_ISSET (c, &set))
+                    t->node_of[c] = node;
+        }
+        fclose (f);
+        num_nodes = node + 1;
+    }
+
+    return num_nodes > 0 ? num_nodes : 1;
+}
+
+static struct cpu_topology *sort_topology;
+
+static int compare_cpus (const void *a, const void *b)
+{
+    int x = *(const int *) a, y = *(const int *) b;
+    struct cpu_topology *t = sort_topology;
+
+    if (t->node_of[x] != t->node_of[y])
+        return t->node_of[x] - t->node_of[y];
+    if (t->package_of[x] != t->package_of[y])
+        return t->package_of[x] - t->package_of[y];
+    if (t->core_of[x] != t->core_of[y])
+        return t->core_of[x] - t->core_of[y];
+    return x - y;
+}
+
+// Read "quota period" from a cgroup v2 cpu.max file, or the v1 pair of
+// cfs files. Returns 0 if the file is missing or says "max".
+static int read_cpu_quota (const char *dir, long *quota, long *period)
+{
+    char path[4096], q[32];
+    FILE *f;
+
+    snprintf (path, sizeof (path), "%s/cpu.max", dir);
+    if ((f = fopen (path, "r")) != NULL)
+    {
+        int ok = fscanf (f, "%31s %ld", q, period) == 2 && strcmp (q, "max") != 0;
+        fclose (f);
+        *quota = ok ? atol (q) : -1;
+        return ok;
+    }
+
+    snprintf (path, sizeof (path), "%s/cpu.cfs_quota_us", dir);
+    *quota = read_sysfs_int (path, -1);
+    snprintf (path, sizeof (path), "%s/cpu.cfs_period_us", dir);
+    *period = read_sysfs_int (path, 0);
+    return *quota > 0 && *period > 0;
+}
+
+// CPUs' worth of time the cgroup CPU quota allows this process, rounded
+// up, or 0 if there is no quota. Looks in the process's own cgroup
+// directories first, then at the root of the v2 and v1 hierarchies.
+int cgroup_cpu_limit ()
+{
+    char line[4096], dir[4096];
+    long quota = -1, period = 0;
+    int found = 0;
+    FILE *f = fopen ("/proc/self/cgroup", "r");
+
+    if (f != NULL)
+    {
+        /* Lines are "id:controllers:path"; v2 has id 0 and no controllers. */
+        while (!found && fgets (line, sizeof (line), f) != NULL)
+        {
+            char *controllers = strchr (line, ':');
+            char *cgpath = controllers != NULL ? strchr (controllers + 1, ':') : NULL;
+            if (cgpath == NULL)
+                continue;
+            *cgpath++ = '\0';
+            cgpath[strcspn (cgpath, "\n")] = '\0';
+
+            if (strcmp (controllers, ":") == 0)
+                snprintf (dir, sizeof (dir), "/sys/fs/cgroup%s", cgpath);
+            else if (strstr (controllers, "cpu,") != NULL
+                     || (strlen (controllers) >= 4 && strcmp (controllers + strlen (controllers) - 4, ",cpu") == 0)
+                     || strcmp (controllers, ":cpu") == 0)
+                snprintf (dir, sizeof (dir), "/sys/fs/cgroup/cpu%s", cgpath);
+            else
+                continue;
+            found = read_cpu_quota (dir, &quota, &period);
+        }
+        fclose (f);
+    }
+    if (!found)
+        found = read_cpu_quota ("/sys/fs/cgroup", &quota, &period);
+    if (!found)
+        found = read_cpu_quota ("/sys/fs/cgroup/cpu", &quota, &period);
+
+    if (!found || quota <= 0 || period <= 0)
+        return 0;
+    return (int) ((quota + period - 1) / period);
+}
+
+// Detect the CPUs available to this process and their NUMA/socket layout.
+int detect_topology (struct cpu_topology *t)
+{
+    cpu_set_t mask;
+    char path[128];
+
+    memset (t, 0, sizeof (*t));
+    if (sched_getaffinity (0, sizeof (mask), &mask) != 0)
+        return -1;
+
+    detect_numa_nodes (t);
+
+    for (int c = 0; c < CPU_SETSIZE; c++)
+    {
+        if (!CPU_ISSET (c, &mask))
+            continue;
+
+        snprintf (path, sizeof (path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", c);
+        t->package_of[c] = read_sysfs_int (path, 0);
+        snprintf (path, sizeof (path), "/sys/devices/system/cpu/cpu%d/topology/core_id", c);
+        t->core_of[c] = read_sysfs_int (path, c);
+
+        t->cpus[t->num_cpus++] = c;
+    }
+
+    /* Count only the nodes we can actually run on. */
+    int seen[CPU_SETSIZE] = { 0 };
+    for (int i = 0; i < t->num_cpus; i++)
+    {
+        if (!seen[t->node_of[t->cpus[i]]])
+        {
+            seen[t->node_of[t->cpus[i]]] = 1;
+            t->num_nodes++;
+        }
+    }
+
+    sort_topology = t;
+    qsort (t->cpus, t->num_cpus, sizeof (int), compare_cpus);
+
+    return t->num_cpus;
+}
+
+int parse_affinity_mode (const char *s)
+{
+    if (s == NULL || strcmp (s, "none") == 0)
+        return AFFINITY_NONE;
+    if (strcmp (s, "compact") == 0)
+        return AFFINITY_COMPACT;
+    if (strcmp (s, "spread") == 0)
+        return AFFINITY_SPREAD;
+    return AFFINITY_LIST;
+}
+
+const char *affinity_mode_name (int mode)
+{
+    switch (mode)
+    {
+    case AFFINITY_COMPACT:
+        return "compact";
+    case AFFINITY_SPREAD:
+        return "spread";
+    case AFFINITY_LIST:
+        return "list";
+    default:
+        return "none";
+    }
+}
+
+// Order CPUs round-robin over NUMA nodes, keeping core order within each node.
+// Relies on t->cpus already being sorted by node.
+static void interleave_nodes (struct cpu_topology *t, int *order)
+{
+    int starts[CPU_SETSIZE], ends[CPU_SETSIZE];
+    int num_groups = 0, n = 0;
+
+    for (int i = 0; i < t->num_cpus; i++)
+    {
+        if (i == 0 || t->node_of[t->cpus[i]] != t->node_of[t->cpus[i - 1]])
+            starts[num_groups++] = i;
+        ends[num_groups - 1] = i + 1;
+    }
+
+    for (int round = 0; n < t->num_cpus; round++)
+        for (int g = 0; g < num_groups; g++)
+            if (starts[g] + round < ends[g])
+                order[n++] = t->cpus[starts[g] + round];
+}
+
+// Whether cpu is one this process may run on.
+static int in_mask (struct cpu_topology *t, long cpu)
+{
+    for (int i = 0; i < t->num_cpus; i++)
+        if (t->cpus[i] == cpu)
+            return 1;
+    return 0;
+}
+
+// Decide which CPU each stage and worker runs on. Stages are assigned in
+// the order input, output, then workers, wrapping around when there are
+// more threads than CPUs. The compute stage shares the first worker's CPU
+// so that batches it first-touches live on the workers' node.
+int plan_placement (struct cpu_topology *t, int mode, const char *list, int num_workers, struct placement *p)
+{
+    int order[CPU_SETSIZE];
+    int n = 0;
+
+    p->mode = mode;
+    p->num_workers = num_workers < CPU_SETSIZE ? num_workers : CPU_SETSIZE;
+    p->input_cpu = p->compute_cpu = p->output_cpu = -1;
+    for (int i = 0; i < p->num_workers; i++)
+        p->worker_cpus[i] = -1;
+
+    switch (mode)
+    {
+    case AFFINITY_NONE:
+        return 0;
+
+    case AFFINITY_COMPACT:
+        memcpy (order, t->cpus, t->num_cpus * sizeof (int));
+        n = t->num_cpus;
+        break;
+
+    case AFFINITY_SPREAD:
+        interleave_nodes (t, order);
+        n = t->num_cpus;
+        break;
+
+    case AFFINITY_LIST:
+    {
+        /* Keep the user's ordering rather than set order. */
+        const char *s = list;
+        while (*s != '\0' && n < CPU_SETSIZE)
+        {
+            char *end;
+            long lo = strtol (s, &end, 10), hi;
+            if (end == s)
+                return -1;
+            hi = lo;
+            if (*end == '-')
+            {
+                s = end + 1;
+                hi = strtol (s, &end, 10);
+                if (end == s)
+                    return -1;
+            }
+            if (lo < 0 || hi < lo)
+                return -1;
+            for (long c = lo; c <= hi && n < CPU_SETSIZE; c++)
+            {
+                /* A CPU outside the mask would only fail later, in pthread_create(). */
+                if (!in_mask (t, c))
+                    return -1;
+                order[n++] = (int) c;
+            }
+            s = (*end == ',') ? end + 1 : end;
+        }
+        break;
+    }
+    }
+
+    if (n == 0)
+        return -1;
+
+    p->input_cpu = order[0];
+    p->output_cpu = order[1 % n];
+    for (int i = 0; i < p->num_workers; i++)
+        p->worker_cpus[i] = order[(2 + i) % n];
+    p->compute_cpu = p->num_workers > 0 ? p->worker_cpus[0] : order[0];
+
+    return 0;
+}
+
+int pin_attr_to_cpu (pthread_attr_t *attr, int cpu)
+{
+    cpu_set_t set;
+
+    if (cpu < 0)
+        return 0;
+    CPU_ZERO (&set);
+    CPU_SET (cpu, &set);
+    return pthread_attr_setaffinity_np (attr, sizeof (set), &set);
+}
+
+int pin_self_to_cpu (int cpu)
+{
+    cpu_set_t set;
+
+    if (cpu < 0)
+        return 0;
+    CPU_ZERO (&set);
+    CPU_SET (cpu, &set);
+    return pthread_setaffinity_np (pthread_self (), sizeof (set), &set);
+}
+
+int cpu_node (struct cpu_topology *t, int cpu)
+{
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+        return -1;
+    return t->node_of[cpu];
+}
+
+// Render the placement as "input=0/n0 compute=2/n0 output=1/n0 workers=2/n0,3/n0".
+void format_placement (struct cpu_topology *t, struct placement *p, char *buf, int len)
+{
+    int used = 0;
+
+    if (p->mode == AFFINITY_NONE)
+    {
+        snprintf (buf, len, "unpinned");
+        return;
+    }
+
+    used += snprintf (buf + used, len - used, "input=%d/n%d compute=%d/n%d output=%d/n%d workers=",
+                      p->input_cpu, cpu_node (t, p->input_cpu),
+                      p->compute_cpu, cpu_node (t, p->compute_cpu),
+                      p->output_cpu, cpu_node (t, p->output_cpu));
+    for (int i = 0; i < p->num_workers && used < len; i++)
+    {
+        used += snprintf (buf + used, len - used, "%s%d/n%d", i ? "," : "",
+                          p->worker_cpus[i], cpu_node (t, p->worker_cpus[i]));
+    }
+}
@@ -0,0 +1,222 @@
+/* Job socket for the warm daemon. A client connects to a Unix domain
+   socket and sends one request: a length, then its working directory and
+   arguments as NUL-terminated strings, with its standard input, output and
+   error passed along as SCM_RIGHTS. The daemon runs the job against those
+   descriptors and answers with the exit status, so the client can hand it
+   straight back to whoever started it. */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../include/daemon.h"
+
+static int socket_addr (const char *path, struct sockaddr_un *addr)
+{
+    if (strlen (path) >= sizeof (addr->sun_path))
+        return -1;
+    memset (addr, 0, sizeof (struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    strcpy (addr->sun_path, path);
+    return 0;
+}
+
+static int read_all (int fd, void *buf, size_t len)
+{
+    char *p = (char *) buf;
+
+    while (len > 0)
+    {
+        ssize_t n = read (fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t) n;
+    }
+    return 0;
+}
+
+static int write_all (int fd, const void *buf, size_t len)
+{
+    const char *p = (const char *) buf;
+
+    while (len > 0)
+    {
+        ssize_t n = write (fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t) n;
+    }
+    return 0;
+}
+
+// Listen for clients at path. Returns the socket, or -1 on failure.
+int daemon_listen (const char *path)
+{
+    struct sockaddr_un addr;
+
+    if (socket_addr (path, &addr) != 0)
+        return -1;
+
+    /* A socket file left by an earlier daemon would make bind() fail. */
+    unlink (path);
+    int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) != 0 || listen (fd, SOMAXCONN) != 0)
+    {
+        close (fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Wait for the next client and read its request into job. Clients are
+// taken in the order they connected. Returns -1 with errno set if accept()
+// fails, as when a signal arrives, or -2 if the client sent a bad request;
+// it has been dropped.
+int daemon_accept (int listener, struct daemon_job *job)
+{
+    struct timeval timeout = { DAEMON_READ_TIMEOUT_S, 0 };
+    char control[CMSG_SPACE (3 * sizeof (int))];
+    uint32_t len;
+    struct iovec iov = { &len, sizeof (len) };
+    struct msghdr msg;
+
+    memset (job, 0, sizeof (struct daemon_job));
+    job->conn = accept4 (listener, NULL, NULL, SOCK_CLOEXEC);
+    if (job->conn < 0)
+        return -1;
+    job->fds[0] = job->fds[1] = job->fds[2] = -1;
+
+    /* A client that connects and then says nothing must not hold up the rest. */
+    setsockopt (job->conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+
+    memset (&msg, 0, sizeof (msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof (control);
+    ssize_t n = recvmsg (job->conn, &msg, MSG_CMSG_CLOEXEC);
+
+    struct cmsghdr *c = n > 0 ? CMSG_FIRSTHDR (&msg) : NULL;
+    if (c != NULL && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS
+        && c->cmsg_len == CMSG_LEN (3 * sizeof (int)))
+        memcpy (job->fds, CMSG_DATA (c), 3 * sizeof (int));
+
+    /* The length may arrive in pieces; the descriptors come with the first. */
+    if (n <= 0 || job->fds[0] < 0 || (n < (ssize_t) sizeof (len) && read_all (job->conn, (char *) &len + n, sizeof (len) - n) != 0)
+        || len == 0 || len > DAEMON_MAX_REQUEST)
+    {
+        daemon_reply (job, -1);
+        return -2;
+    }
+
+    job->buf = (char *) malloc (len + 1);
+    if (read_all (job->conn, job->buf, len) != 0)
+    {
+        daemon_reply (job, -1);
+        return -2;
+    }
+    job->buf[len] = '\0';
+
+    /* The working directory, then argv, each ending in a NUL. */
+    int count = 0;
+    for (uint32_t i = 0; i < len; i++)
+        count += job->buf[i] == '\0';
+    job->argv = (char **) malloc ((count + 1) * sizeof (char *));
+    job->cwd = job->buf;
+    for (char *p = job->buf + strlen (job->buf) + 1; p < job->buf + len; p += strlen (p) + 1)
+        job->argv[job->argc++] = p;
+    job->argv[job->argc] = NULL;
+
+    if (job->argc == 0)
+    {
+        daemon_reply (job, -1);
+        return -2;
+    }
+    return 0;
+}
+
+// Send the job's exit status, -1 for a request that was refused, and
+// release the client's descriptors and the job.
+void daemon_reply (struct daemon_job *job, int status)
+{
+    int32_t s = status;
+
+    write_all (job->conn, &s, sizeof (s));
+    for (int i = 0; i < 3; i++)
+        if (job->fds[i] >= 0)
+            close (job->fds[i]);
+    close (job->conn);
+    free (job->argv);
+    free (job->buf);
+    memset (job, 0, sizeof (struct daemon_job));
+}
+
+// Client side: run argv[0, argc) on the daemon at path with this process's
+// standard streams and working directory, and wait for it. Returns the
+// job's exit status, or -1 if the daemon cannot be reached, refused the
+// request or went away before answering.
+int daemon_submit (const char *path, int argc, char **argv)
+{
+    struct sockaddr_un addr;
+    int fds[3] = { 0, 1, 2 };
+    char control[CMSG_SPACE (sizeof (fds))];
+    char *cwd = getcwd (NULL, 0);
+    int32_t status;
+
+    if (cwd == NULL || socket_addr (path, &addr) != 0)
+        return -1;
+
+    size_t len = strlen (cwd) + 1;
+    for (int i = 0; i < argc; i++)
+        len += strlen (argv[i]) + 1;
+    if (len > DAEMON_MAX_REQUEST)
+        return -1;
+
+    char *buf = (char *) malloc (len);
+    char *p = stpcpy (buf, cwd) + 1;
+    for (int i = 0; i < argc; i++)
+        p = stpcpy (p, argv[i]) + 1;
+    free (cwd);
+
+    int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect (fd, (struct sockaddr *) &addr, sizeof (addr)) != 0)
+    {
+        free (buf);
+        return -1;
+    }
+
+    uint32_t n = (uint32_t) len;
+    struct iovec iov = { &n, sizeof (n) };
+    struct msghdr msg;
+    memset (&msg, 0, sizeof (msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof (control);
+
+    struct cmsghdr *c = CMSG_FIRSTHDR (&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN (sizeof (fds));
+    memcpy (CMSG_DATA (c), fds, sizeof (fds));
+
+    int ok = sendmsg (fd, &msg, MSG_NOSIGNAL) == (ssize_t) sizeof (n) && write_all (fd, buf, len) == 0
+             && read_all (fd, &status, sizeof (status)) == 0;
+    free (buf);
+    close (fd);
+    return ok ? status : -1;
+}
@@ -0,0 +1,325 @@
+/* Hot loops shared by the compute tasks: lags, prefix sums, rolling
+   windows and the filter predicate, plus the choice of which build of
+   the scan, diff and format kernels in kernels_isa.c runs. */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/kernels.h"
+
+// diffs[i] = scores[i] - scores[i + lag] for i in [lo, hi). Lines past the
+// end of the batch come from lookahead, the first lag scores of the next
+// batch, which is zero-filled past the end of the file.
+void lag_diffs (const long *scores, const long *lookahead, long *diffs, int num_entries, int lag, int lo, int hi)
+{
+    int end = hi < num_entries - lag ? hi : num_entries - lag;
+    int i = lo;
+
+    for (; i < end; i++)
+        diffs[i] = scores[i] - scores[i + lag];
+
+    for (; i < hi; i++)
+        diffs[i] = scores[i] - lookahead[i + lag - num_entries];
+}
+
+// As lag_diffs(), over 32-bit scores.
+void lag_diffs_narrow (const int32_t *scores, const long *lookahead, long *diffs, int num_entries, int lag, int lo, int hi)
+{
+    int end = hi < num_entries - lag ? hi : num_entries - lag;
+    int i = lo;
+
+    for (; i < end; i++)
+        diffs[i] = (long) scores[i] - scores[i + lag];
+
+    for (; i < hi; i++)
+        diffs[i] = scores[i] - lookahead[i + lag - num_entries];
+}
+
+// Mean, min, max and population stddev of the trailing window of w values
+// ending at x[i], for i in [lo, hi). x may be read back to x[first], which
+// is <= 0 and marks the start of the file; windows that would reach past it
+// are shortened.
+//
+// scratch holds ROLLING_SCRATCH_BYTES(hi - lo + w - 1) bytes for the
+// working arrays; the caller keeps one per worker so tasks never allocate.
+//
+// Mean and variance slide with the window by Welford's update, and are
+// worked out afresh, shifted by the window's first value, each time the
+// window reaches a new block of w, so rounding cannot build up and large,
+// nearly equal scores do not cancel. Min and max use the van Herk/Gil-Werman
+// scheme: with the range cut into blocks of w, every window is the union of
+// a block suffix and a block prefix, so each needs two lookups however long
+// w is.
+void rolling_stats (const long *x, int first, int w, int lo, int hi, void *scratch, double *mean, long *min, long *max,
+                    double *stddev)
+{
+    int base = lo - w + 1 > first ? lo - w + 1 : first;
+    int len = hi - base;
+    const long *v = x + base;
+
+    long *pmin = (long *) scratch;
+    long *pmax = pmin + len;
+    long *smin = pmax + len;
+    long *smax = smin + len;
+
+    /* Running min/max from the start of each block forwards... */
+    for (int j = 0; j < len; j++)
+    {
+        if (j % w == 0)
+        {
+            pmin[j] = v[j];
+            pmax[j] = v[j];
+        }
+        else
+        {
+            pmin[j] = v[j] < pmin[j - 1] ? v[j] : pmin[j - 1];
+            pmax[j] = v[j] > pmax[j - 1] ? v[j] : pmax[j - 1];
+        }
+    }
+
+    /* ...and from the end of each block backwards. */
+    for (int j = len - 1; j >= 0; j--)
+    {
+        if (j == len - 1 || j % w == w - 1)
+        {
+            smin[j] = v[j];
+            smax[j] = v[j];
+        }
+        else
+        {
+            smin[j] = v[j] < smin[j + 1] ? v[j] : smin[j + 1];
+            smax[j] = v[j] > smax[j + 1] ? v[j] : smax[j + 1];
+        }
+    }
+
+    /* The window for v[j] is v[start..j], with m its mean and m2 its sum of
+       squared deviations. Lines before lo only fill the first window. */
+    double m = 0, m2 = 0;
+    for (int j = 0; j < len; j++)
+    {
+        int start = j - w + 1 > 0 ? j - w + 1 : 0;
+        double n = (double) (j - start + 1);
+
+        if (j < w)
+        {
+            /* Growing: add v[j]. */
+            double d = (double) v[j] - m;
+            m += d / n;
+            m2 += d * ((double) v[j] - m);
+        }
+        else if (j % w != 0)
+        {
+            /* Full: v[j] takes the place of v[j - w]. */
+            double d = (double) (v[j] - v[j - w]);
+            double old = m;
+            m += d / n;
+            m2 += d * (((double) v[j] - m) + ((double) v[j - w] - old));
+        }
+        else
+        {
+            /* New block: two passes over the window, shifted by its first value. */
+            double s = 0, q = 0;
+            for (int k = start; k <= j; k++)
+                s += (double) (v[k] - v[start]);
+            s /= n;
+            for (int k = start; k <= j; k++)
+            {
+                double d = (double) (v[k] - v[start]) - s;
+                q += d * d;
+            }
+            m = (double) v[start] + s;
+            m2 = q;
+        }
+
+        if (j < lo - base)
+            continue;
+
+        int i = base + j;
+        double var = m2 / n;
+
+        mean[i] = m;
+        stddev[i] = var > 0 ? sqrt (var) : 0;
+
+        /* A shortened window starts a block, so its prefix covers it. */
+        if (j - start + 1 == w)
+        {
+            min[i] = smin[start] < pmin[j] ? smin[start] : pmin[j];
+            max[i] = smax[start] > pmax[j] ? smax[start] : pmax[j];
+        }
+        else
+        {
+            min[i] = pmin[j];
+            max[i] = pmax[j];
+        }
+    }
+}
+
+// Write to rows the indices in [lo, hi) whose value is inside [min, max],
+// or with outside set, not inside it. Returns how many there are. The
+// test is done a chunk at a time into a mask with no branches, so it
+// vectorizes; only the packing of the kept indices is serial.
+int select_rows (const long *values, int lo, int hi, long min, long max, int outside, int *rows)
+{
+    unsigned char keep[SELECT_CHUNK];
+    int n = 0;
+
+    for (int start = lo; start < hi; start += SELECT_CHUNK)
+    {
+        int len = hi - start < SELECT_CHUNK ? hi - start : SELECT_CHUNK;
+        const long *v = values + start;
+
+        for (int i = 0; i < len; i++)
+            keep[i] = (unsigned char) (((v[i] >= min) & (v[i] <= max)) ^ outside);
+
+        for (int i = 0; i < len; i++)
+        {
+            rows[n] = start + i;
+            n += keep[i];
+        }
+    }
+
+    return n;
+}
+
+// As select_rows(), over 32-bit values.
+int select_rows_narrow (const int32_t *values, int lo, int hi, long min, long max, int outside, int *rows)
+{
+    unsigned char keep[SELECT_CHUNK];
+    int n = 0;
+
+    for (int start = lo; start < hi; start += SELECT_CHUNK)
+    {
+        int len = hi - start < SELECT_CHUNK ? hi - start : SELECT_CHUNK;
+        const int32_t *v = values + start;
+
+        for (int i = 0; i < len; i++)
+            keep[i] = (unsigned char) (((v[i] >= min) & (v[i] <= max)) ^ outside);
+
+        for (int i = 0; i < len; i++)
+        {
+            rows[n] = start + i;
+            n += keep[i];
+        }
+    }
+
+    return n;
+}
+
+// sums[i] = carry + values[lo] + ... + values[i] for i in [lo, hi).
+void prefix_scores (const long *values, long *sums, int lo, int hi, long carry)
+{
+    for (int i = lo; i < hi; i++)
+    {
+        carry += values[i];
+        sums[i] = carry;
+    }
+}
+
+// As prefix_scores(), over 32-bit values.
+void prefix_scores_narrow (const int32_t *values, long *sums, int lo, int hi, long carry)
+{
+    for (int i = lo; i < hi; i++)
+    {
+        carry += values[i];
+        sums[i] = carry;
+    }
+}
+
+static const struct kernel_set *const kernel_sets[NUM_ISAS] = { &kernels_base, &kernels_avx2, &kernels_avx512 };
+static const char *const isa_names[NUM_ISAS] = { "base", "avx2", "avx512" };
+static const struct kernel_set *active_set = &kernels_base;
+static int active_isa = ISA_BASE;
+
+// The widest kernel build this CPU, and the OS, can run.
+int kernels_detect (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("avx512f") && __builtin_cpu_supports ("avx512bw"))
+        return ISA_AVX512;
+    if (__builtin_cpu_supports ("avx2"))
+        return ISA_AVX2;
+#endif
+    return ISA_BASE;
+}
+
+// Switch every kernel call to the build for isa. Returns -1, keeping the
+// current build, if this CPU cannot run it.
+int kernels_use (int isa)
+{
+    if (isa < 0 || isa >= NUM_ISAS || isa > kernels_detect ())
+        return -1;
+
+    active_set = kernel_sets[isa];
+    active_isa = isa;
+    return 0;
+}
+
+// Look up a build by name. Returns -1 if there is none.
+int kernels_parse_isa (const char *name)
+{
+    for (int isa = 0; isa < NUM_ISAS; isa++)
+        if (strcmp (name, isa_names[isa]) == 0)
+            return isa;
+    return -1;
+}
+
+const char *kernels_isa_name (int isa)
+{
+    return isa >= 0 && isa < NUM_ISAS ? isa_names[isa] : "unknown";
+}
+
+// The build in use.
+int kernels_isa (void)
+{
+    return active_isa;
+}
+
+scan_kernel_fn select_scan_kernel (int mask)
+{
+    if (mask <= 0 || mask > ALL_METRICS)
+        return NULL;
+    return active_set->scan[mask];
+}
+
+void diff_scores (const long *scores, long *diffs, int num_entries, int lo, int hi, long next_first)
+{
+    active_set->diff_scores (scores, diffs, num_entries, lo, hi, next_first);
+}
+
+void diff_scores_narrow (const int32_t *scores, int32_t *diffs, int num_entries, int lo, int hi, long next_first)
+{
+    active_set->diff_narrow (scores, diffs, num_entries, lo, hi, next_first);
+}
+
+long sum_scores (const long *values, int lo, int hi)
+{
+    return active_set->sum_scores (values, lo, hi);
+}
+
+long sum_scores_narrow (const int32_t *values, int lo, int hi)
+{
+    return active_set->sum_narrow (values, lo, hi);
+}
+
+int format_long (char *dst, long v)
+{
+    return active_set->format_long (dst, v);
+}
+
+size_t format_records (char *dst, int first_line, const struct column *columns, int num_columns, int lo, int hi)
+{
+    return active_set->format_records (dst, first_line, columns, num_columns, lo, hi);
+}
+
+size_t format_selected (char *dst, int first_line, const struct column *columns, int num_columns, const int *rows,
+                        int count)
+{
+    return active_set->format_selected (dst, first_line, columns, num_columns, rows, count);
+}
+
+size_t format_sums (char *dst, int first_line, const long *sums, int lo, int hi)
+{
+    return active_set->format_sums (dst, first_line, sums, lo, hi);
+}
@@ -0,0 +1,514 @@
+/* The hot kernels - line scanning, diffs, sums and record formatting -
+ * built once per instruction set. The Makefile compiles this file three
+ * times: for baseline x86-64, with AVX2 and with AVX-512, each time naming
+ * the table it exports with KERNEL_SET. Everything else here is static, so
+ * the copies do not clash, and kernels.c picks one at startup.
+ *
+ * Each metric contributes a step to scan_line(). scan_line() takes the
+ * metric set as a compile-time constant, so every instantiation below keeps
+ * only the steps it needs: there are no per-byte tests of which metrics are
+ * on. Metrics that look at bytes independently (sum, chars, words) share
+ * one vector loop, 64, 32 or 16 bytes wide depending on the build; code
+ * point sums and hashes need a sequential decode and share a second loop.
+ * The plain loops are left for the compiler to widen.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined __AVX2__ || defined __AVX512BW__
+#include <immintrin.h>
+#elif defined __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "../include/kernels.h"
+
+#ifndef KERNEL_SET
+#error "KERNEL_SET must name the kernel table this build exports"
+#endif
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+#define ALWAYS_INLINE inline __attribute__ ((always_inline))
+
+// Index of each metric's column, matching the order of its flag bit.
+#define COL_SUM 0
+#define COL_CODEPOINTS 1
+#define COL_CHARS 2
+#define COL_WORDS 3
+#define COL_HASH 4
+
+static ALWAYS_INLINE int is_space (unsigned char c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// Decode one UTF-8 sequence at p[i]. Malformed or truncated sequences
+// count the lead byte as its own value. Stores the length in *len.
+static ALWAYS_INLINE long decode_utf8 (const unsigned char *p, size_t i, size_t n, int *len)
+{
+    unsigned char c = p[i];
+
+    if (c >= 0xC0 && c < 0xE0 && i + 1 < n && (p[i + 1] & 0xC0) == 0x80)
+    {
+        *len = 2;
+        return ((long) (c & 0x1F) << 6) | (p[i + 1] & 0x3F);
+    }
+    if (c >= 0xE0 && c < 0xF0 && i + 2 < n && (p[i + 1] & 0xC0) == 0x80 && (p[i + 2] & 0xC0) == 0x80)
+    {
+        *len = 3;
+        return ((long) (c & 0x0F) << 12) | ((long) (p[i + 1] & 0x3F) << 6) | (p[i + 2] & 0x3F);
+    }
+    if (c >= 0xF0 && c < 0xF8 && i + 3 < n && (p[i + 1] & 0xC0) == 0x80 && (p[i + 2] & 0xC0) == 0x80
+        && (p[i + 3] & 0xC0) == 0x80)
+    {
+        *len = 4;
+        return ((long) (c & 0x07) << 18) | ((long) (p[i + 1] & 0x3F) << 12) | ((long) (p[i + 2] & 0x3F) << 6)
+               | (p[i + 3] & 0x3F);
+    }
+
+    *len = 1;
+    return c;
+}
+
+// Compute every metric in mask for one line. mask must be a constant.
+static ALWAYS_INLINE void scan_line (const unsigned char *p, size_t n, const int mask, long *vals)
+{
+    size_t i = 0;
+    long sum = 0, chars = 0, words = 0;
+    unsigned int prev_space = 1; // Start of line counts as whitespace.
+
+    if (mask & (METRIC_SUM | METRIC_CHARS | METRIC_WORDS))
+    {
+#if defined __AVX512BW__
+        const __m512i zero512 = _mm512_setzero_si512 ();
+        __m512i acc512 = zero512;
+
+        for (; i + 64 <= n; i += 64)
+        {
+            __m512i v = _mm512_loadu_si512 ((const void *) (p + i));
+
+            if (mask & METRIC_SUM)
+                acc512 = _mm512_add_epi64 (acc512, _mm512_sad_epu8 (v, zero512));
+
+            if (mask & METRIC_CHARS)
+            {
+                __mmask64 cont = _mm512_cmpeq_epi8_mask (_mm512_and_si512 (v, _mm512_set1_epi8 ((char) 0xC0)),
+                                                         _mm512_set1_epi8 ((char) 0x80));
+                chars += 64 - __builtin_popcountll (cont);
+            }
+
+            if (mask & METRIC_WORDS)
+            {
+                __mmask64 space = _mm512_cmpeq_epi8_mask (v, _mm512_set1_epi8 (' '))
+                                  | (_mm512_cmpgt_epi8_mask (v, _mm512_set1_epi8 ('\t' - 1))
+                                     & _mm512_cmplt_epi8_mask (v, _mm512_set1_epi8 ('\r' + 1)));
+                unsigned long long starts = ~space & ((space << 1) | prev_space);
+                words += __builtin_popcountll (starts);
+                prev_space = (unsigned int) (space >> 63);
+            }
+        }
+
+        if (mask & METRIC_SUM)
+            sum += _mm512_reduce_add_epi64 (acc512);
+#elif defined __AVX2__
+        const __m256i zero256 = _mm256_setzero_si256 ();
+        __m256i acc256 = zero256;
+
+        for (; i + 32 <= n; i += 32)
+        {
+            __m256i v = _mm256_loadu_si256 ((const __m256i *) (p + i));
+
+            if (mask & METRIC_SUM)
+                acc256 = _mm256_add_epi64 (acc256, _mm256_sad_epu8 (v, zero256));
+
+            if (mask & METRIC_CHARS)
+            {
+                __m256i cont = _mm256_cmpeq_epi8 (_mm256_and_si256 (v, _mm256_set1_epi8 ((char) 0xC0)),
+                                                  _mm256_set1_epi8 ((char) 0x80));
+                chars += 32 - __builtin_popcount ((unsigned int) _mm256_movemask_epi8 (cont));
+            }
+
+            if (mask & METRIC_WORDS)
+            {
+                __m256i sp = _mm256_or_si256 (_mm256_cmpeq_epi8 (v, _mm256_set1_epi8 (' ')),
+                                              _mm256_and_si256 (_mm256_cmpgt_epi8 (v, _mm256_set1_epi8 ('\t' - 1)),
+                                                                _mm256_cmpgt_epi8 (_mm256_set1_epi8 ('\r' + 1), v)));
+                unsigned int space = (unsigned int) _mm256_movemask_epi8 (sp);
+                unsigned int starts = ~space & ((space << 1) | prev_space);
+                words += __builtin_popcount (starts);
+                prev_space = space >> 31;
+            }
+        }
+
+        if (mask & METRIC_SUM)
+        {
+            __m128i half = _mm_add_epi64 (_mm256_castsi256_si128 (acc256), _mm256_extracti128_si256 (acc256, 1));
+            sum += _mm_cvtsi128_si64 (half) + _mm_cvtsi128_si64 (_mm_unpackhi_epi64 (half, half));
+        }
+#endif
+
+        /* Whatever is left of the wider loops goes 16 bytes at a time. */
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128 ();
+        __m128i acc = zero;
+
+        for (; i + 16 <= n; i += 16)
+        {
+            __m128i v = _mm_loadu_si128 ((const __m128i *) (p + i));
+
+            if (mask & METRIC_SUM)
+                acc = _mm_add_epi64 (acc, _mm_sad_epu8 (v, zero));
+
+            if (mask & METRIC_CHARS)
+            {
+                __m128i cont = _mm_cmpeq_epi8 (_mm_and_si128 (v, _mm_set1_epi8 ((char) 0xC0)), _mm_set1_epi8 ((char) 0x80));
+                chars += 16 - __builtin_popcount (_mm_movemask_epi8 (cont));
+            }
+
+            if (mask & METRIC_WORDS)
+            {
+                /* Signed compares leave bytes >= 0x80 out of the 9..13 range. */
+                __m128i sp = _mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 (' ')),
+                                           _mm_and_si128 (_mm_cmpgt_epi8 (v, _mm_set1_epi8 ('\t' - 1)),
+                                                          _mm_cmplt_epi8 (v, _mm_set1_epi8 ('\r' + 1))));
+                unsigned int space = (unsigned int) _mm_movemask_epi8 (sp);
+                unsigned int starts = ~space & ((space << 1) | prev_space) & 0xFFFF;
+                words += __builtin_popcount (starts);
+                prev_space = (space >> 15) & 1;
+            }
+        }
+
+        if (mask & METRIC_SUM)
+            sum += _mm_cvtsi128_si64 (acc) + _mm_cvtsi128_si64 (_mm_unpackhi_epi64 (acc, acc));
+#endif
+
+        for (; i < n; i++)
+        {
+            unsigned char c = p[i];
+            if (mask & METRIC_SUM)
+                sum += c;
+            if (mask & METRIC_CHARS)
+                chars += (c & 0xC0) != 0x80;
+            if (mask & METRIC_WORDS)
+            {
+                unsigned int space = is_space (c);
+                words += (!space) & prev_space;
+                prev_space = space;
+            }
+        }
+
+        if (mask & METRIC_SUM)
+            vals[COL_SUM] = sum;
+        if (mask & METRIC_CHARS)
+            vals[COL_CHARS] = chars;
+        if (mask & METRIC_WORDS)
+            vals[COL_WORDS] = words;
+    }
+
+    if (mask & (METRIC_CODEPOINTS | METRIC_HASH))
+    {
+        long codepoints = 0;
+        uint64_t hash = FNV_OFFSET_BASIS;
+
+        for (size_t j = 0; j < n;)
+        {
+            if (mask & METRIC_CODEPOINTS)
+            {
+                int len;
+                codepoints += decode_utf8 (p, j, n, &len);
+
+                /* Hash the whole sequence while its bytes are at hand. */
+                if (mask & METRIC_HASH)
+                    for (int k = 0; k < len; k++)
+                        hash = (hash ^ p[j + k]) * FNV_PRIME;
+                j += len;
+            }
+            else
+            {
+                hash = (hash ^ p[j]) * FNV_PRIME;
+                j++;
+            }
+        }
+
+        if (mask & METRIC_CODEPOINTS)
+            vals[COL_CODEPOINTS] = codepoints;
+        if (mask & METRIC_HASH)
+            vals[COL_HASH] = (long) hash;
+    }
+}
+
+// Store one line's scores: 64-bit, or 32-bit in all but the hash column.
+// Returns nonzero if a 32-bit score did not fit.
+static ALWAYS_INLINE int store_scores (void *const *columns, const int mask, int wide, int line, const long *vals)
+{
+    int overflow = 0;
+
+    for (int m = 0; m < NUM_METRICS; m++)
+    {
+        if (!(mask & (1 << m)))
+            continue;
+        if (wide || m == COL_HASH)
+            ((long *) columns[m])[line] = vals[m];
+        else
+        {
+            ((int32_t *) columns[m])[line] = (int32_t) vals[m];
+            overflow |= (unsigned long) vals[m] > INT32_MAX;
+        }
+    }
+    return overflow;
+}
+
+// Instantiate scan_line for one metric set over a range of lines.
+#define DEFINE_SCAN_KERNEL(mask)                                                                   \
+    static int scan_lines_##mask (const char *text, const size_t *line_offsets, void *const *columns, \
+                                  int wide, int lo, int hi)                                        \
+    {                                                                                              \
+        long vals[NUM_METRICS];                                                                    \
+        int overflow = 0;                                                                          \
+        for (int line = lo; line < hi; line++)                                                     \
+        {                                                                                          \
+            size_t start = line_offsets[line];                                                     \
+            scan_line ((const unsigned char *) text + start, line_offsets[line + 1] - start - 1,  \
+                       mask, vals);                                                                \
+            overflow |= store_scores (columns, mask, wide, line, vals);                            \
+        }                                                                                          \
+        return overflow;                                                                           \
+    }
+
+DEFINE_SCAN_KERNEL (1)
+DEFINE_SCAN_KERNEL (2)
+DEFINE_SCAN_KERNEL (3)
+DEFINE_SCAN_KERNEL (4)
+DEFINE_SCAN_KERNEL (5)
+DEFINE_SCAN_KERNEL (6)
+DEFINE_SCAN_KERNEL (7)
+DEFINE_SCAN_KERNEL (8)
+DEFINE_SCAN_KERNEL (9)
+DEFINE_SCAN_KERNEL (10)
+DEFINE_SCAN_KERNEL (11)
+DEFINE_SCAN_KERNEL (12)
+DEFINE_SCAN_KERNEL (13)
+DEFINE_SCAN_KERNEL (14)
+DEFINE_SCAN_KERNEL (15)
+DEFINE_SCAN_KERNEL (16)
+DEFINE_SCAN_KERNEL (17)
+DEFINE_SCAN_KERNEL (18)
+DEFINE_SCAN_KERNEL (19)
+DEFINE_SCAN_KERNEL (20)
+DEFINE_SCAN_KERNEL (21)
+DEFINE_SCAN_KERNEL (22)
+DEFINE_SCAN_KERNEL (23)
+DEFINE_SCAN_KERNEL (24)
+DEFINE_SCAN_KERNEL (25)
+DEFINE_SCAN_KERNEL (26)
+DEFINE_SCAN_KERNEL (27)
+DEFINE_SCAN_KERNEL (28)
+DEFINE_SCAN_KERNEL (29)
+DEFINE_SCAN_KERNEL (30)
+DEFINE_SCAN_KERNEL (31)
+
+// diffs[i] = scores[i] - scores[i + 1] for i in [lo, hi). The last line of
+// a batch is compared against next_first, the first score of the next batch.
+static void diff_range (const long *scores, long *diffs, int num_entries, int lo, int hi, long next_first)
+{
+    int end = hi < num_entries - 1 ? hi : num_entries - 1;
+
+    for (int i = lo; i < end; i++)
+        diffs[i] = scores[i] - scores[i + 1];
+
+    if (hi == num_entries)
+        diffs[num_entries - 1] = scores[num_entries - 1] - next_first;
+}
+
+// As diff_range(), over 32-bit scores. Scores are in [0, INT32_MAX], so
+// their differences fit; the caller widens a batch whose next_first does not.
+static void diff_range_narrow (const int32_t *scores, int32_t *diffs, int num_entries, int lo, int hi, long next_first)
+{
+    int end = hi < num_entries - 1 ? hi : num_entries - 1;
+
+    for (int i = lo; i < end; i++)
+        diffs[i] = scores[i] - scores[i + 1];
+
+    if (hi == num_entries)
+        diffs[num_entries - 1] = (int32_t) (scores[num_entries - 1] - next_first);
+}
+
+// Write v in decimal without a terminator. Returns the number of bytes.
+static int put_long (char *dst, long v)
+{
+    char tmp[24];
+    int n = 0, len = 0;
+    unsigned long u = (unsigned long) v;
+
+    if (v < 0)
+    {
+        dst[len++] = '-';
+        u = 0UL - u;
+    }
+
+    do
+    {
+        tmp[n++] = (char) ('0' + u % 10);
+        u /= 10;
+    } while (u != 0);
+
+    while (n > 0)
+        dst[len++] = tmp[--n];
+
+    return len;
+}
+
+// Write v as 16 lowercase hex digits. Returns the number of bytes.
+static int put_hex (char *dst, unsigned long v)
+{
+    static const char digits[] = "0123456789abcdef";
+
+    for (int i = 15; i >= 0; i--)
+    {
+        dst[i] = digits[v & 0xF];
+        v >>= 4;
+    }
+
+    return 16;
+}
+
+// Write v with three decimals. Returns the number of bytes.
+static int put_fixed (char *dst, double v)
+{
+    int len = 0;
+
+    /* Keep v * 1000 within a long. */
+    if (v > 9e15)
+        v = 9e15;
+    if (v < -9e15)
+        v = -9e15;
+
+    long scaled = (long) (v * 1000 + (v < 0 ? -0.5 : 0.5));
+    if (scaled < 0)
+    {
+        dst[len++] = '-';
+        scaled = -scaled;
+    }
+
+    len += put_long (dst + len, scaled / 1000);
+    dst[len++] = '.';
+    dst[len++] = (char) ('0' + scaled / 100 % 10);
+    dst[len++] = (char) ('0' + scaled / 10 % 10);
+    dst[len++] = (char) ('0' + scaled % 10);
+
+    return len;
+}
+
+// Render "line-(line+1): v0 v1 ...\n" for line i, numbering from
+// first_line, with one value from each column. Returns the bytes written.
+static inline size_t put_record (char *dst, int first_line, const struct column *columns, int num_columns, int i)
+{
+    char *p = dst;
+    int line = first_line + i;
+
+    p += put_long (p, line);
+    *p++ = '-';
+    p += put_long (p, (long) line + 1);
+    *p++ = ':';
+    for (int c = 0; c < num_columns; c++)
+    {
+        *p++ = ' ';
+        if (columns[c].format == FMT_FIXED)
+            p += put_fixed (p, ((const double *) columns[c].values)[i]);
+        else if (columns[c].format == FMT_HEX)
+            p += put_hex (p, (unsigned long) ((const long *) columns[c].values)[i]);
+        else if (columns[c].format == FMT_NARROW)
+            p += put_long (p, ((const int32_t *) columns[c].values)[i]);
+        else
+            p += put_long (p, ((const long *) columns[c].values)[i]);
+    }
+    *p++ = '\n';
+
+    return (size_t) (p - dst);
+}
+
+// Render the records of lines [lo, hi) back to back. Returns the number of
+// bytes written to dst.
+static size_t put_records (char *dst, int first_line, const struct column *columns, int num_columns, int lo, int hi)
+{
+    char *p = dst;
+
+    for (int i = lo; i < hi; i++)
+        p += put_record (p, first_line, columns, num_columns, i);
+
+    return (size_t) (p - dst);
+}
+
+// Render the records of rows[0, count) back to back.
+static size_t put_selected (char *dst, int first_line, const struct column *columns, int num_columns,
+                            const int *rows, int count)
+{
+    char *p = dst;
+
+    for (int k = 0; k < count; k++)
+        p += put_record (p, first_line, columns, num_columns, rows[k]);
+
+    return (size_t) (p - dst);
+}
+
+// Sum of values[lo, hi).
+static long sum_range (const long *values, int lo, int hi)
+{
+    long sum = 0;
+
+    for (int i = lo; i < hi; i++)
+        sum += values[i];
+
+    return sum;
+}
+
+// Sum of 32-bit values[lo, hi), in 64 bits.
+static long sum_range_narrow (const int32_t *values, int lo, int hi)
+{
+    long sum = 0;
+
+    for (int i = lo; i < hi; i++)
+        sum += values[i];
+
+    return sum;
+}
+
+// Render "line: sum\n" for lines [lo, hi), numbering from first_line.
+// Returns the bytes written.
+static size_t put_sums (char *dst, int first_line, const long *sums, int lo, int hi)
+{
+    char *p = dst;
+
+    for (int i = lo; i < hi; i++)
+    {
+        p += put_long (p, (long) first_line + i);
+        *p++ = ':';
+        *p++ = ' ';
+        p += put_long (p, sums[i]);
+        *p++ = '\n';
+    }
+
+    return (size_t) (p - dst);
+}
+
+const struct kernel_set KERNEL_SET = {
+    .scan = {
+        NULL,             scan_lines_1,  scan_lines_2,  scan_lines_3,  scan_lines_4,  scan_lines_5,
+        scan_lines_6,     scan_lines_7,  scan_lines_8,  scan_lines_9,  scan_lines_10, scan_lines_11,
+        scan_lines_12,    scan_lines_13, scan_lines_14, scan_lines_15, scan_lines_16, scan_lines_17,
+        scan_lines_18,    scan_lines_19, scan_lines_20, scan_lines_21, scan_lines_22, scan_lines_23,
+        scan_lines_24,    scan_lines_25, scan_lines_26, scan_lines_27, scan_lines_28, scan_lines_29,
+        scan_lines_30,    scan_lines_31,
+    },
+    .diff_scores = diff_range,
+    .diff_narrow = diff_range_narrow,
+    .sum_scores = sum_range,
+    .sum_narrow = sum_range_narrow,
+    .format_long = put_long,
+    .format_records = put_records,
+    .format_selected = put_selected,
+    .format_sums = put_sums,
+};
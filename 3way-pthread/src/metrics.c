@@ -0,0 +1,57 @@
+/* Line metrics: their names and flags, and parsing of -m lists. The scan
+ * loops that compute them are built per instruction set in kernels_isa.c.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../include/metrics.h"
+
+const struct metric_info metric_table[NUM_METRICS] = {
+    { "sum", METRIC_SUM, 1 },
+    { "codepoints", METRIC_CODEPOINTS, 1 },
+    { "chars", METRIC_CHARS, 1 },
+    { "words", METRIC_WORDS, 1 },
+    { "hash", METRIC_HASH, 0 },
+};
+
+// Parse a comma-separated list such as "sum,words,hash". Returns the metric
+// set, or -1 if a name is not recognised.
+int parse_metrics (const char *list)
+{
+    int mask = 0;
+    const char *p = list;
+
+    while (*p != '\0')
+    {
+        size_t len = strcspn (p, ",");
+        int found = 0;
+
+        for (int m = 0; m < NUM_METRICS; m++)
+        {
+            if (strlen (metric_table[m].name) == len && strncmp (p, metric_table[m].name, len) == 0)
+            {
+                mask |= metric_table[m].flag;
+                found = 1;
+            }
+        }
+        if (!found)
+            return -1;
+
+        p += len;
+        if (*p == ',')
+            p++;
+    }
+
+    return mask > 0 ? mask : -1;
+}
+
+void format_metrics (int mask, char *buf, int len)
+{
+    int used = 0;
+
+    buf[0] = '\0';
+    for (int m = 0; m < NUM_METRICS && used < len; m++)
+        if (mask & metric_table[m].flag)
+            used += snprintf (buf + used, len - used, "%s%s", used ? "," : "", metric_table[m].name);
+}
@@ -0,0 +1,462 @@
+/* Microbenchmarks for the building blocks of the pthread pipeline, run in
+ * isolation: the batch queues, the line scan kernels, the diff kernel,
+ * record formatting and batch allocation. Built with "make bench".
+ *
+ * Each case runs a few untimed warm-up passes, then a number of timed
+ * repetitions, and reports the median: ns and cycles per item, and bytes
+ * per second where the case moves bytes.
+ */
+
+/* Standard libraries. */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+/* Custom libraries. */
+#include "../include/kernels.h"
+#include "../include/metrics.h"
+#include "../include/queue.h"
+
+/* Custom definitions. */
+#define WARMUP_RUNS 3
+#define DEFAULT_REPS 11
+#define MAX_REPS 101
+#define SCAN_BUFFER_SIZE (16 << 20)  // Bytes of synthetic text per scan pass.
+#define QUEUE_OPS 100000             // Push/pop pairs per thread per pass.
+#define FORMAT_COUNT 100000          // Values formatted per pass.
+#define MAX_ENTRIES_PER_READ 10000   // Batch shape, as in scorecard_pthread.c.
+#define INITIAL_TEXT_SIZE (4 << 20)
+#define BATCH_POOL_SIZE 8
+
+typedef void (*bench_fn)(void *);
+
+int REPS;            // Timed repetitions per case, taken from -r option.
+const char *filter;  // Only cases whose name starts with this run, taken from first cmdline arg.
+
+/* Function prototypes. */
+double now_ns();
+uint64_t now_cycles();
+int compare_double(const void *, const void *);
+void escape(void *);
+void run_bench(const char *, const char *, bench_fn, void *, long, long);
+void bench_queue();
+void bench_scan();
+void bench_diff();
+void bench_format();
+void bench_alloc();
+
+double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+uint64_t now_cycles()
+{
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/* Make the compiler assume p is used, so work on it is not optimized away. */
+void escape(void *p)
+{
+    __asm__ volatile("" : : "r"(p) : "memory");
+}
+
+int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Time fn(ctx), which handles items items and bytes bytes per call, and
+   print the median of REPS runs after the warm-up. */
+void run_bench(const char *name, const char *param, bench_fn fn, void *ctx, long items, long bytes)
+{
+    double ns[MAX_REPS], cycles[MAX_REPS];
+
+    if (strncmp(name, filter, strlen(filter)) != 0)
+        return;
+
+    for (int i = 0; i < WARMUP_RUNS; i++)
+        fn(ctx);
+
+    for (int i = 0; i < REPS; i++)
+    {
+        double t0 = now_ns();
+        uint64_t c0 = now_cycles();
+        fn(ctx);
+        cycles[i] = (double)(now_cycles() - c0);
+        ns[i] = now_ns() - t0;
+    }
+
+    qsort(ns, REPS, sizeof(double), compare_double);
+    qsort(cycles, REPS, sizeof(double), compare_double);
+    double median = ns[REPS / 2];
+
+    printf("BENCH, %s, %s, %.3f us, %.2f ns/item, ", name, param, median / 1e3, median / items);
+#ifdef HAVE_TSC
+    printf("%.2f cycles/item", cycles[REPS / 2] / items);
+#else
+    printf("n/a cycles/item");
+#endif
+    if (bytes > 0)
+        printf(", %.1f MB/s", bytes / (median / 1e3));
+    printf("\n");
+    fflush(stdout);
+}
+
+/* Queue push/pop under contention. Every thread does QUEUE_OPS locked
+   enqueue/dequeue pairs on one shared queue, the way the stages share
+   input_queue and output_queue. */
+struct queue_ctx
+{
+    struct Queue *q;
+    pthread_mutex_t lock;
+    int threads;
+};
+
+void *queue_worker(void *v)
+{
+    struct queue_ctx *c = (struct queue_ctx *)v;
+    long token = 1;
+
+    for (int i = 0; i < QUEUE_OPS; i++)
+    {
+        pthread_mutex_lock(&c->lock);
+        enqueue(c->q, (void *)token);
+        pthread_mutex_unlock(&c->lock);
+
+        pthread_mutex_lock(&c->lock);
+        dequeue(c->q);
+        pthread_mutex_unlock(&c->lock);
+    }
+
+    return NULL;
+}
+
+void queue_pass(void *v)
+{
+    struct queue_ctx *c = (struct queue_ctx *)v;
+    pthread_t threads[16];
+
+    for (int i = 0; i < c->threads; i++)
+        pthread_create(&threads[i], NULL, queue_worker, c);
+    for (int i = 0; i < c->threads; i++)
+        pthread_join(threads[i], NULL);
+}
+
+void bench_queue()
+{
+    struct queue_ctx c;
+    char param[64];
+
+    c.q = create_queue();
+    pthread_mutex_init(&c.lock, NULL);
+
+    for (int t = 1; t <= 8; t *= 2)
+    {
+        c.threads = t;
+        snprintf(param, sizeof(param), "%d threads", t);
+        run_bench("queue", param, queue_pass, &c, 2L * QUEUE_OPS * t, 0);
+    }
+
+    pthread_mutex_destroy(&c.lock);
+    free(c.q);
+}
+
+/* Line scanning over synthetic text: printable ASCII with some multi-byte
+   UTF-8 and spaces, cut into lines of one length. */
+struct scan_ctx
+{
+    char *text;
+    size_t *line_offsets;
+    int num_lines;
+    scan_kernel_fn kernel;
+    void *columns[NUM_METRICS];
+};
+
+void scan_pass(void *v)
+{
+    struct scan_ctx *c = (struct scan_ctx *)v;
+    c->kernel(c->text, c->line_offsets, c->columns, 0, 0, c->num_lines);
+    escape(c->columns);
+}
+
+void bench_scan()
+{
+    static const int line_lengths[] = { 8, 80, 800, 8000, 80000 };
+    static const int masks[] = { METRIC_SUM, METRIC_WORDS, METRIC_CODEPOINTS, ALL_METRICS };
+    struct scan_ctx c;
+    char param[128], names[128];
+
+    c.text = (char *)malloc(SCAN_BUFFER_SIZE);
+    srand(1);
+    for (size_t i = 0; i < SCAN_BUFFER_SIZE; i++)
+    {
+        int r = rand() % 64;
+        c.text[i] = r == 0 ? ' ' : r == 1 ? (char)0xC3 : r == 2 ? (char)0xA9 : (char)('a' + r % 26);
+    }
+
+    int max_lines = SCAN_BUFFER_SIZE / line_lengths[0];
+    c.line_offsets = (size_t *)malloc((max_lines + 1) * sizeof(size_t));
+    for (int m = 0; m < NUM_METRICS; m++)
+        c.columns[m] = (long *)malloc(max_lines * sizeof(long));
+
+    for (int l = 0; l < (int)(sizeof(line_lengths) / sizeof(line_lengths[0])); l++)
+    {
+        /* Newline-terminate every line_lengths[l] bytes. */
+        int len = line_lengths[l];
+        c.num_lines = SCAN_BUFFER_SIZE / len;
+        for (int i = 0; i <= c.num_lines; i++)
+            c.line_offsets[i] = (size_t)i * len;
+        for (int i = 1; i <= c.num_lines; i++)
+            c.text[c.line_offsets[i] - 1] = '\n';
+
+        for (int k = 0; k < (int)(sizeof(masks) / sizeof(masks[0])); k++)
+        {
+            c.kernel = select_scan_kernel(masks[k]);
+            format_metrics(masks[k], names, sizeof(names));
+            for (char *p = names; *p != '\0'; p++)
+                if (*p == ',')
+                    *p = '+'; // Keep the report comma-separated.
+            snprintf(param, sizeof(param), "%d-byte lines, %s", len, names);
+            run_bench("scan", param, scan_pass, &c, c.num_lines, (long)c.num_lines * len);
+        }
+
+        /* Restore the bytes the newlines replaced, so the next length starts clean. */
+        for (int i = 1; i <= c.num_lines; i++)
+            c.text[c.line_offsets[i] - 1] = 'x';
+    }
+
+    for (int m = 0; m < NUM_METRICS; m++)
+        free(c.columns[m]);
+    free(c.line_offsets);
+    free(c.text);
+}
+
+/* The diff kernel over one batch, at several batch sizes. */
+struct diff_ctx
+{
+    long *scores;
+    long *diffs;
+    int n;
+};
+
+void diff_pass(void *v)
+{
+    struct diff_ctx *c = (struct diff_ctx *)v;
+    diff_scores(c->scores, c->diffs, c->n, 0, c->n, 0);
+    escape(c->diffs);
+}
+
+void bench_diff()
+{
+    static const int sizes[] = { 256, 10000, 1 << 20 };
+    struct diff_ctx c;
+    char param[64];
+    int max = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+
+    c.scores = (long *)malloc(max * sizeof(long));
+    c.diffs = (long *)malloc(max * sizeof(long));
+    for (int i = 0; i < max; i++)
+        c.scores[i] = rand() % 100000;
+
+    for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++)
+    {
+        c.n = sizes[s];
+        snprintf(param, sizeof(param), "%d lines", c.n);
+        run_bench("diff", param, diff_pass, &c, c.n, 2L * c.n * (long)sizeof(long));
+    }
+
+    free(c.scores);
+    free(c.diffs);
+}
+
+/* Decimal formatting of diffs: format_long() against printf, and whole
+   records as the output stage sees them. */
+struct format_ctx
+{
+    long *values;
+    char *out;
+    struct column column;
+};
+
+void format_long_pass(void *v)
+{
+    struct format_ctx *c = (struct format_ctx *)v;
+    char *p = c->out;
+
+    for (int i = 0; i < FORMAT_COUNT; i++)
+    {
+        p += format_long(p, c->values[i]);
+        *p++ = '\n';
+    }
+}
+
+void format_printf_pass(void *v)
+{
+    struct format_ctx *c = (struct format_ctx *)v;
+    char *p = c->out;
+
+    for (int i = 0; i < FORMAT_COUNT; i++)
+        p += sprintf(p, "%ld\n", c->values[i]);
+}
+
+void format_records_pass(void *v)
+{
+    struct format_ctx *c = (struct format_ctx *)v;
+    format_records(c->out, 0, &c->column, 1, 0, FORMAT_COUNT);
+}
+
+void bench_format()
+{
+    struct format_ctx c;
+
+    c.values = (long *)malloc(FORMAT_COUNT * sizeof(long));
+    c.out = (char *)malloc((size_t)FORMAT_COUNT * (RECORD_PREFIX_LEN + MAX_FIELD_LEN));
+    c.column.values = c.values;
+    c.column.format = FMT_DECIMAL;
+
+    /* Diffs are mostly small with a long tail, so mix magnitudes and signs. */
+    for (int i = 0; i < FORMAT_COUNT; i++)
+    {
+        long v = rand() % 1000;
+        for (int d = rand() % 4; d > 0; d--)
+            v = v * 1000 + rand() % 1000;
+        c.values[i] = rand() % 2 ? v : -v;
+    }
+
+    run_bench("format", "format_long", format_long_pass, &c, FORMAT_COUNT, 0);
+    run_bench("format", "sprintf", format_printf_pass, &c, FORMAT_COUNT, 0);
+    run_bench("format", "format_records", format_records_pass, &c, FORMAT_COUNT, 0);
+
+    free(c.values);
+    free(c.out);
+}
+
+/* Batch buffers: a fresh malloc and first touch each time, as before the
+   pool, against taking one from and returning it to a locked pool queue. */
+struct alloc_ctx
+{
+    struct Queue *pool;
+    pthread_mutex_t lock;
+};
+
+size_t batch_bytes()
+{
+    /* Text, line offsets, one score and one diff column per metric, and the formatted records. */
+    return INITIAL_TEXT_SIZE + (size_t)MAX_ENTRIES_PER_READ * (sizeof(size_t) + 2 * NUM_METRICS * sizeof(long)
+                                                               + RECORD_PREFIX_LEN + MAX_FIELD_LEN);
+}
+
+void alloc_fresh_pass(void *v)
+{
+    (void)v;
+    char *b = (char *)malloc(batch_bytes());
+    memset(b, 0, batch_bytes());
+    escape(b);
+    free(b);
+}
+
+void alloc_pool_pass(void *v)
+{
+    struct alloc_ctx *c = (struct alloc_ctx *)v;
+
+    for (int i = 0; i < BATCH_POOL_SIZE; i++)
+    {
+        pthread_mutex_lock(&c->lock);
+        void *b = dequeue(c->pool);
+        pthread_mutex_unlock(&c->lock);
+
+        pthread_mutex_lock(&c->lock);
+        enqueue(c->pool, b);
+        pthread_mutex_unlock(&c->lock);
+    }
+}
+
+void bench_alloc()
+{
+    struct alloc_ctx c;
+    char param[64];
+
+    c.pool = create_queue();
+    pthread_mutex_init(&c.lock, NULL);
+    for (int i = 0; i < BATCH_POOL_SIZE; i++)
+    {
+        char *b = (char *)malloc(batch_bytes());
+        memset(b, 0, batch_bytes());
+        enqueue(c.pool, b);
+    }
+
+    snprintf(param, sizeof(param), "malloc+touch %zu bytes", batch_bytes());
+    run_bench("alloc", param, alloc_fresh_pass, NULL, 1, (long)batch_bytes());
+    run_bench("alloc", "pool acquire+release", alloc_pool_pass, &c, BATCH_POOL_SIZE, 0);
+
+    void *b;
+    while ((b = dequeue(c.pool)) != NULL)
+        free(b);
+    free(c.pool);
+    pthread_mutex_destroy(&c.lock);
+}
+
+int main(int argc, char *argv[])
+{
+    /* Parse options. An optional case name prefix follows. */
+    int opt;
+    REPS = DEFAULT_REPS;
+    int isa = kernels_detect();
+    while ((opt = getopt(argc, argv, "r:I:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            REPS = (int)strtol(optarg, (char **)NULL, 10);
+            if (REPS < 1 || REPS > MAX_REPS)
+            {
+                printf("Invalid repetitions - %s - given! Program exiting!\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'I':
+            isa = kernels_parse_isa(optarg);
+            if (isa < 0 || kernels_use(isa) != 0)
+            {
+                printf("Invalid or unsupported kernel build - %s - given! Program exiting!\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            printf("Usage: %s [-r reps] [-I base|avx2|avx512] [queue|scan|diff|format|alloc]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    filter = optind < argc ? argv[optind] : "";
+    kernels_use(isa);
+
+    printf("DATA, WARMUP RUNS, %d\n", WARMUP_RUNS);
+    printf("DATA, REPS, %d\n", REPS);
+    printf("DATA, KERNELS, %s, cpu supports %s\n", kernels_isa_name(kernels_isa()), kernels_isa_name(kernels_detect()));
+    printf("DATA, NUM OF CORES, %ld\n", sysconf(_SC_NPROCESSORS_ONLN));
+
+    bench_queue();
+    bench_scan();
+    bench_diff();
+    bench_format();
+    bench_alloc();
+
+    return 0;
+}
@@ -40,8 +40,9 @@ void enqueue (struct Queue *q, void *data)
         q->rear->next = temp;
         q->rear = temp;
     }
-    
-    q->count += 1;
+
+    /* Updated under the caller's lock, but read without it by queue_count(). */
+    __atomic_add_fetch (&q->count, 1, __ATOMIC_RELAXED);
 }
 
 // Function to remove a key from given queue q
@@ -60,7 +61,17 @@ void *dequeue (struct Queue *q)
     if (q->front == NULL)
         q->rear = NULL;
 
-    q->count -= 1;
+    __atomic_sub_fetch (&q->count, 1, __ATOMIC_RELAXED);
+
+    void *data = temp->data;
+    free (temp);
+
+    return data;
+}
 
-    return temp->data;
-}
\ No newline at end of file
+// Entries in q. Safe without the queue's lock, though the answer may be
+// stale by the time the caller looks at it.
+int queue_count (struct Queue *q)
+{
+    return __atomic_load_n (&q->count, __ATOMIC_RELAXED);
+}
@@ -1,8 +1,18 @@
 /* Standard libraries. */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 /* Parallel libraries. */
 #include <pthread.h>
@@ -10,412 +20,2976 @@
 
 /* Custom libraries. */
 #include "../include/queue.h"
+#include "../include/affinity.h"
+#include "../include/kernels.h"
+#include "../include/wsched.h"
+#include "../include/metrics.h"
+#include "../include/summary.h"
+#include "../include/shards.h"
+#include "../include/sink.h"
+#include "../include/telemetry.h"
+#include "../include/trace.h"
+#include "../include/daemon.h"
 
 /* Custom definitions. */
 #define MAX_ENTRIES_PER_READ 10000
+#define BATCH_POOL_SIZE 8
+#define READ_CHUNK_SIZE (1 << 20)    // Bytes requested per read() call.
+#define INITIAL_TEXT_SIZE (4 << 20)  // Starting size of a batch's text buffer.
+#define FORMAT_BLOCK 256             // Lines diffed and formatted per task.
+#define NUM_FORMAT_BLOCKS ((MAX_ENTRIES_PER_READ + FORMAT_BLOCK - 1) / FORMAT_BLOCK)
+#define SCORE_GRAIN_BYTES (32 << 10) // Score ranges smaller than this are not split further.
+#define SCORE_LINE_COST 16           // Fixed per-line cost, so runs of empty lines still split.
+#define MAX_LAGS 8                   // Extra lag diffs allowed with -l.
+#define MAX_WINDOWS 4                // Rolling windows allowed with -w.
+#define MAX_WINDOW_LEN (1 << 16)     // Longest rolling window, in lines.
+#define PIPE_BUFFER_SIZE (1 << 20)   // Pipe capacity requested when streaming, so each read() gets more.
+#define ADAPT_INTERVAL_MS 100        // How often -A reconsiders the active worker count.
+#define ADAPT_BACKLOG 2              // Queue depth, in batches, that counts as backed up.
+#define ADAPT_MIN_GAIN 0.05          // Throughput gain a new worker must bring to be kept.
+#define ADAPT_HOLD_INTERVALS 5       // Intervals to wait after undoing a step before trying again.
+#define TELEMETRY_INTERVAL_MS 1000   // Default time between telemetry samples.
+#define ENGINE_PIPELINE 0            // Input, compute and output threads around the full worker pool.
+#define ENGINE_POOL 1                // Stages in turn on the main thread, with a small worker pool.
+#define ENGINE_FUSED 2               // Everything on the main thread; no threads are started.
+#define ENGINE_AUTO 3                // One of the above, picked by input size.
+#define ENGINE_CALIBRATE 4           // Time the engines over a range of sizes and save the thresholds.
+#define POOL_ENGINE_WORKERS 4        // Most workers the pool engine uses.
+#define FUSED_MAX_BYTES (1 << 20)    // Largest input for the fused engine, until calibrated.
+#define POOL_MAX_BYTES (16 << 20)    // Largest input for the pool engine, until calibrated.
+#define STREAM_SNIFF_MS 50           // How long auto waits on a quiet stream before taking it as long-running.
+#define CALIBRATION_REPS 3           // Runs per engine and size; the fastest counts.
+#define CALIBRATION_MAX_BYTES (64 << 20) // Largest input timed, going up by 4x from 16 kB.
+#define WRITE_GRAIN_BLOCKS 8         // Most slots one worker writes at a time with -W.
+#define PREFIX_NONE 0                // Records are diffs.
+#define PREFIX_TEXT 1                // Records are running sums, as "line: sum" text.
+#define PREFIX_BINARY 2              // Records are running sums, as native 64-bit integers.
+
+/* State shared by every run in the process. A daemon keeps it from job
+   to job, and the jobs it runs at once use it side by side. */
+struct cpu_topology topology;  // CPUs and NUMA nodes available to this process.
+struct placement placement;    // CPU chosen for each stage and compute worker.
+struct ws_pool *pool;          // Work-stealing workers, shared by every run; a run's compute thread is its worker 0.
+const char *engine_names[] = {"pipeline", "pool", "fused", "auto", "calibrate"};
+int SERVING;                   // Running jobs for the daemon, which keeps the worker pool and batches between them.
+long jobs_served;              // Jobs the daemon has taken, numbering them.
+sem_t job_slots;               // Jobs the daemon may still start before one of those running ends.
+volatile sig_atomic_t stop_serving; // Set by SIGINT or SIGTERM to shut the daemon down.
+
+/* One run's options, stages, buffers and counters. A direct run has one;
+   a daemon has one per job it is running. Every thread reaches the run it
+   is working for through run. */
+struct run
+{
+    int cwd;                       // Directory relative paths are opened from, AT_FDCWD in a direct run.
+    int fds[3];                    // The run's standard input, output and error.
+    FILE *console;                 // Messages, and the report by default: stdout in a direct run.
+    FILE *errors;                  // The run's standard error, as a stream.
+    long job_number;               // Which of the daemon's jobs this is, 0 in a direct run.
+    struct ws_client *workers;     // The run's share of the pool.
+    struct dataset *batches[BATCH_POOL_SIZE]; // The batches it took from warm_batches.
+    /* For measuring performance. */
+    double overall_elapsed, input_elapsed, compute_elapsed, output_elapsed;
+    int NUM_COMPUTE_THREADS;       // Number of threads to compute in parallel, taken from first cmdline arg, default is 1.
+    struct Queue *input_queue;     // Stores datasets that are ready to be computed with.
+    struct Queue *output_queue;    // Stores datasets that are ready to be output to stdout.
+    pthread_mutex_t inq_lock;      // Mutex lock to protect input_queue when multiple threads are enq/deq.
+    pthread_mutex_t outq_lock;     // Mutex lock to protect output_queue when multiple threads are enq/deq.
+    int input_complete_flag;       // Signals entire file has been read.
+    int computation_complete_flag; // Signals all score diffs have been calculated.
+    struct Queue *batch_pool;      // Free datasets, first-touched by the compute thread on its NUMA node.
+    pthread_mutex_t pool_lock;     // Mutex lock to protect batch_pool.
+    pthread_cond_t pool_cv;        // Signals a dataset was returned to batch_pool.
+    int AFFINITY_MODE;             // Thread placement strategy, taken from -a option, default is none.
+    char *affinity_list;           // Explicit cpulist when AFFINITY_MODE is AFFINITY_LIST.
+    int batch_pool_node;           // NUMA node the batch pool was first-touched on.
+    struct ws_stats *worker_stats; // Copy of each worker's counters for this run, taken when it leaves the pool.
+    int METRICS;                   // Metrics computed per line, taken from -m option, default is the byte sum.
+    scan_kernel_fn scan_kernel;    // Scan loop specialized for METRICS.
+    int num_columns;               // Number of metrics in METRICS, one output column each.
+    int column_metric[NUM_METRICS]; // Metric index of each output column, in metric_table order.
+    int NUM_LAGS;                  // Extra lag-k diffs of the primary metric, taken from -l option.
+    int lags[MAX_LAGS];            // The k of each extra lag column.
+    int max_lag;                   // Largest k, i.e. how many scores of the next batch are needed.
+    int NUM_WINDOWS;               // Rolling windows over the primary metric, taken from -w option.
+    int windows[MAX_WINDOWS];      // Length of each window, in lines.
+    int max_window;                // Longest window. Its last max_window - 1 scores carry over to the next batch.
+    int primary_metric;            // First diffable metric in METRICS; lags and windows are taken over it.
+    long *window_history;          // Primary scores of the max_window - 1 lines before the batch being finished.
+    int window_chunk;              // Lines per rolling-window task, at least one window long.
+    char **window_scratch;         // One rolling_stats() work area per worker, sized for the longest task.
+    size_t record_len;             // Longest record with the selected columns.
+    int SUMMARY_MODE;              // Aggregate only, with no per-line records, set by -s option.
+    int SUMMARY_K;                 // Number of largest jumps kept in summary mode, taken from -s option.
+    struct summary *partials;      // One summary per worker, merged once all batches are in.
+    struct summary totals;         // Merged summary, printed in place of the records.
+    char *sink_specs[MAX_TEE_SINKS]; // Result destinations, one per -o option, default is stdout.
+    int num_sink_specs;
+    struct sink *results;          // Where the output stage writes records. Teed when -o is repeated.
+    FILE *metrics_out;             // Where TIME and DATA lines go, set by -M option, default is stdout.
+    int STREAMING;                 // Input is a pipe, socket or terminal rather than a regular file.
+    struct shard_set shards;       // Input files, from the paths, directories and globs given.
+    int RESTART_NUMBERING;         // Number each shard's lines from 0, set by -n restart; default continues on.
+    char *shard_dir;               // Directory for one output file per shard, set by -O option.
+    int ADAPTIVE;                  // Grow and shrink the active workers with load, set by -A option.
+    int min_workers, max_workers;  // Range for the active worker count; the pool holds max_workers.
+    int active_workers;            // Workers taking part in compute jobs now.
+    int cgroup_limit;              // CPUs allowed by the cgroup CPU quota, 0 if none.
+    struct timeval run_start;      // Start of the run, for scaling timestamps.
+    char *telemetry_spec;          // Where progress samples go, set by -T option, NULL for none.
+    int telemetry_interval;        // Milliseconds between samples, set by -t option.
+    struct telemetry_counters progress; // Bytes read, lines scored and records written so far.
+    struct telemetry *telemetry;   // The running sampler, NULL without -T.
+    char *trace_path;              // Where the event trace is written at exit, set by -X option.
+    int batches_read;              // Batches started by the input thread, numbering them for the trace.
+    struct dataset *held_batch;    // Scored batch waiting on the first score of the next one.
+    long lines_computed;           // Lines scored so far, for -A.
+    int STAGES_FUSED;              // Input, compute and output run in turn on one thread, not as a pipeline.
+    int ENGINE;                    // Engine asked for with -E option, default is the pipeline.
+    int engine_used;               // Engine the run went with.
+    long input_size;               // Bytes auto mode sized the input at, -1 for a stream still open.
+    long fused_max_bytes;          // Auto mode uses the fused engine up to this many bytes,
+    long pool_max_bytes;           // and the pool engine up to this many.
+    char *sniffed;                 // Start of standard input, read ahead by auto mode.
+    size_t sniffed_len, sniffed_pos;
+    int sniffed_eof;               // Standard input ended within sniffed.
+    int FILTER_MODE;               // Only lines whose primary diff passes the filter are written, set by -f option.
+    long filter_min, filter_max;   // Range the filter tests the diff against.
+    int filter_outside;            // Keep diffs outside the range rather than inside it.
+    char *filter_spec;             // The -f argument, for the report.
+    long lines_matched;            // Records the filter let through.
+    int PREFIX_MODE;               // Write running sums of the primary metric instead of diffs, set by -P option.
+    long prefix_carry;             // Primary metric summed over every line finished so far.
+    char *compare_path;            // Older dump the input is compared against, set by -C option, NULL for none.
+    const char *compare_maps[2];   // Both dumps, mapped: the older, then the input.
+    size_t compare_sizes[2];
+    long compare_lines[2];         // Lines in each.
+    long lines_changed;            // Lines whose score differs between the two.
+    long batches_widened;          // Batches whose scores needed 64-bit columns.
+    int POSITIONED_WRITES;         // Workers write records straight to their place in the output file, set by -W option.
+    int KERNEL_ISA;                // Build of the scan, diff and format kernels, set by -I option, default is the widest the CPU runs.
+    jmp_buf job_abort;             // Where a daemon job that cannot go ahead returns to.
+    int run_failed;                // Set when a daemon job fails once its stages are running; it drains and reports status 1.
+    int num_scale_events;           // Changes of the active worker count made by -A.
+    double adapt_last_ms;          // When -A last looked, and what it saw then.
+    long adapt_last_lines;
+    double adapt_last_rate;
+    int adapt_last_grew, adapt_hold;
+};
 
-/* For measuring performance. */
-double overall_elapsed, input_elapsed, compute_elapsed, output_elapsed;
-
-int NUM_COMPUTE_THREADS;       // Number of threads to compute in parallel, taken from first cmdline arg, default is 1.
-struct Queue *input_queue;     // Stores datasets that are ready to be computed with.
-struct Queue *output_queue;    // Stores datasets that are ready to be output to stdout.
-struct dataset *working_set;   // The current dataset that is being computed upon in parallel.
-pthread_mutex_t inq_lock;      // Mutex lock to protect input_queue when multiple threads are enq/deq.
-pthread_mutex_t outq_lock;     // Mutex lock to protect output_queue when multiple threads are enq/deq.
-pthread_mutex_t barrier_lock;  // Barrier lock for pthreads to synch back up when calculating diffs.
-pthread_cond_t barrier_cv;     // Barrier condition var for pthreads to synch back up when calculating diffs.
-int num_threads_done;          // Counter variable to determine when to broadcast cond var.
-int input_complete_flag;       // Signals entire file has been read.
-int computation_complete_flag; // Signals all score diffs have been calculated.
+__thread struct run *run;          // The run this thread is working for.
 
 /* Data structure to hold batch reads. */
 struct dataset
 {
-    int line_start;
+    struct run *run;                               // The run the batch belongs to.
+    int seq;                                       // Read order across all shards, for the trace.
+    int shard;                                     // Index of the input file in shards.
+    int shard_end;                                 // Set on a shard's last batch, which may be empty.
+    int number_base;                               // Added to line_start when numbering records.
+    int line_start;                                // First line's index within its shard.
     int num_entries;
-    long line_scores[MAX_ENTRIES_PER_READ];
+    char *text;                                    // Raw bytes of this batch's lines.
+    size_t text_len;                               // Bytes of text that belong to this batch.
+    size_t text_cap;                               // Allocated size of text.
+    size_t line_offsets[MAX_ENTRIES_PER_READ + 1]; // Start of each line in text, plus one past the last.
+    void *line_scores[NUM_METRICS];                // One column per selected metric, NULL for the rest: int32_t[],
+    void *line_diffs[NUM_METRICS];                 // or long[] for the hash and throughout a wide batch.
+    int wide;                                      // Set once a score, or the next batch's first, needs 64 bits.
+    int overflow;                                  // Set by a scoring task that met such a score.
+    char *columns;                                 // Backing store for line_scores and line_diffs.
+    size_t columns_cap;                            // Allocated size of columns.
+    long next_first[NUM_METRICS];                  // First scores of the following batch, 0 at end of file.
+    long *lookahead;                               // First max_lag primary scores of the following batch.
+    long *window_src;                              // max_window - 1 earlier primary scores, then this batch's.
+    long *lag_out;                                 // NUM_LAGS columns of lag diffs.
+    double *win_mean;                              // NUM_WINDOWS columns each of rolling mean, min, max, stddev.
+    long *win_min;
+    long *win_max;
+    double *win_std;
+    char *out;                                     // Formatted records, FORMAT_BLOCK lines per slot.
+    size_t out_lens[NUM_FORMAT_BLOCKS];            // Bytes used in each slot of out.
+    int tail_line;                                 // Set if the line after the last record is included too.
+    int out_blocks;                                // Slots of out in use.
+    int num_records;                               // Records in out: every line, or the filter's matches.
+    int match_count[NUM_FORMAT_BLOCKS];            // Filter matches in each format block.
+    int match_start[NUM_FORMAT_BLOCKS];            // Where each block's matches go in matches.
+    int block_rows[MAX_ENTRIES_PER_READ];          // Each block's matching lines, at the block's own offset.
+    int matches[MAX_ENTRIES_PER_READ];             // All matching lines, packed in order.
+    long line_sums[MAX_ENTRIES_PER_READ];          // Running sums of the primary metric, in prefix mode.
+    long block_sums[NUM_FORMAT_BLOCKS];            // Each format block's sum, then the running sum before it.
+    const char *side_text[2];                      // Compare mode: the older dump's text, then the input's.
+    size_t side_offsets[2][MAX_ENTRIES_PER_READ + 1]; // Start of each side's lines, plus one past the last.
+    int side_lines[2];                             // Lines of each side in this batch.
+    long side_scores[2][MAX_ENTRIES_PER_READ];     // Primary score of each side's lines, 0 past its end.
+    struct sink *out_sink;                         // File the slots of out go to, under -W.
+    off_t out_offsets[NUM_FORMAT_BLOCKS];          // Where each slot goes in it.
+    size_t out_cap;                                // Allocated size of out.
+    int lags_cap, lookahead_cap;                   // Lag columns and lookahead scores allocated.
+    int windows_cap, history_cap;                  // Window columns and longest window allocated.
 };
 
+struct Queue *warm_batches;    // Batches no run holds now, kept from job to job by the daemon.
+pthread_mutex_t warm_lock = PTHREAD_MUTEX_INITIALIZER; // Mutex lock to protect warm_batches.
+
 /* Function prototypes. */
+int parse_options(int, char *[]);
+int run_job(int, char *[]);
+int serve(char *, int, char *[]);
+void end_run(int);
+void fail_run();
+void check_sink(struct sink *);
+void abandon_run();
+void stop_on_signal(int);
+void *serve_job(void *);
+void block_stop_signals(int);
 void init_vars();
 void cleanup_vars();
 void output_performance();
 void *input_scores(void *);
+void read_all_shards();
+void read_shard(int, int);
+void read_compare();
+int map_dump(const char *, const char **, size_t *);
 void *compute_scores(void *);
+void compute_stage();
+void compute_setup();
+void compute_batch(struct dataset *);
+void compute_teardown();
 void *output_scores(void *);
-void *calc_line_diffs(void *); // Parallel function using PTHREADS.
-FILE *try_open_file(char *);
-int try_close_file(FILE *);
-void safe_add_batch_to_queue(struct Queue *, pthread_mutex_t, struct dataset *);
-struct dataset *safe_remove_batch_from_queue(struct Queue *, pthread_mutex_t);
+void output_batch(struct dataset *);
+void output_teardown();
+void hand_to_compute(struct dataset *);
+void hand_to_output(struct dataset *);
+void run_pipeline();
+void run_stages_in_turn();
+int choose_engine();
+long sniff_stdin(long);
+ssize_t read_input(int, char *, size_t);
+char *calibration_path(char *, size_t);
+void load_thresholds();
+void calibrate_engines(char *, char *);
+double time_engine(char *, int, char *, char *);
+void finish_batch(struct dataset *, struct dataset *);
+struct dataset *task_batch(void *);
+long score_cost(void *, int, int);
+void score_task(void *, int, int);        // Parallel function using the work-stealing pool.
+long compare_cost(void *, int, int);
+void score_sides(void *, int, int);       // Parallel function using the work-stealing pool.
+void compare_blocks(void *, int, int);    // Parallel function using the work-stealing pool.
+void calc_line_diffs(void *, int, int);   // Parallel function using the work-stealing pool.
+void select_matches(void *, int, int);    // Parallel function using the work-stealing pool.
+void pack_matches(void *, int, int);      // Parallel function using the work-stealing pool.
+void format_matches(void *, int, int);    // Parallel function using the work-stealing pool.
+void sum_blocks(void *, int, int);        // Parallel function using the work-stealing pool.
+void calc_line_sums(void *, int, int);    // Parallel function using the work-stealing pool.
+void finish_output(struct dataset *);
+void write_in_place(struct dataset *);
+void write_slots(void *, int, int);       // Parallel function using the work-stealing pool.
+int output_columns(struct dataset *, struct column *);
+void diff_block(struct dataset *, int, int);
+void calc_windows(void *, int, int);      // Parallel function using the work-stealing pool.
+void summarize_diffs(void *, int, int);   // Parallel function using the work-stealing pool.
+int parse_int_list(const char *, int *, int, int, int);
+int try_open_file(char *);
+int try_close_file(int);
+int input_ready(int);
+void ensure_text_capacity(struct dataset *, size_t);
+void safe_add_batch_to_queue(struct Queue *, pthread_mutex_t *, struct dataset *);
+struct dataset *safe_remove_batch_from_queue(struct Queue *, pthread_mutex_t *);
+void fill_batch_pool();
+void make_batches();
+void free_batch(struct dataset *);
+void free_batches();
+void size_batch(struct dataset *);
+size_t column_bytes(int);
+void lay_out_columns(struct dataset *);
+void widen_batch(struct dataset *);
+int narrow_column(struct dataset *, int);
+long score_at(struct dataset *, int, int);
+void copy_scores(long *, struct dataset *, int, int, int);
+struct dataset *acquire_batch();
+void release_batch(struct dataset *);
+void adapt_workers();
+void log_scale_event(const char *);
+struct sink *open_shard_output(struct shard *);
 
 void init_vars()
 {
     /* Initialize timer vars. */
-    overall_elapsed = 0;
-    input_elapsed = 0;
-    compute_elapsed = 0;
-    output_elapsed = 0;
+    run->overall_elapsed = 0;
+    run->input_elapsed = 0;
+    run->compute_elapsed = 0;
+    run->output_elapsed = 0;
 
     /* Initialize locks. */
-    pthread_mutex_init(&inq_lock, NULL);
-    pthread_mutex_init(&outq_lock, NULL);
+    pthread_mutex_init(&run->inq_lock, NULL);
+    pthread_mutex_init(&run->outq_lock, NULL);
+    pthread_mutex_init(&run->pool_lock, NULL);
+    pthread_cond_init(&run->pool_cv, NULL);
 
     /* Initialize queues. */
-    input_queue = create_queue();
-    output_queue = create_queue();
-
-    /* Initialize barrier. */
-    pthread_mutex_init(&barrier_lock, NULL);
-    pthread_cond_init(&barrier_cv, NULL);
+    run->input_queue = create_queue();
+    run->output_queue = create_queue();
+    run->batch_pool = create_queue();
+    run->batch_pool_node = -1;
 
     /* Initialize flags. */
-    input_complete_flag = 0;
-    computation_complete_flag = 0;
+    run->input_complete_flag = 0;
+    run->computation_complete_flag = 0;
+
+    /* Initialize counters. */
+    run->batches_read = 0;
+    run->held_batch = NULL;
+    run->lines_computed = 0;
+    run->lines_matched = 0;
+    run->prefix_carry = 0;
+    run->lines_changed = 0;
+    run->batches_widened = 0;
+    run->run_failed = 0;
+    run->compare_lines[0] = run->compare_lines[1] = 0;
+    run->num_scale_events = 0;
+    memset(&run->progress, 0, sizeof(run->progress));
+}
+
+/* Free a batch and its buffers. */
+void free_batch(struct dataset *b)
+{
+    free(b->text);
+    free(b->columns);
+    free(b->out);
+    free(b->lookahead);
+    free(b->window_src);
+    free(b->lag_out);
+    free(b->win_mean);
+    free(b->win_min);
+    free(b->win_max);
+    free(b->win_std);
+    free(b);
+}
+
+/* Free the batches a daemon kept warm, once its last job is done. */
+void free_batches()
+{
+    struct dataset *b;
+
+    while ((b = (struct dataset *)dequeue(warm_batches)) != NULL)
+        free_batch(b);
 }
 
 void cleanup_vars()
 {
-    free(input_queue);
-    free(output_queue);
-    pthread_mutex_destroy(&inq_lock);
-    pthread_mutex_destroy(&outq_lock);
+    /* A daemon keeps its batches warm for its other jobs. */
+    while (dequeue(run->batch_pool) != NULL)
+        ;
+    for (int i = 0; i < BATCH_POOL_SIZE; i++)
+    {
+        if (run->batches[i] == NULL)
+            continue;
+        if (SERVING)
+            safe_add_batch_to_queue(warm_batches, &warm_lock, run->batches[i]);
+        else
+            free_batch(run->batches[i]);
+        run->batches[i] = NULL;
+    }
+    free(run->worker_stats);
+    free(run->window_history);
+    free(run->partials);
+    free(run->sniffed);
+    for (int i = 0; run->window_scratch != NULL && i < run->NUM_COMPUTE_THREADS; i++)
+        free(run->window_scratch[i]);
+    free(run->window_scratch);
+    run->window_scratch = NULL;
+    run->worker_stats = NULL;
+    run->window_history = NULL;
+    run->partials = NULL;
+    run->sniffed = NULL;
+    run->sniffed_len = run->sniffed_pos = 0;
+    run->sniffed_eof = 0;
+    for (int i = 0; i < run->shards.count; i++)
+        if (run->shards.shards[i].out != NULL)
+            sink_free(run->shards.shards[i].out);
+    shards_free(&run->shards);
+    sink_free(run->results);
+    run->results = NULL;
+    for (int s = 0; s < 2; s++)
+    {
+        if (run->compare_maps[s] != NULL)
+            munmap((void *)run->compare_maps[s], run->compare_sizes[s]);
+        run->compare_maps[s] = NULL;
+    }
+    if (run->metrics_out != run->console && run->metrics_out != run->errors)
+        fclose(run->metrics_out);
+
+    free(run->input_queue);
+    free(run->output_queue);
+    free(run->batch_pool);
+    pthread_mutex_destroy(&run->inq_lock);
+    pthread_mutex_destroy(&run->outq_lock);
+    pthread_mutex_destroy(&run->pool_lock);
+    pthread_cond_destroy(&run->pool_cv);
 }
 
 void output_performance()
 {
-    printf("TIME, OVERALL, %f ms\n", overall_elapsed);
-    printf("TIME, INPUT, %f ms\n", input_elapsed);
-    printf("TIME, COMPUTE, %f ms\n", compute_elapsed);
-    printf("TIME, OUTPUT, %f ms\n", output_elapsed);
+    fprintf(run->metrics_out, "TIME, OVERALL, %f ms\n", run->overall_elapsed);
+    fprintf(run->metrics_out, "TIME, INPUT, %f ms\n", run->input_elapsed);
+    fprintf(run->metrics_out, "TIME, COMPUTE, %f ms\n", run->compute_elapsed);
+    fprintf(run->metrics_out, "TIME, OUTPUT, %f ms\n", run->output_elapsed);
+
+    fprintf(run->metrics_out, "DATA, VERSION, Pthread\n");
+    fprintf(run->metrics_out, "DATA, NUM OF CORES, %d\n", topology.num_cpus);
+    fprintf(run->metrics_out, "DATA, NUMA NODES, %d\n", topology.num_nodes);
+    fprintf(run->metrics_out, "DATA, COMP THREADS, %d\n", run->NUM_COMPUTE_THREADS);
+    if (SERVING)
+        fprintf(run->metrics_out, "DATA, DAEMON, job %ld, pool of %d workers\n", run->job_number, pool->num_workers);
+    fprintf(run->metrics_out, "DATA, KERNELS, %s, cpu supports %s\n", kernels_isa_name(kernels_isa()),
+            kernels_isa_name(kernels_detect()));
+    if (run->compare_path != NULL)
+        fprintf(run->metrics_out, "DATA, COMPARE, %s, %ld lines, %s, %ld lines, %ld changed\n", run->compare_path,
+                run->compare_lines[0], run->shards.shards[0].path, run->compare_lines[1], run->lines_changed);
+    if (run->PREFIX_MODE != PREFIX_NONE)
+        fprintf(run->metrics_out, "DATA, PREFIX, %s\n", run->PREFIX_MODE == PREFIX_BINARY ? "binary" : "text");
+    if (run->FILTER_MODE)
+        fprintf(run->metrics_out, "DATA, FILTER, %s, %ld of %ld lines\n", run->filter_spec, run->lines_matched, run->lines_computed);
+    if (run->ENGINE == ENGINE_AUTO)
+        fprintf(run->metrics_out, "DATA, ENGINE, %s, auto, %ld bytes, fused up to %ld, pool up to %ld\n",
+                engine_names[run->engine_used], run->input_size, run->fused_max_bytes, run->pool_max_bytes);
+    else
+        fprintf(run->metrics_out, "DATA, ENGINE, %s\n", engine_names[run->engine_used]);
+
+    char names[256];
+    format_metrics(run->METRICS, names, sizeof(names));
+    fprintf(run->metrics_out, "DATA, METRICS, %s\n", names);
+    fprintf(run->metrics_out, "DATA, LAGS, 1");
+    for (int i = 0; i < run->NUM_LAGS; i++)
+        fprintf(run->metrics_out, ",%d", run->lags[i]);
+    fprintf(run->metrics_out, "\n");
+    if (run->SUMMARY_MODE)
+        fprintf(run->metrics_out, "DATA, SUMMARY TOP K, %d\n", run->SUMMARY_K);
+    if (run->NUM_WINDOWS > 0)
+    {
+        fprintf(run->metrics_out, "DATA, WINDOWS, %d", run->windows[0]);
+        for (int i = 1; i < run->NUM_WINDOWS; i++)
+            fprintf(run->metrics_out, ",%d", run->windows[i]);
+        fprintf(run->metrics_out, "\n");
+    }
+
+    char where[4096];
+    format_placement(&topology, &placement, where, sizeof(where));
+    fprintf(run->metrics_out, "DATA, AFFINITY, %s\n", affinity_mode_name(run->AFFINITY_MODE));
+    fprintf(run->metrics_out, "DATA, PLACEMENT, %s\n", where);
+    fprintf(run->metrics_out, "DATA, BATCH POOL NODE, %d\n", run->batch_pool_node);
+
+    /* Score and diff columns held by the batches, against 64-bit columns throughout. */
+    long column_total = 0;
+    for (int i = 0; i < BATCH_POOL_SIZE; i++)
+        if (run->batches[i] != NULL)
+            column_total += (long)run->batches[i]->columns_cap;
+    long column_wide = (long)BATCH_POOL_SIZE * (long)column_bytes(1);
+    fprintf(run->metrics_out, "DATA, FOOTPRINT, %d batches, %ld widened to 64-bit, %ld bytes of scores and diffs, %ld as 64-bit, %.2fx\n",
+            BATCH_POOL_SIZE, run->batches_widened, column_total, column_wide,
+            column_total > 0 ? (double)column_wide / column_total : 1.0);
+
+    /* Per-worker balance. Busy max/mean near 1 means no worker was left with the tail. */
+    double busy_max = 0, busy_sum = 0;
+    for (int i = 0; i < run->NUM_COMPUTE_THREADS; i++)
+    {
+        struct ws_stats *st = &run->worker_stats[i];
+        fprintf(run->metrics_out, "DATA, WORKER %d, tasks %ld, lines %ld, splits %ld, steals %ld/%ld, busy %.3f ms, idle %.3f ms\n",
+                i, st->tasks, st->items, st->splits, st->steals, st->steal_attempts,
+                st->busy_ms, st->active_ms - st->busy_ms);
+        busy_sum += st->busy_ms;
+        if (st->busy_ms > busy_max)
+            busy_max = st->busy_ms;
+    }
+    fprintf(run->metrics_out, "DATA, BUSY MAX/MEAN, %.3f\n", busy_sum > 0 ? busy_max / (busy_sum / run->NUM_COMPUTE_THREADS) : 1.0);
 
-    printf("DATA, VERSION, Pthread\n");
-    printf("DATA, NUM OF CORES, %s\n", getenv("cpus-per-task"));
-    printf("DATA, COMP THREADS, %d\n", NUM_COMPUTE_THREADS);
+    /* The decisions themselves went out as they were made; see adapt_workers(). */
+    if (run->ADAPTIVE)
+        fprintf(run->metrics_out, "DATA, ADAPTIVE, %d-%d workers, cgroup limit %d, final %d, %d changes\n",
+                run->min_workers, run->max_workers, run->cgroup_limit, run->active_workers, run->num_scale_events);
+
+    shards_report(&run->shards, run->overall_elapsed, run->metrics_out);
+    if (run->shard_dir != NULL)
+    {
+        for (int i = 0; i < run->shards.count; i++)
+            if (run->shards.shards[i].out != NULL)
+                sink_report(run->shards.shards[i].out, run->metrics_out);
+    }
+    else
+        sink_report(run->results, run->metrics_out);
 
-    fflush(stdout);
+    fflush(run->metrics_out);
 }
 
-void *compute_scores(void *n)
+/* Set up the compute stage: the batch pool, the workers and their summaries. */
+void compute_setup()
 {
-    /* Thread initialization. */
-    pthread_t compute_threads[NUM_COMPUTE_THREADS];
-    pthread_attr_t attr;
-    void *status;
+    /* Batches are consumed here, so allocate and touch them on this thread's node. */
+    fill_batch_pool();
+
+    /* This thread becomes worker 0; the rest start pinned to their planned CPUs.
+       A daemon started them once and keeps them, shared by all its jobs. */
+    if (pool == NULL)
+        pool = ws_create(run->NUM_COMPUTE_THREADS, placement.worker_cpus);
+    run->workers = ws_attach(pool);
+    ws_set_active(run->workers, run->active_workers);
+
+    /* Each worker aggregates into its own summary; they are merged at the end. */
+    if (run->SUMMARY_MODE)
+    {
+        run->partials = (struct summary *)malloc(run->NUM_COMPUTE_THREADS * sizeof(struct summary));
+        for (int i = 0; i < run->NUM_COMPUTE_THREADS; i++)
+            summary_init(&run->partials[i], run->SUMMARY_K);
+    }
 
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+    /* A window task covers at most a chunk of lines and the window before it. */
+    if (run->NUM_WINDOWS > 0)
+    {
+        run->window_scratch = (char **)malloc(run->NUM_COMPUTE_THREADS * sizeof(char *));
+        for (int i = 0; i < run->NUM_COMPUTE_THREADS; i++)
+            run->window_scratch[i] = (char *)malloc(ROLLING_SCRATCH_BYTES(run->window_chunk + run->max_window));
+    }
+}
 
+/* Score one read batch, and finish whichever batches that completes. */
+void compute_batch(struct dataset *b)
+{
     struct timeval compute_start, compute_end;
 
-    while (!input_complete_flag || input_queue->count > 0)
-    {
-        working_set = safe_remove_batch_from_queue(input_queue, inq_lock);
+    /* Start compute timer. */
+    gettimeofday(&compute_start, NULL);
 
-        if (working_set != NULL)
-        {
-            /* Start compute timer. */
-            gettimeofday(&compute_start, NULL);
+    /* Score every line, splitting by bytes so long lines spread out. */
+    TRACE_BEGIN("score", b->seq);
+    if (run->compare_path != NULL)
+        ws_parallel_for(run->workers, 0, b->num_entries, SCORE_GRAIN_BYTES, compare_cost, score_sides, b);
+    else
+        ws_parallel_for(run->workers, 0, b->num_entries + b->tail_line, SCORE_GRAIN_BYTES, score_cost, score_task, b);
 
-            num_threads_done = 0;
+    /* Rarely a line scores past 32 bits; only its batch pays for 64-bit columns. */
+    if (b->overflow)
+    {
+        widen_batch(b);
+        ws_parallel_for(run->workers, 0, b->num_entries + b->tail_line, SCORE_GRAIN_BYTES, score_cost, score_task, b);
+    }
+    TRACE_END("score", b->seq);
+
+    /* The previous batch's last diff needed this batch's first scores.
+       An empty batch only marks the end of a shard. */
+    if (run->held_batch != NULL)
+        finish_batch(run->held_batch, b->num_entries > 0 ? b : NULL);
+    run->held_batch = b;
+
+    /* A batch cut short by a stalled stream carries the line after
+       its last record, so it can go out without waiting for more input.
+       A shard's last line is diffed against an empty line, so shards
+       are scored as if each were run on its own. */
+    if (b->tail_line)
+    {
+        finish_batch(b, b);
+        run->held_batch = NULL;
+    }
+    else if (b->shard_end)
+    {
+        finish_batch(b, NULL);
+        run->held_batch = NULL;
+    }
 
-            for (int i = 0; i < NUM_COMPUTE_THREADS; i++)
-            {
-                int rc = pthread_create(&compute_threads[i], &attr, calc_line_diffs, (void *)i);
-                if (rc)
-                {
-                    printf("ERROR: Return code from pthread_create() was %d.\n", rc);
-                    exit(-1);
-                }
-            }
+    /* Stop compute timer and add time elapsed. */
+    gettimeofday(&compute_end, NULL);
+    run->compute_elapsed += ((compute_end.tv_sec - compute_start.tv_sec) * 1000) + ((compute_end.tv_usec - compute_start.tv_usec) / 1000);
 
-            for (int j = 0; j < NUM_COMPUTE_THREADS; j++)
-            {
-                int rc = pthread_join(compute_threads[j], &status);
-                if (rc)
-                {
-                    printf("ERROR: Return code from pthread_join() was %d.\n", rc);
-                    exit(-1);
-                }
-            }
+    run->lines_computed += b->num_entries;
+    telemetry_add(run->progress.lines_scored, b->num_entries);
+    if (run->ADAPTIVE)
+        adapt_workers();
+}
+
+/* Merge the summaries and stop the workers once every batch is in. */
+void compute_teardown()
+{
+    if (run->SUMMARY_MODE)
+    {
+        summary_init(&run->totals, run->SUMMARY_K);
+        run->totals.per_line = run->compare_path != NULL;
+        for (int i = 0; i < run->NUM_COMPUTE_THREADS; i++)
+            summary_merge(&run->totals, &run->partials[i]);
+    }
 
-            safe_add_batch_to_queue(output_queue, outq_lock, working_set);
+    run->computation_complete_flag = 1;
 
-            /* Stop compute timer and add time elapsed. */
-            gettimeofday(&compute_end, NULL);
-            compute_elapsed += ((compute_end.tv_sec - compute_start.tv_sec) * 1000) + ((compute_end.tv_usec - compute_start.tv_usec) / 1000);
-        }
+    /* Keep the counters for the summary, then stop the workers, unless
+       the daemon needs them for its other jobs. */
+    run->worker_stats = (struct ws_stats *)malloc(pool->num_workers * sizeof(struct ws_stats));
+    ws_detach(run->workers, run->worker_stats);
+    run->workers = NULL;
+    if (!SERVING)
+    {
+        ws_destroy(pool);
+        pool = NULL;
     }
+}
 
-    computation_complete_flag = 1;
+void *compute_scores(void *r)
+{
+    run = (struct run *)r;
+    compute_stage();
 
-    pthread_attr_destroy (&attr);
     pthread_exit(NULL);
 }
 
-/* Parallel function using OMP. */
-void *calc_line_diffs(void *myID)
+void compute_stage()
+{
+    compute_setup();
+    TRACE_THREAD("compute", -1);
+
+    while (!run->input_complete_flag || queue_count(run->input_queue) > 0)
+    {
+        struct dataset *b = safe_remove_batch_from_queue(run->input_queue, &run->inq_lock);
+
+        if (b != NULL)
+            compute_batch(b);
+    }
+
+    compute_teardown();
+}
+
+/* Write one scaling decision as soon as it is made, so a long run, or one
+   that dies, can still be audited. It goes to metrics_out, or to the run's
+   standard error when that is its standard output and would land among the
+   records, and to the telemetry stream if there is one. */
+void log_scale_event(const char *line)
 {
-    int startPos, endPos, i;
-    int local_score_diffs[MAX_ENTRIES_PER_READ - 1];
+    FILE *out = run->metrics_out == run->console ? run->errors : run->metrics_out;
+
+    fputs(line, out);
+    fflush(out);
+    if (run->telemetry != NULL)
+        telemetry_note(run->telemetry, line);
+}
 
-    startPos = ((int) myID) * (MAX_ENTRIES_PER_READ / NUM_COMPUTE_THREADS);
-    endPos = startPos + (MAX_ENTRIES_PER_READ / NUM_COMPUTE_THREADS);
+/* Called by the compute thread between batches. Every ADAPT_INTERVAL_MS,
+   looks at the queues on either side of compute and at compute throughput,
+   and moves the active worker count one step within [min_workers, max_workers]:
+   up while batches pile up waiting for compute, down while compute waits
+   on input or output is the one falling behind. A step up that does not
+   raise throughput by ADAPT_MIN_GAIN is undone and not retried for a while. */
+void adapt_workers()
+{
+    struct timeval now;
 
-    /* Protect against going outside bounds of array. */
-    if (((int) myID) == NUM_COMPUTE_THREADS - 1)
-        endPos = working_set->num_entries - 1;
+    gettimeofday(&now, NULL);
+    double now_ms = (now.tv_sec - run->run_start.tv_sec) * 1000.0 + (now.tv_usec - run->run_start.tv_usec) / 1000.0;
+    if (now_ms - run->adapt_last_ms < ADAPT_INTERVAL_MS)
+        return;
 
-    for (int i = startPos; i < endPos; i++)
-        local_score_diffs[i] = working_set->line_scores[i] - working_set->line_scores[i + 1];
+    double rate = (run->lines_computed - run->adapt_last_lines) * 1000.0 / (now_ms - run->adapt_last_ms);
+    int in_depth = queue_count(run->input_queue);
+    int out_depth = queue_count(run->output_queue);
+    int to = run->active_workers;
+    const char *reason = NULL;
 
-    /* Wait for all pthreads to finish diffs. */
-    pthread_mutex_lock(&barrier_lock);
-    num_threads_done += 1;
-    if (num_threads_done < NUM_COMPUTE_THREADS)
+    if (run->adapt_last_grew && rate < run->adapt_last_rate * (1 + ADAPT_MIN_GAIN))
+    {
+        to = run->active_workers - 1;
+        reason = "no gain from last step";
+        run->adapt_hold = ADAPT_HOLD_INTERVALS;
+    }
+    else if (run->adapt_hold > 0)
+        run->adapt_hold--;
+    else if (out_depth >= ADAPT_BACKLOG && run->active_workers > run->min_workers)
     {
-        pthread_cond_wait(&barrier_cv, &barrier_lock);
+        to = run->active_workers - 1;
+        reason = "output backlog";
     }
-    else 
+    else if (in_depth >= ADAPT_BACKLOG && run->active_workers < run->max_workers)
     {
-        pthread_cond_broadcast(&barrier_cv);
+        to = run->active_workers + 1;
+        reason = "input backlog";
+    }
+    else if (in_depth == 0 && !run->input_complete_flag && run->active_workers > run->min_workers)
+    {
+        to = run->active_workers - 1;
+        reason = "waiting on input";
     }
-    pthread_mutex_unlock(&barrier_lock);
 
-    /* Update working set to reflect line diffs. */
-    for (i = startPos; i < endPos; i++)
+    run->adapt_last_grew = to > run->active_workers;
+    if (to != run->active_workers)
     {
-        working_set->line_scores[i] = local_score_diffs[i];
+        char line[256];
+        snprintf(line, sizeof(line), "DATA, SCALE, %.3f ms, %d -> %d, input queue %d, output queue %d, %.0f lines/s, %s\n",
+                 now_ms, run->active_workers, to, in_depth, out_depth, rate, reason);
+        log_scale_event(line);
+        run->num_scale_events++;
+
+        ws_set_active(run->workers, to);
+        run->active_workers = to;
     }
 
-    pthread_exit(NULL);
+    run->adapt_last_ms = now_ms;
+    run->adapt_last_lines = run->lines_computed;
+    run->adapt_last_rate = rate;
 }
 
-void *input_scores(void *f)
+/* Diff and format a scored batch in parallel, then hand it to output. next
+   is the batch that follows it, NULL at the end of the file, or b itself
+   when b carries a tail line. */
+void finish_batch(struct dataset *b, struct dataset *next)
 {
-    FILE *file = (FILE *)f;
+    int num_blocks = (b->num_entries + FORMAT_BLOCK - 1) / FORMAT_BLOCK;
+    int next_pos = next == b ? b->num_entries : 0; // Where the following line's scores are in next.
+    int next_len = next == NULL ? 0 : next == b ? 1 : next->num_entries;
 
-    int ch = 0;
-    int line_counter = 0;
-    long score_counter = 0;
+    TRACE_BEGIN("finish", b->seq);
+    for (int c = 0; c < run->num_columns; c++)
+    {
+        int m = run->column_metric[c];
+        b->next_first[m] = next != NULL ? score_at(next, m, next_pos) : 0;
 
-    struct dataset *batch = (struct dataset *)malloc(sizeof(struct dataset));
-    batch->line_start = 0;
-    batch->num_entries = 0;
+        /* The last diff takes the next batch's first score, which may be wider. */
+        if (narrow_column(b, m) && (unsigned long)b->next_first[m] > INT32_MAX)
+            widen_batch(b);
+    }
 
-    struct timeval input_start, input_end;
-    gettimeofday(&input_start, NULL);
+    /* Summary mode writes nothing per line, so the batch goes straight back to the pool. */
+    if (run->SUMMARY_MODE)
+    {
+        ws_parallel_for(run->workers, 0, num_blocks, 1, NULL, run->compare_path != NULL ? compare_blocks : summarize_diffs, b);
+        if (b->shard_end)
+            shard_finish(&run->shards.shards[b->shard]);
+        TRACE_END("finish", b->seq);
+        release_batch(b);
+        return;
+    }
 
-    while (!feof(f))
+    /* Lags reach into the next batch. Only the last batch is short, or one
+       with a tail line when lags are 1, so anything the next one does not
+       cover is past the end of the file. */
+    if (run->NUM_LAGS > 0)
     {
-        int ch = fgetc(f);
-        if (ch == EOF && batch->num_entries > 0)
-        {
-            /* Add partial batch to queue. */
-            safe_add_batch_to_queue(input_queue, inq_lock, batch);
-        }
-        else if (ch == '\n')
+        int have = next_len < run->max_lag ? next_len : run->max_lag;
+        if (have > 0)
+            copy_scores(b->lookahead, next, run->primary_metric, next_pos, have);
+        memset(b->lookahead + have, 0, (run->max_lag - have) * sizeof(long));
+    }
+
+    /* Windows reach back into earlier batches. Lay the carried scores out
+       in front of this batch's, then keep this batch's tail for the next. */
+    if (run->NUM_WINDOWS > 0)
+    {
+        int keep = run->max_window - 1;
+        int num_chunks = (b->num_entries + run->window_chunk - 1) / run->window_chunk;
+
+        memcpy(b->window_src, run->window_history, keep * sizeof(long));
+        copy_scores(b->window_src + keep, b, run->primary_metric, 0, b->num_entries);
+        ws_parallel_for(run->workers, 0, run->NUM_WINDOWS * num_chunks, 1, NULL, calc_windows, b);
+        memcpy(run->window_history, b->window_src + b->num_entries, keep * sizeof(long));
+    }
+
+    /* Compared dumps are already line for line; there is nothing to wait for. */
+    if (run->compare_path != NULL)
+    {
+        ws_parallel_for(run->workers, 0, num_blocks, 1, NULL, compare_blocks, b);
+        b->num_records = b->num_entries;
+        b->out_blocks = num_blocks;
+        finish_output(b);
+        return;
+    }
+
+    /* Prefix sums are a two-pass scan: sum each block in parallel, turn
+       the block sums into starting offsets in order, carrying on from the
+       batches before, then scan and format every block from its offset. */
+    if (run->PREFIX_MODE != PREFIX_NONE)
+    {
+        ws_parallel_for(run->workers, 0, num_blocks, 1, NULL, sum_blocks, b);
+        for (int block = 0; block < num_blocks; block++)
         {
-            batch->line_scores[(line_counter++) % MAX_ENTRIES_PER_READ] = score_counter;
-            batch->num_entries += 1;
-            score_counter = 0;
-            if (line_counter % MAX_ENTRIES_PER_READ == 0)
-            {
-                /* Add full batch to queue. */
-                safe_add_batch_to_queue(input_queue, inq_lock, batch);
-
-                /* Prep a new batch. */
-                batch = (struct dataset *)malloc(sizeof(struct dataset));
-                batch->line_start = line_counter;
-                batch->num_entries = 0;
-
-                /* Add time to read batch. */
-                gettimeofday(&input_end, NULL);
-                input_elapsed += ((input_end.tv_sec - input_start.tv_sec) * 1000) + ((input_end.tv_usec - input_start.tv_usec) / 1000);
-                gettimeofday(&input_start, NULL);
-            }
+            long sum = b->block_sums[block];
+            b->block_sums[block] = run->prefix_carry;
+            run->prefix_carry += sum;
         }
-        else
+        if (b->shard_end && run->RESTART_NUMBERING)
+            run->prefix_carry = 0;
+        ws_parallel_for(run->workers, 0, num_blocks, 1, NULL, calc_line_sums, b);
+        b->num_records = b->num_entries;
+        b->out_blocks = num_blocks;
+        finish_output(b);
+        return;
+    }
+
+    /* With a filter, the matching lines are packed together first so
+       formatting and output only cost as much as there are matches:
+       select per block, place each block's matches with a scan over the
+       block counts, pack them, then format the packed list. */
+    if (run->FILTER_MODE)
+    {
+        ws_parallel_for(run->workers, 0, num_blocks, 1, NULL, select_matches, b);
+        int total = 0;
+        for (int block = 0; block < num_blocks; block++)
         {
-            score_counter += ch;
+            b->match_start[block] = total;
+            total += b->match_count[block];
         }
+        ws_parallel_for(run->workers, 0, num_blocks, 1, NULL, pack_matches, b);
+        b->num_records = total;
+        b->out_blocks = (total + FORMAT_BLOCK - 1) / FORMAT_BLOCK;
+        ws_parallel_for(run->workers, 0, b->out_blocks, 1, NULL, format_matches, b);
     }
+    else
+    {
+        ws_parallel_for(run->workers, 0, num_blocks, 1, NULL, calc_line_diffs, b);
+        b->num_records = b->num_entries;
+        b->out_blocks = num_blocks;
+    }
+    finish_output(b);
+}
 
-    /* Add time to read last batch. */
-    gettimeofday(&input_end, NULL);
-    input_elapsed += ((input_end.tv_sec - input_start.tv_sec) * 1000) + ((input_end.tv_usec - input_start.tv_usec) / 1000);
-
-    /* Signal to compute threads that input is complete. */
-    input_complete_flag = 1;
-
-    /* Close file stream. */
-    try_close_file(file);
-
-    pthread_exit(NULL);
+/* Pass a formatted batch on. Under -W its records are written here first. */
+void finish_output(struct dataset *b)
+{
+    if (run->POSITIONED_WRITES)
+        write_in_place(b);
+    TRACE_END("finish", b->seq);
+    hand_to_output(b);
 }
 
-void *output_scores(void *v)
+/* Under -W: claim the batch's bytes in the output file, in batch order,
+   and give each slot its offset within them, so the workers can write
+   the slots side by side rather than leaving it all to the output stage. */
+void write_in_place(struct dataset *b)
 {
-    struct timeval output_start, output_end;
+    struct shard *sh = &run->shards.shards[b->shard];
+    long len = 0;
 
-    while (!computation_complete_flag || output_queue->count != 0)
+    b->out_sink = run->results;
+    if (run->shard_dir != NULL)
     {
-        struct dataset *b = safe_remove_batch_from_queue(output_queue, outq_lock);
+        if (sh->out == NULL)
+            sh->out = open_shard_output(sh);
+        b->out_sink = sh->out;
+    }
 
-        if (b != NULL)
-        {
-            /* Start output timer. */
-            gettimeofday(&output_start, NULL);
+    for (int slot = 0; slot < b->out_blocks; slot++)
+        len += (long)b->out_lens[slot];
 
-            for (int i = b->line_start; i < b->line_start + MAX_ENTRIES_PER_READ; i++)
-            {
-                printf("%d-%d: %ld\n", i, i + 1, b->line_scores[i % MAX_ENTRIES_PER_READ]);
-            }
+    off_t at = sink_claim(b->out_sink, len);
+    for (int slot = 0; slot < b->out_blocks; slot++)
+    {
+        b->out_offsets[slot] = at;
+        at += (off_t)b->out_lens[slot];
+    }
 
-            /* Cleanup. No longer need dataset. */
-            free(b);
+    ws_parallel_for(run->workers, 0, b->out_blocks, WRITE_GRAIN_BLOCKS, NULL, write_slots, b);
+}
 
-            /* Stop output timer and add time elapsed. */
-            gettimeofday(&output_end, NULL);
-            output_elapsed += ((output_end.tv_sec - output_start.tv_sec) * 1000) + ((output_end.tv_usec - output_start.tv_usec) / 1000);
-        }
+/* Parallel function using the work-stealing pool. Writes slots [lo, hi),
+   which sit back to back in the file, with one pwritev(). */
+void write_slots(void *ctx, int lo, int hi)
+{
+    struct dataset *b = task_batch(ctx);
+    struct iovec iov[WRITE_GRAIN_BLOCKS];
+
+    TRACE_BEGIN("write task", b->seq);
+    for (int slot = lo; slot < hi; slot++)
+    {
+        iov[slot - lo].iov_base = b->out + (size_t)slot * FORMAT_BLOCK * run->record_len;
+        iov[slot - lo].iov_len = b->out_lens[slot];
     }
+    sink_pwritev(b->out_sink, iov, hi - lo, b->out_offsets[lo]);
+    TRACE_END("write task", b->seq);
+}
 
-    /* Stop output timer. */
-    gettimeofday(&output_end, NULL);
+/* The batch a pool task was handed. Pool threads serve every run, so
+   the task works for the batch's run. */
+struct dataset *task_batch(void *ctx)
+{
+    struct dataset *b = (struct dataset *)ctx;
 
-    pthread_exit(NULL);
+    run = b->run;
+    return b;
 }
 
-FILE *try_open_file(char *path)
+/* Cost of scoring lines [lo, hi), used to decide whether to split the range. */
+long score_cost(void *ctx, int lo, int hi)
 {
-    return fopen(path, "r");
+    struct dataset *b = task_batch(ctx);
+    return (long)(b->line_offsets[hi] - b->line_offsets[lo]) + (long)(hi - lo) * SCORE_LINE_COST;
 }
 
-int try_close_file(FILE *f)
+/* Parallel function using the work-stealing pool. Scores lines [lo, hi). */
+void score_task(void *ctx, int lo, int hi)
 {
-    return fclose(f);
+    struct dataset *b = task_batch(ctx);
+
+    TRACE_BEGIN("score task", b->seq);
+    if (run->scan_kernel(b->text, b->line_offsets, b->line_scores, b->wide, lo, hi))
+        __atomic_store_n(&b->overflow, 1, __ATOMIC_RELAXED);
+    TRACE_END("score task", b->seq);
 }
 
-void safe_add_batch_to_queue(struct Queue *q, pthread_mutex_t l, struct dataset *b)
+/* Cost of scoring lines [lo, hi) of both dumps. */
+long compare_cost(void *ctx, int lo, int hi)
 {
-    /* Grab lock to protect queue, enqueue, release lock. */
-    pthread_mutex_lock(&l);
-    enqueue(q, (void *)b);
-    pthread_mutex_unlock(&l);
+    struct dataset *b = task_batch(ctx);
+    long cost = (long)(hi - lo) * 2 * SCORE_LINE_COST;
+
+    for (int s = 0; s < 2; s++)
+    {
+        int l = lo < b->side_lines[s] ? lo : b->side_lines[s];
+        int h = hi < b->side_lines[s] ? hi : b->side_lines[s];
+        cost += (long)(b->side_offsets[s][h] - b->side_offsets[s][l]);
+    }
+    return cost;
 }
 
-struct dataset *safe_remove_batch_from_queue(struct Queue *q, pthread_mutex_t l)
+/* Parallel function using the work-stealing pool. Scores lines [lo, hi)
+   of both dumps. A line past the end of one scores 0 there. Changes are
+   made in 64 bits, so side_scores are long whatever the batch's width. */
+void score_sides(void *ctx, int lo, int hi)
 {
-    /* Grab lock to protect queue, dequeue, release lock. */
-    pthread_mutex_lock(&l);
-    struct dataset *b = (struct dataset *)dequeue(q);
-    pthread_mutex_unlock(&l);
+    struct dataset *b = task_batch(ctx);
+    void *columns[NUM_METRICS];
 
-    return b;
+    TRACE_BEGIN("score task", b->seq);
+    for (int s = 0; s < 2; s++)
+    {
+        int end = hi < b->side_lines[s] ? hi : b->side_lines[s];
+
+        columns[run->primary_metric] = b->side_scores[s];
+        if (lo < end)
+            run->scan_kernel(b->side_text[s], b->side_offsets[s], columns, 1, lo, end);
+        for (int i = lo > end ? lo : end; i < hi; i++)
+            b->side_scores[s][i] = 0;
+    }
+    TRACE_END("score task", b->seq);
 }
 
-int main(int argc, char *argv[])
+/* Parallel function using the work-stealing pool. Takes the change in
+   score, new less old, of each line in format blocks [lo, hi), and
+   formats it or adds it to the running worker's summary. A block's
+   changes are used up at once, so they stay on the stack. */
+void compare_blocks(void *ctx, int lo, int hi)
 {
-    /* Initialize number of compute threads. */
-    if (argc > 1)
+    struct dataset *b = task_batch(ctx);
+    long deltas[FORMAT_BLOCK];
+    long changed = 0;
+
+    TRACE_BEGIN("compare task", b->seq);
+    for (int block = lo; block < hi; block++)
     {
-        NUM_COMPUTE_THREADS = (int)strtol(argv[1], (char **)NULL, 10);
+        int startPos = block * FORMAT_BLOCK;
+        int endPos = startPos + FORMAT_BLOCK;
+
+        if (endPos > b->num_entries)
+            endPos = b->num_entries;
+
+        for (int i = startPos; i < endPos; i++)
+        {
+            deltas[i - startPos] = b->side_scores[1][i] - b->side_scores[0][i];
+            changed += deltas[i - startPos] != 0;
+        }
+
+        if (run->SUMMARY_MODE)
+            summary_add(&run->partials[ws_worker_id()], deltas, (long)b->line_start + startPos, 0, endPos - startPos);
+        else
+            b->out_lens[block] = format_sums(b->out + (size_t)startPos * run->record_len,
+                                             b->number_base + b->line_start + startPos, deltas, 0, endPos - startPos);
     }
-    else
+    __atomic_add_fetch(&run->lines_changed, changed, __ATOMIC_RELAXED);
+    TRACE_END("compare task", b->seq);
+}
+
+/* Parallel function using the work-stealing pool. Task t computes window
+   t / chunks over chunk t % chunks of the batch. Chunks are at least one
+   window long so the lines read back from each chunk's start stay cheap. */
+void calc_windows(void *ctx, int lo, int hi)
+{
+    struct dataset *b = task_batch(ctx);
+    int num_chunks = (b->num_entries + run->window_chunk - 1) / run->window_chunk;
+
+    TRACE_BEGIN("windows task", b->seq);
+    for (int t = lo; t < hi; t++)
     {
-        NUM_COMPUTE_THREADS = 1;
+        int w = t / num_chunks;
+        int startPos = (t % num_chunks) * run->window_chunk;
+        int endPos = startPos + run->window_chunk;
+        size_t col = (size_t)w * MAX_ENTRIES_PER_READ;
+
+        if (endPos > b->num_entries)
+            endPos = b->num_entries;
+
+        /* Lines before the start of the file hold no score. */
+        int first = b->line_start < run->max_window - 1 ? -b->line_start : -(run->max_window - 1);
+        rolling_stats(b->window_src + run->max_window - 1, first, run->windows[w], startPos, endPos, run->window_scratch[ws_worker_id()],
+                      b->win_mean + col, b->win_min + col, b->win_max + col, b->win_std + col);
     }
+    TRACE_END("windows task", b->seq);
+}
 
-    /* Grab file path from cmdline argument. Default to wiki_dump. */
-    char *path = "/homes/dan/625/wiki_dump.txt";
-    if (argc > 2)
+/* Parallel function using the work-stealing pool. Diffs format blocks
+   [lo, hi) of the primary metric into the running worker's summary. */
+void summarize_diffs(void *ctx, int lo, int hi)
+{
+    struct dataset *b = task_batch(ctx);
+    struct summary *s = &run->partials[ws_worker_id()];
+    int m = run->primary_metric;
+
+    TRACE_BEGIN("summarize task", b->seq);
+    for (int block = lo; block < hi; block++)
     {
-        path = argv[2];
-    }
+        int startPos = block * FORMAT_BLOCK;
+        int endPos = startPos + FORMAT_BLOCK;
 
-    /* Perform variable initialization. */
-    init_vars();
+        if (endPos > b->num_entries)
+            endPos = b->num_entries;
 
-    /* Start overall timer. */
-    struct timeval overall_start, overall_end;
-    gettimeofday(&overall_start, NULL);
+        if (b->wide)
+        {
+            diff_scores(b->line_scores[m], b->line_diffs[m], b->num_entries, startPos, endPos, b->next_first[m]);
+            summary_add(s, b->line_diffs[m], (long)b->number_base + b->line_start, startPos, endPos);
+        }
+        else
+        {
+            diff_scores_narrow(b->line_scores[m], b->line_diffs[m], b->num_entries, startPos, endPos, b->next_first[m]);
+            summary_add_narrow(s, b->line_diffs[m], (long)b->number_base + b->line_start, startPos, endPos);
+        }
+    }
+    TRACE_END("summarize task", b->seq);
+}
 
-    /* Try opening file. If file does not exist, exit. */
-    FILE *f = try_open_file(path);
-    if (f == NULL)
+/* Parallel function using the work-stealing pool. Sums the primary
+   metric over each of format blocks [lo, hi). */
+void sum_blocks(void *ctx, int lo, int hi)
+{
+    struct dataset *b = task_batch(ctx);
+
+    TRACE_BEGIN("sum task", b->seq);
+    for (int block = lo; block < hi; block++)
     {
-        printf("Attempt to open file at - %s - failed! Program exiting!\n", path);
-        exit(EXIT_FAILURE);
-    }
+        int startPos = block * FORMAT_BLOCK;
+        int endPos = startPos + FORMAT_BLOCK;
 
-    /* Thread initialization. */
-    void *in_status, *comp_status, *out_status;
-    int in_ret_code, comp_ret_code, out_ret_code;
-    pthread_t input_thread, compute_thread, output_thread;
-    pthread_attr_t attr;
+        if (endPos > b->num_entries)
+            endPos = b->num_entries;
 
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+        if (b->wide)
+            b->block_sums[block] = sum_scores(b->line_scores[run->primary_metric], startPos, endPos);
+        else
+            b->block_sums[block] = sum_scores_narrow(b->line_scores[run->primary_metric], startPos, endPos);
+    }
+    TRACE_END("sum task", b->seq);
+}
 
-    /* Begin I/O and computation threads. */
-    in_ret_code = pthread_create(&input_thread, &attr, input_scores, (void *)f);
-    comp_ret_code = pthread_create(&compute_thread, &attr, compute_scores, NULL);
-    out_ret_code = pthread_create(&output_thread, &attr, output_scores, NULL);
+/* Parallel function using the work-stealing pool. Scans format blocks
+   [lo, hi) from their offsets in block_sums and formats the running sums. */
+void calc_line_sums(void *ctx, int lo, int hi)
+{
+    struct dataset *b = task_batch(ctx);
 
-    /* Standard error checking. */
-    if (in_ret_code)
+    TRACE_BEGIN("prefix task", b->seq);
+    for (int block = lo; block < hi; block++)
     {
-        printf("ERROR: Return code from pthread_create(&input_thread) is %d.\n", in_ret_code);
-        exit(EXIT_FAILURE);
+        int startPos = block * FORMAT_BLOCK;
+        int endPos = startPos + FORMAT_BLOCK;
+        char *dst = b->out + (size_t)startPos * run->record_len;
+
+        if (endPos > b->num_entries)
+            endPos = b->num_entries;
+
+        if (b->wide)
+            prefix_scores(b->line_scores[run->primary_metric], b->line_sums, startPos, endPos, b->block_sums[block]);
+        else
+            prefix_scores_narrow(b->line_scores[run->primary_metric], b->line_sums, startPos, endPos, b->block_sums[block]);
+        if (run->PREFIX_MODE == PREFIX_BINARY)
+        {
+            b->out_lens[block] = (endPos - startPos) * sizeof(long);
+            memcpy(dst, b->line_sums + startPos, b->out_lens[block]);
+        }
+        else
+            b->out_lens[block] = format_sums(dst, b->number_base + b->line_start, b->line_sums, startPos, endPos);
     }
+    TRACE_END("prefix task", b->seq);
+}
 
-    if (comp_ret_code)
+/* Fill columns with what each record holds: metric diffs, then extra lags,
+   then mean/min/max/stddev per window. Returns how many there are. */
+int output_columns(struct dataset *b, struct column *columns)
+{
+    int n = 0;
+
+    for (int c = 0; c < run->num_columns; c++)
     {
-        printf("ERROR: Return code from pthread_create(&compute_thread) is %d.\n", comp_ret_code);
-        exit(EXIT_FAILURE);
+        int m = run->column_metric[c];
+        columns[n].values = b->line_diffs[m];
+        columns[n++].format = !metric_table[m].diffable ? FMT_HEX : b->wide ? FMT_DECIMAL : FMT_NARROW;
     }
-
-    if (out_ret_code)
+    for (int l = 0; l < run->NUM_LAGS; l++)
     {
-        printf("ERROR: Return code from pthread_create(&output_thread) is %d.\n", out_ret_code);
-        exit(EXIT_FAILURE);
+        columns[n].values = b->lag_out + (size_t)l * MAX_ENTRIES_PER_READ;
+        columns[n++].format = FMT_DECIMAL;
+    }
+    for (int w = 0; w < run->NUM_WINDOWS; w++)
+    {
+        size_t col = (size_t)w * MAX_ENTRIES_PER_READ;
+        columns[n].values = b->win_mean + col;
+        columns[n++].format = FMT_FIXED;
+        columns[n].values = b->win_min + col;
+        columns[n++].format = FMT_DECIMAL;
+        columns[n].values = b->win_max + col;
+        columns[n++].format = FMT_DECIMAL;
+        columns[n].values = b->win_std + col;
+        columns[n++].format = FMT_FIXED;
     }
 
-    /* Wait for all threads to finish. Block main thread. */
-    in_ret_code = pthread_join(input_thread, NULL);
-    comp_ret_code = pthread_join(compute_thread, NULL);
-    out_ret_code = pthread_join(output_thread, NULL);
+    return n;
+}
 
-    /* Standard error checking. */
-    if (in_ret_code)
+/* Diff lines [startPos, endPos) in every metric column and lag. */
+void diff_block(struct dataset *b, int startPos, int endPos)
+{
+    /* Hashes are not ordered, so they are written as is rather than diffed. */
+    for (int c = 0; c < run->num_columns; c++)
     {
-        printf("ERROR: Return code from pthread_create(&input_thread) is %d.\n", in_ret_code);
-        exit(EXIT_FAILURE);
+        int m = run->column_metric[c];
+        if (!metric_table[m].diffable)
+            memcpy((long *)b->line_diffs[m] + startPos, (long *)b->line_scores[m] + startPos,
+                   (endPos - startPos) * sizeof(long));
+        else if (b->wide)
+            diff_scores(b->line_scores[m], b->line_diffs[m], b->num_entries, startPos, endPos, b->next_first[m]);
+        else
+            diff_scores_narrow(b->line_scores[m], b->line_diffs[m], b->num_entries, startPos, endPos, b->next_first[m]);
     }
+    for (int l = 0; l < run->NUM_LAGS; l++)
+    {
+        long *out = b->lag_out + (size_t)l * MAX_ENTRIES_PER_READ;
+        if (b->wide)
+            lag_diffs(b->line_scores[run->primary_metric], b->lookahead, out, b->num_entries, run->lags[l], startPos, endPos);
+        else
+            lag_diffs_narrow(b->line_scores[run->primary_metric], b->lookahead, out, b->num_entries, run->lags[l], startPos, endPos);
+    }
+}
 
-    if (comp_ret_code)
+/* Parallel function using the work-stealing pool. Diffs and formats
+   format blocks [lo, hi), each covering FORMAT_BLOCK lines. */
+void calc_line_diffs(void *ctx, int lo, int hi)
+{
+    struct dataset *b = task_batch(ctx);
+    struct column columns[NUM_METRICS + MAX_LAGS + 4 * MAX_WINDOWS];
+    int n = output_columns(b, columns);
+
+    TRACE_BEGIN("diff+format task", b->seq);
+    for (int block = lo; block < hi; block++)
     {
-        printf("ERROR: Return code from pthread_create(&compute_thread) is %d.\n", comp_ret_code);
-        exit(EXIT_FAILURE);
+        int startPos = block * FORMAT_BLOCK;
+        int endPos = startPos + FORMAT_BLOCK;
+
+        /* Protect against going outside bounds of array. */
+        if (endPos > b->num_entries)
+            endPos = b->num_entries;
+
+        diff_block(b, startPos, endPos);
+        b->out_lens[block] = format_records(b->out + (size_t)startPos * run->record_len, b->number_base + b->line_start,
+                                            columns, n, startPos, endPos);
     }
+    TRACE_END("diff+format task", b->seq);
+}
 
-    if (out_ret_code)
+/* Parallel function using the work-stealing pool. Diffs format blocks
+   [lo, hi) and lists, per block, the lines whose primary diff passes the filter. */
+void select_matches(void *ctx, int lo, int hi)
+{
+    struct dataset *b = task_batch(ctx);
+
+    TRACE_BEGIN("select task", b->seq);
+    for (int block = lo; block < hi; block++)
     {
-        printf("ERROR: Return code from pthread_create(&output_thread) is %d.\n", out_ret_code);
-        exit(EXIT_FAILURE);
+        int startPos = block * FORMAT_BLOCK;
+        int endPos = startPos + FORMAT_BLOCK;
+
+        if (endPos > b->num_entries)
+            endPos = b->num_entries;
+
+        diff_block(b, startPos, endPos);
+        if (b->wide)
+            b->match_count[block] = select_rows(b->line_diffs[run->primary_metric], startPos, endPos, run->filter_min, run->filter_max,
+                                                run->filter_outside, b->block_rows + startPos);
+        else
+            b->match_count[block] = select_rows_narrow(b->line_diffs[run->primary_metric], startPos, endPos, run->filter_min,
+                                                       run->filter_max, run->filter_outside, b->block_rows + startPos);
     }
+    TRACE_END("select task", b->seq);
+}
 
-    /* Stop overall timer and calculate time elapsed. */
-    gettimeofday(&overall_end, NULL);
-    overall_elapsed = ((overall_end.tv_sec - overall_start.tv_sec) * 1000) + ((overall_end.tv_usec - overall_start.tv_usec) / 1000);
+/* Parallel function using the work-stealing pool. Moves the matches of
+   format blocks [lo, hi) to their places in the packed list. */
+void pack_matches(void *ctx, int lo, int hi)
+{
+    struct dataset *b = task_batch(ctx);
 
-    /* Perform cleanup. */
-    cleanup_vars();
+    for (int block = lo; block < hi; block++)
+        memcpy(b->matches + b->match_start[block], b->block_rows + block * FORMAT_BLOCK,
+               b->match_count[block] * sizeof(int));
+}
 
-    /* Output TIME and DATA measurements. */
-    output_performance();
+/* Parallel function using the work-stealing pool. Formats slots [lo, hi)
+   of the packed matches, FORMAT_BLOCK records to a slot. */
+void format_matches(void *ctx, int lo, int hi)
+{
+    struct dataset *b = task_batch(ctx);
+    struct column columns[NUM_METRICS + MAX_LAGS + 4 * MAX_WINDOWS];
+    int n = output_columns(b, columns);
 
-    return 0;
-}
\ No newline at end of file
+    TRACE_BEGIN("format task", b->seq);
+    for (int slot = lo; slot < hi; slot++)
+    {
+        int first = slot * FORMAT_BLOCK;
+        int count = b->num_records - first < FORMAT_BLOCK ? b->num_records - first : FORMAT_BLOCK;
+
+        b->out_lens[slot] = format_selected(b->out + (size_t)first * run->record_len, b->number_base + b->line_start,
+                                            columns, n, b->matches + first, count);
+    }
+    TRACE_END("format task", b->seq);
+}
+
+void *input_scores(void *r)
+{
+    run = (struct run *)r;
+    TRACE_THREAD("input", -1);
+    read_all_shards();
+
+    /* Signal to compute threads that input is complete. */
+    run->input_complete_flag = 1;
+
+    pthread_exit(NULL);
+}
+
+void read_all_shards()
+{
+    int number_base = 0;
+
+    if (run->compare_path != NULL)
+    {
+        read_compare();
+        return;
+    }
+
+    /* Shards are read one after another into the same batch pool, so the
+       workers stay busy across file boundaries. */
+    for (int i = 0; i < run->shards.count && !run->run_failed; i++)
+    {
+        read_shard(i, number_base);
+        if (!run->RESTART_NUMBERING)
+            number_base += (int)run->shards.shards[i].lines;
+    }
+}
+
+/* Map a whole dump read-only. An empty one maps to NULL. Returns -1 if it
+   cannot be opened or mapped. */
+int map_dump(const char *path, const char **map, size_t *size)
+{
+    struct stat st;
+    int fd = openat(run->cwd, path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0)
+        return -1;
+
+    *size = (size_t)st.st_size;
+    *map = NULL;
+    if (*size > 0)
+    {
+        void *p = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            close(fd);
+            return -1;
+        }
+        madvise(p, *size, MADV_SEQUENTIAL);
+        *map = (const char *)p;
+    }
+    close(fd);
+    return 0;
+}
+
+/* Compare mode input. Both dumps are mapped and cut into batches by line
+   number together, so line i of each lands in the same batch and the
+   workers score them side by side. The mappings stay until the end of
+   the run, and batches point into them rather than copying. */
+void read_compare()
+{
+    struct shard *sh = &run->shards.shards[0];
+    const char *paths[2] = {run->compare_path, sh->path};
+    size_t pos[2] = {0, 0};
+    int line_counter = 0;
+    struct timeval input_start, input_end;
+
+    gettimeofday(&input_start, NULL);
+    shard_start(sh);
+    for (int s = 0; s < 2; s++)
+    {
+        if (map_dump(paths[s], &run->compare_maps[s], &run->compare_sizes[s]) != 0)
+        {
+            fprintf(run->console, "Attempt to open file at - %s - failed! Program exiting!\n", paths[s]);
+            fail_run();
+            return;
+        }
+    }
+
+    struct dataset *batch;
+    do
+    {
+        batch = acquire_batch();
+        batch->seq = run->batches_read++;
+        TRACE_BEGIN("read", batch->seq);
+        batch->shard = 0;
+        batch->shard_end = 0;
+        batch->number_base = 0;
+        batch->line_start = line_counter;
+        batch->tail_line = 0;
+        batch->num_entries = 0;
+
+        /* An unterminated last line ends one past the end of the file, as
+           if its newline were there; the scan never reads that byte. */
+        for (int s = 0; s < 2; s++)
+        {
+            size_t start = pos[s];
+            int n = 0;
+
+            batch->side_text[s] = run->compare_maps[s];
+            batch->side_offsets[s][0] = pos[s];
+            while (n < MAX_ENTRIES_PER_READ && pos[s] < run->compare_sizes[s])
+            {
+                const char *nl = (const char *)memchr(run->compare_maps[s] + pos[s], '\n', run->compare_sizes[s] - pos[s]);
+                pos[s] = nl != NULL ? (size_t)(nl - run->compare_maps[s]) + 1 : run->compare_sizes[s] + 1;
+                batch->side_offsets[s][++n] = pos[s];
+            }
+            batch->side_lines[s] = n;
+            run->compare_lines[s] += n;
+            if (n > batch->num_entries)
+                batch->num_entries = n;
+            telemetry_add(run->progress.bytes_read, (long)(pos[s] - start));
+        }
+
+        batch->shard_end = (pos[0] >= run->compare_sizes[0] && pos[1] >= run->compare_sizes[1]) || run->run_failed;
+        line_counter += batch->num_entries;
+        TRACE_END("read", batch->seq);
+        hand_to_compute(batch);
+    } while (!batch->shard_end);
+
+    sh->lines = line_counter;
+    sh->bytes = (long)(run->compare_sizes[0] + run->compare_sizes[1]);
+
+    gettimeofday(&input_end, NULL);
+    run->input_elapsed += ((input_end.tv_sec - input_start.tv_sec) * 1000) + ((input_end.tv_usec - input_start.tv_usec) / 1000);
+}
+
+/* Split one shard into batches and queue them. Its last batch is marked,
+   and is queued even if empty so the later stages see every shard end. */
+void read_shard(int index, int number_base)
+{
+    struct shard *sh = &run->shards.shards[index];
+
+    /* Try opening file. If file does not exist, exit. */
+    int fd = try_open_file(sh->path);
+    if (fd < 0)
+    {
+        fprintf(run->console, "Attempt to open file at - %s - failed! Program exiting!\n", sh->path);
+        fail_run();
+        return;
+    }
+
+    /* Pipes and sockets are read as a stream: fewer, larger reads, and
+       batches handed on as soon as input pauses. */
+    struct stat st;
+    run->STREAMING = fstat(fd, &st) == 0 && !S_ISREG(st.st_mode);
+    if (run->STREAMING)
+        fcntl(fd, F_SETPIPE_SZ, PIPE_BUFFER_SIZE);
+
+    int line_counter = 0;
+    int eof = 0;
+    size_t filled = 0;  // Bytes of the current batch's text read so far.
+    size_t scanned = 0; // Bytes of the current batch's text already searched for newlines.
+
+    struct dataset *batch = acquire_batch();
+    batch->seq = run->batches_read++;
+    TRACE_BEGIN("read", batch->seq);
+    batch->shard = index;
+    batch->shard_end = 0;
+    batch->number_base = number_base;
+    batch->line_start = 0;
+    batch->num_entries = 0;
+    batch->tail_line = 0;
+    batch->line_offsets[0] = 0;
+
+    struct timeval input_start, input_end;
+    gettimeofday(&input_start, NULL);
+    shard_start(sh);
+
+    while (1)
+    {
+        /* Record where each complete line starts. Scoring is left to the workers. */
+        while (batch->num_entries < MAX_ENTRIES_PER_READ)
+        {
+            char *nl = (char *)memchr(batch->text + scanned, '\n', filled - scanned);
+            if (nl == NULL)
+            {
+                scanned = filled;
+                break;
+            }
+            scanned = (size_t)(nl - batch->text) + 1;
+            batch->line_offsets[++batch->num_entries] = scanned;
+        }
+
+        /* When a stream has nothing more ready, pass on the lines already
+           complete rather than wait for a full batch, so output keeps up
+           with input. Lags past 1 assume only the last batch is short. */
+        int stalled = run->STREAMING && !eof && batch->num_entries > 1 && run->max_lag <= 1 && !input_ready(fd);
+
+        if (batch->num_entries == MAX_ENTRIES_PER_READ || stalled)
+        {
+            /* A paused batch keeps its last line as a tail for the final diff,
+               and that line also starts the next batch. */
+            if (stalled)
+            {
+                batch->num_entries--;
+                batch->tail_line = 1;
+            }
+
+            /* Batch is full, or input paused. Any bytes past its last record start the next batch. */
+            size_t end = batch->line_offsets[batch->num_entries];
+            size_t carry = filled - end;
+            struct dataset *next = acquire_batch();
+            ensure_text_capacity(next, carry + READ_CHUNK_SIZE);
+            memcpy(next->text, batch->text + end, carry);
+
+            /* Add batch to queue. */
+            batch->text_len = batch->line_offsets[batch->num_entries + batch->tail_line];
+            line_counter += batch->num_entries;
+            TRACE_END("read", batch->seq);
+            hand_to_compute(batch);
+
+            /* Prep a new batch. */
+            batch = next;
+            batch->seq = run->batches_read++;
+            TRACE_BEGIN("read", batch->seq);
+            batch->shard = index;
+            batch->shard_end = 0;
+            batch->number_base = number_base;
+            batch->line_start = line_counter;
+            batch->num_entries = 0;
+            batch->tail_line = 0;
+            batch->line_offsets[0] = 0;
+            filled = carry;
+            scanned = 0;
+
+            /* Add time to read batch. */
+            gettimeofday(&input_end, NULL);
+            run->input_elapsed += ((input_end.tv_sec - input_start.tv_sec) * 1000) + ((input_end.tv_usec - input_start.tv_usec) / 1000);
+            gettimeofday(&input_start, NULL);
+            continue;
+        }
+
+        /* A failed run stops reading; what is already here still drains. */
+        if (eof || run->run_failed)
+            break;
+
+        ensure_text_capacity(batch, filled + READ_CHUNK_SIZE + 1);
+        ssize_t n = read_input(fd, batch->text + filled, READ_CHUNK_SIZE);
+        if (n < 0)
+            fprintf(run->errors, "read: %s\n", strerror(errno));
+        if (n <= 0)
+        {
+            eof = 1;
+
+            /* Treat an unterminated last line as a complete line. */
+            if (filled > batch->line_offsets[batch->num_entries])
+                batch->text[filled++] = '\n';
+            continue;
+        }
+        filled += (size_t)n;
+        sh->bytes += n;
+        telemetry_add(run->progress.bytes_read, n);
+    }
+
+    /* Add the last batch to queue, even if the file ended on a batch boundary. */
+    batch->text_len = scanned;
+    batch->shard_end = 1;
+    line_counter += batch->num_entries;
+    sh->lines = line_counter;
+    TRACE_END("read", batch->seq);
+    hand_to_compute(batch);
+
+    /* Add time to read last batch. */
+    gettimeofday(&input_end, NULL);
+    run->input_elapsed += ((input_end.tv_sec - input_start.tv_sec) * 1000) + ((input_end.tv_usec - input_start.tv_usec) / 1000);
+
+    /* Close file. */
+    try_close_file(fd);
+}
+
+/* Write one finished batch's records. */
+void output_batch(struct dataset *b)
+{
+    struct timeval output_start, output_end;
+    struct iovec iov[NUM_FORMAT_BLOCKS];
+
+    /* Start output timer. */
+    gettimeofday(&output_start, NULL);
+    TRACE_BEGIN("write", b->seq);
+
+    /* With -O each shard gets its own file, opened when its first batch arrives. */
+    struct shard *sh = &run->shards.shards[b->shard];
+    struct sink *dst = run->results;
+    if (run->shard_dir != NULL)
+    {
+        if (sh->out == NULL)
+            sh->out = open_shard_output(sh);
+        dst = sh->out;
+    }
+
+    /* Records were already formatted by the workers, one slot per
+       block. Hand the slots to the kernel as they are, in order, unless
+       the workers already wrote them. */
+    int num_blocks = b->out_blocks;
+    for (int block = 0; block < num_blocks; block++)
+    {
+        iov[block].iov_base = b->out + (size_t)block * FORMAT_BLOCK * run->record_len;
+        iov[block].iov_len = b->out_lens[block];
+    }
+    if (!run->POSITIONED_WRITES)
+        sink_writev(dst, iov, num_blocks);
+    check_sink(dst);
+    telemetry_add(run->progress.records_written, b->num_records);
+    run->lines_matched += b->num_records;
+    TRACE_END("write", b->seq);
+
+    if (b->shard_end)
+    {
+        if (run->shard_dir != NULL)
+        {
+            sink_close(dst);
+            check_sink(dst);
+        }
+        shard_finish(sh);
+    }
+
+    /* Cleanup. writev() has copied the records, so hand dataset back to the
+       pool for reuse. */
+    release_batch(b);
+
+    /* Stop output timer and add time elapsed. */
+    gettimeofday(&output_end, NULL);
+    run->output_elapsed += ((output_end.tv_sec - output_start.tv_sec) * 1000) + ((output_end.tv_usec - output_start.tv_usec) / 1000);
+}
+
+/* Write the summary, if any, and flush the sinks. */
+void output_teardown()
+{
+    struct timeval output_start, output_end;
+
+    /* Summary mode has no records; its aggregates are the results. */
+    if (run->SUMMARY_MODE)
+    {
+        char *text;
+        size_t len;
+        FILE *mem = open_memstream(&text, &len);
+        summary_print(&run->totals, mem);
+        fclose(mem);
+        sink_write(run->results, text, len);
+        free(text);
+    }
+
+    /* Flush what the sinks still hold. */
+    gettimeofday(&output_start, NULL);
+    sink_close(run->results);
+    check_sink(run->results);
+    gettimeofday(&output_end, NULL);
+    run->output_elapsed += ((output_end.tv_sec - output_start.tv_sec) * 1000) + ((output_end.tv_usec - output_start.tv_usec) / 1000);
+}
+
+void *output_scores(void *r)
+{
+    run = (struct run *)r;
+    TRACE_THREAD("output", -1);
+
+    while (!run->computation_complete_flag || queue_count(run->output_queue) != 0)
+    {
+        struct dataset *b = safe_remove_batch_from_queue(run->output_queue, &run->outq_lock);
+
+        if (b != NULL)
+            output_batch(b);
+    }
+
+    output_teardown();
+
+    pthread_exit(NULL);
+}
+
+/* Open <shard_dir>/<file name>.scores for a shard's records. */
+struct sink *open_shard_output(struct shard *sh)
+{
+    const char *name = strrchr(sh->path, '/');
+    name = name != NULL ? name + 1 : strcmp(sh->path, "-") == 0 ? "stdin" : sh->path;
+
+    /* The sink keeps the name for its report, so the shard owns the string. */
+    size_t len = strlen(run->shard_dir) + strlen(name) + sizeof("/.scores");
+    sh->out_path = (char *)malloc(len);
+    snprintf(sh->out_path, len, "%s/%s.scores", run->shard_dir, name);
+
+    struct sink *s = sink_open(run->cwd, sh->out_path, run->fds[1]);
+    if (s == NULL)
+    {
+        fprintf(run->console, "Attempt to open file at - %s - failed! Program exiting!\n", sh->out_path);
+        fail_run();
+        s = sink_open(run->cwd, "null", run->fds[1]);
+    }
+    return s;
+}
+
+int try_open_file(char *path)
+{
+    /* "-" reads from stdin, usually the read end of a shell pipeline. */
+    if (strcmp(path, "-") == 0)
+        return run->fds[0];
+    return openat(run->cwd, path, O_RDONLY);
+}
+
+int try_close_file(int fd)
+{
+    /* Standard input belongs to whoever started the run. */
+    if (fd == run->fds[0])
+        return 0;
+    return close(fd);
+}
+
+/* Whether a read() on fd would return without blocking. */
+int input_ready(int fd)
+{
+    if (fd == run->fds[0] && run->sniffed_pos < run->sniffed_len)
+        return 1;
+
+    struct pollfd p = { fd, POLLIN, 0 };
+    return poll(&p, 1, 0) != 0;
+}
+
+void ensure_text_capacity(struct dataset *b, size_t needed)
+{
+    if (needed <= b->text_cap)
+        return;
+
+    /* Lines can be megabytes long, so grow geometrically. */
+    size_t cap = b->text_cap * 2;
+    if (cap < needed)
+        cap = needed;
+    b->text = (char *)realloc(b->text, cap);
+    b->text_cap = cap;
+}
+
+/* Pipeline engine: input, compute and output each on a thread of their own. */
+void run_pipeline()
+{
+    /* Thread initialization. */
+    int in_ret_code, comp_ret_code, out_ret_code;
+    pthread_t input_thread, compute_thread, output_thread;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+
+    /* Begin I/O and computation threads, each pinned per the placement plan.
+       A daemon job computes on its own thread, started on the compute CPU. */
+    pin_attr_to_cpu(&attr, placement.input_cpu);
+    in_ret_code = pthread_create(&input_thread, &attr, input_scores, run);
+    pin_attr_to_cpu(&attr, placement.compute_cpu);
+    comp_ret_code = SERVING ? 0 : pthread_create(&compute_thread, &attr, compute_scores, run);
+    pin_attr_to_cpu(&attr, placement.output_cpu);
+    out_ret_code = pthread_create(&output_thread, &attr, output_scores, run);
+
+    /* Standard error checking. */
+    if (in_ret_code)
+    {
+        fprintf(run->console, "ERROR: Return code from pthread_create(&input_thread) is %d.\n", in_ret_code);
+        exit(EXIT_FAILURE);
+    }
+
+    if (comp_ret_code)
+    {
+        fprintf(run->console, "ERROR: Return code from pthread_create(&compute_thread) is %d.\n", comp_ret_code);
+        exit(EXIT_FAILURE);
+    }
+
+    if (out_ret_code)
+    {
+        fprintf(run->console, "ERROR: Return code from pthread_create(&output_thread) is %d.\n", out_ret_code);
+        exit(EXIT_FAILURE);
+    }
+
+    if (SERVING)
+        compute_stage();
+
+    /* Wait for all threads to finish. Block main thread. */
+    in_ret_code = pthread_join(input_thread, NULL);
+    comp_ret_code = SERVING ? 0 : pthread_join(compute_thread, NULL);
+    out_ret_code = pthread_join(output_thread, NULL);
+
+    /* Standard error checking. */
+    if (in_ret_code)
+    {
+        fprintf(run->console, "ERROR: Return code from pthread_create(&input_thread) is %d.\n", in_ret_code);
+        exit(EXIT_FAILURE);
+    }
+
+    if (comp_ret_code)
+    {
+        fprintf(run->console, "ERROR: Return code from pthread_create(&compute_thread) is %d.\n", comp_ret_code);
+        exit(EXIT_FAILURE);
+    }
+
+    if (out_ret_code)
+    {
+        fprintf(run->console, "ERROR: Return code from pthread_create(&output_thread) is %d.\n", out_ret_code);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Fused and pool engines: every batch goes through the stages on this
+   thread, handed from one to the next by call rather than by queue. */
+void run_stages_in_turn()
+{
+    TRACE_THREAD("main", -1);
+    compute_setup();
+    read_all_shards();
+    run->input_complete_flag = 1;
+    compute_teardown();
+    output_teardown();
+}
+
+/* read() that first hands back whatever auto mode read ahead of standard input. */
+ssize_t read_input(int fd, char *buf, size_t len)
+{
+    if (fd == run->fds[0] && run->sniffed != NULL)
+    {
+        if (run->sniffed_pos < run->sniffed_len)
+        {
+            size_t n = run->sniffed_len - run->sniffed_pos < len ? run->sniffed_len - run->sniffed_pos : len;
+            memcpy(buf, run->sniffed + run->sniffed_pos, n);
+            run->sniffed_pos += n;
+            return (ssize_t)n;
+        }
+        if (run->sniffed_eof)
+            return 0;
+    }
+    return read(fd, buf, len);
+}
+
+/* Read up to limit + 1 bytes of standard input ahead, stopping early at end
+   of input or once it has been quiet for STREAM_SNIFF_MS. Returns its size
+   if it ended, or -1 if it is bigger than limit or still open. */
+long sniff_stdin(long limit)
+{
+    run->sniffed = (char *)malloc(limit + 1);
+    while (run->sniffed_len < (size_t)limit + 1)
+    {
+        struct pollfd p = { run->fds[0], POLLIN, 0 };
+        if (poll(&p, 1, STREAM_SNIFF_MS) <= 0)
+            return -1;
+
+        ssize_t n = read(run->fds[0], run->sniffed + run->sniffed_len, limit + 1 - run->sniffed_len);
+        if (n <= 0)
+        {
+            run->sniffed_eof = 1;
+            return (long)run->sniffed_len;
+        }
+        run->sniffed_len += (size_t)n;
+    }
+    return -1;
+}
+
+/* Auto mode: the fused engine for inputs up to fused_max_bytes, the pool
+   engine up to pool_max_bytes, and the pipeline past that. Regular files
+   are sized with stat(); standard input is read ahead to see if it ends
+   soon. Any other stream, or one that stays open, gets the pipeline. */
+int choose_engine()
+{
+    struct stat st;
+
+    load_thresholds();
+    run->input_size = 0;
+    for (int i = 0; i < run->shards.count && run->input_size >= 0; i++)
+    {
+        const char *path = run->shards.shards[i].path;
+        if (strcmp(path, "-") == 0 && run->sniffed == NULL)
+        {
+            long n = sniff_stdin(run->pool_max_bytes);
+            run->input_size = n < 0 ? -1 : run->input_size + n;
+        }
+        else if (strcmp(path, "-") != 0 && fstatat(run->cwd, path, &st, 0) == 0 && S_ISREG(st.st_mode))
+            run->input_size += (long)st.st_size;
+        else
+            run->input_size = -1;
+    }
+
+    if (run->input_size < 0 || run->input_size > run->pool_max_bytes)
+        return ENGINE_PIPELINE;
+    return run->input_size <= run->fused_max_bytes ? ENGINE_FUSED : ENGINE_POOL;
+}
+
+/* Where calibrated thresholds are kept: $SCORECARD_ENGINES, or
+   ~/.scorecard_engines, built in path. */
+char *calibration_path(char *path, size_t len)
+{
+    char *env = getenv("SCORECARD_ENGINES");
+
+    if (env != NULL)
+        return env;
+    snprintf(path, len, "%s/.scorecard_engines", getenv("HOME") != NULL ? getenv("HOME") : ".");
+    return path;
+}
+
+void load_thresholds()
+{
+    run->fused_max_bytes = FUSED_MAX_BYTES;
+    run->pool_max_bytes = POOL_MAX_BYTES;
+
+    char path[4096];
+    FILE *f = fopen(calibration_path(path, sizeof(path)), "r");
+    if (f == NULL)
+        return;
+    long fused, pooled;
+    if (fscanf(f, "%ld %ld", &fused, &pooled) == 2 && fused >= 0 && pooled >= fused)
+    {
+        run->fused_max_bytes = fused;
+        run->pool_max_bytes = pooled;
+    }
+    fclose(f);
+}
+
+/* Best of CALIBRATION_REPS runs of this program with one engine over path,
+   in milliseconds. Each run is a fresh process, so start-up counts too. */
+double time_engine(char *self, int engine, char *threads, char *path)
+{
+    double best = -1;
+    char *args[] = {self, "-E", (char *)engine_names[engine], "-o", "null", "-M", "/dev/null", threads, path, NULL};
+
+    for (int rep = 0; rep < CALIBRATION_REPS; rep++)
+    {
+        struct timeval start, end;
+        int status;
+
+        gettimeofday(&start, NULL);
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            execv("/proc/self/exe", args);
+            _exit(127);
+        }
+        if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            fprintf(run->console, "Calibration run failed! Program exiting!\n");
+            exit(EXIT_FAILURE);
+        }
+        gettimeofday(&end, NULL);
+
+        double ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_usec - start.tv_usec) / 1000.0;
+        if (best < 0 || ms < best)
+            best = ms;
+    }
+    return best;
+}
+
+/* Time every engine on synthetic inputs from 16 kB up to
+   CALIBRATION_MAX_BYTES, and save the largest size each of the fused and
+   pool engines was fastest at as the thresholds for auto mode. */
+void calibrate_engines(char *self, char *threads)
+{
+    char path[] = "/tmp/scorecard_calibrate_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+    {
+        fprintf(run->console, "Attempt to create calibration input failed! Program exiting!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    long fused = 0, pooled = 0, written = 0;
+    unsigned int seed = 12345;
+    char line[256];
+
+    for (long size = 16 << 10; size <= CALIBRATION_MAX_BYTES; size *= 4)
+    {
+        /* Grow the file to size with lines of 0 to 160 letters, like a text dump. */
+        while (written < size)
+        {
+            seed = seed * 1103515245 + 12345;
+            int len = (seed >> 16) % 161;
+            for (int i = 0; i < len; i++)
+                line[i] = 'a' + (char)((seed >> (i % 16)) % 26);
+            line[len] = '\n';
+            if (write(fd, line, len + 1) != len + 1)
+            {
+                fprintf(run->console, "Attempt to write calibration input failed! Program exiting!\n");
+                exit(EXIT_FAILURE);
+            }
+            written += len + 1;
+        }
+
+        double ms[3];
+        for (int e = ENGINE_PIPELINE; e <= ENGINE_FUSED; e++)
+            ms[e] = time_engine(self, e, threads, path);
+
+        int best = ENGINE_PIPELINE;
+        for (int e = ENGINE_POOL; e <= ENGINE_FUSED; e++)
+            if (ms[e] < ms[best])
+                best = e;
+        if (best == ENGINE_FUSED)
+            fused = written;
+        if (best != ENGINE_PIPELINE)
+            pooled = written;
+
+        fprintf(run->console, "DATA, CALIBRATE, %ld bytes, pipeline %.3f ms, pool %.3f ms, fused %.3f ms, best %s\n", written,
+                ms[ENGINE_PIPELINE], ms[ENGINE_POOL], ms[ENGINE_FUSED], engine_names[best]);
+        fflush(run->console);
+    }
+    close(fd);
+    unlink(path);
+
+    if (pooled < fused)
+        pooled = fused;
+    char saved[4096];
+    char *save_path = calibration_path(saved, sizeof(saved));
+    FILE *f = fopen(save_path, "w");
+    if (f == NULL || fprintf(f, "%ld %ld\n", fused, pooled) < 0 || fclose(f) != 0)
+    {
+        fprintf(run->console, "Attempt to save thresholds to - %s - failed! Program exiting!\n", save_path);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(run->console, "DATA, THRESHOLDS, fused up to %ld, pool up to %ld, saved to %s\n", fused, pooled, save_path);
+}
+
+/* Pass a read batch on to compute: through the queue, or straight in when the stages share a thread. */
+void hand_to_compute(struct dataset *b)
+{
+    if (run->STAGES_FUSED)
+        compute_batch(b);
+    else
+        safe_add_batch_to_queue(run->input_queue, &run->inq_lock, b);
+}
+
+/* Pass a finished batch on to output the same way. */
+void hand_to_output(struct dataset *b)
+{
+    if (run->STAGES_FUSED)
+        output_batch(b);
+    else
+        safe_add_batch_to_queue(run->output_queue, &run->outq_lock, b);
+}
+
+void safe_add_batch_to_queue(struct Queue *q, pthread_mutex_t *l, struct dataset *b)
+{
+    /* Grab lock to protect queue, enqueue, release lock. */
+    pthread_mutex_lock(l);
+    enqueue(q, (void *)b);
+    pthread_mutex_unlock(l);
+}
+
+struct dataset *safe_remove_batch_from_queue(struct Queue *q, pthread_mutex_t *l)
+{
+    /* Grab lock to protect queue, dequeue, release lock. */
+    pthread_mutex_lock(l);
+    struct dataset *b = (struct dataset *)dequeue(q);
+    pthread_mutex_unlock(l);
+
+    return b;
+}
+
+void fill_batch_pool()
+{
+    pthread_mutex_lock(&run->pool_lock);
+    make_batches();
+    for (int i = 0; i < BATCH_POOL_SIZE; i++)
+        enqueue(run->batch_pool, (void *)run->batches[i]);
+    run->batch_pool_node = cpu_node(&topology, sched_getcpu());
+    pthread_cond_broadcast(&run->pool_cv);
+    pthread_mutex_unlock(&run->pool_lock);
+}
+
+/* Take the run's batches from the warm ones, allocating any that are
+   missing, and size them all for this run. A daemon's batches are mostly
+   there from its earlier jobs. */
+void make_batches()
+{
+    for (int i = 0; i < BATCH_POOL_SIZE; i++)
+    {
+        /* Writing every page here places it on the calling thread's NUMA node. */
+        struct dataset *b = safe_remove_batch_from_queue(warm_batches, &warm_lock);
+        if (b == NULL)
+        {
+            b = (struct dataset *)malloc(sizeof(struct dataset));
+            memset(b, 0, sizeof(struct dataset));
+            b->text_cap = INITIAL_TEXT_SIZE;
+            b->text = (char *)malloc(b->text_cap);
+            memset(b->text, 0, b->text_cap);
+        }
+        b->run = run;
+        run->batches[i] = b;
+        size_batch(b);
+    }
+}
+
+/* Grow b's record, lag and window buffers to what this run's options need.
+   They are never shrunk, so a warm batch only pays when a job asks for
+   more columns than any job before it. Score and diff columns, which
+   change width batch by batch, are sized to this run's metrics exactly. */
+void size_batch(struct dataset *b)
+{
+    if (column_bytes(0) != b->columns_cap)
+    {
+        free(b->columns);
+        b->columns_cap = column_bytes(0);
+        b->columns = (char *)malloc(b->columns_cap);
+        memset(b->columns, 0, b->columns_cap);
+    }
+
+    size_t out_len = (size_t)MAX_ENTRIES_PER_READ * run->record_len;
+    if (out_len > b->out_cap)
+    {
+        free(b->out);
+        b->out = (char *)malloc(out_len);
+        memset(b->out, 0, out_len);
+        b->out_cap = out_len;
+    }
+    if (run->max_lag > b->lookahead_cap)
+    {
+        free(b->lookahead);
+        b->lookahead = (long *)calloc(run->max_lag, sizeof(long));
+        b->lookahead_cap = run->max_lag;
+    }
+    if (run->NUM_LAGS > b->lags_cap)
+    {
+        free(b->lag_out);
+        b->lag_out = (long *)calloc((size_t)run->NUM_LAGS * MAX_ENTRIES_PER_READ, sizeof(long));
+        b->lags_cap = run->NUM_LAGS;
+    }
+    if (run->NUM_WINDOWS > 0 && run->max_window > b->history_cap)
+    {
+        free(b->window_src);
+        b->window_src = (long *)calloc(run->max_window - 1 + MAX_ENTRIES_PER_READ, sizeof(long));
+        b->history_cap = run->max_window;
+    }
+    if (run->NUM_WINDOWS > b->windows_cap)
+    {
+        size_t cells = (size_t)run->NUM_WINDOWS * MAX_ENTRIES_PER_READ;
+        free(b->win_mean);
+        free(b->win_min);
+        free(b->win_max);
+        free(b->win_std);
+        b->win_mean = (double *)calloc(cells, sizeof(double));
+        b->win_min = (long *)calloc(cells, sizeof(long));
+        b->win_max = (long *)calloc(cells, sizeof(long));
+        b->win_std = (double *)calloc(cells, sizeof(double));
+        b->windows_cap = run->NUM_WINDOWS;
+    }
+}
+
+/* Bytes of score and diff columns a batch needs for this run's metrics,
+   with 64-bit columns throughout if wide is set. Hashes are always 64-bit. */
+size_t column_bytes(int wide)
+{
+    size_t bytes = 0;
+
+    for (int m = 0; m < NUM_METRICS; m++)
+        if (run->METRICS & metric_table[m].flag)
+            bytes += 2 * (size_t)MAX_ENTRIES_PER_READ
+                     * (wide || !metric_table[m].diffable ? sizeof(long) : sizeof(int32_t));
+    return bytes;
+}
+
+/* Point b's score and diff columns into its backing store, at b's width. */
+void lay_out_columns(struct dataset *b)
+{
+    char *p = b->columns;
+
+    for (int m = 0; m < NUM_METRICS; m++)
+    {
+        b->line_scores[m] = b->line_diffs[m] = NULL;
+        if (!(run->METRICS & metric_table[m].flag))
+            continue;
+
+        size_t len = (size_t)MAX_ENTRIES_PER_READ * (narrow_column(b, m) ? sizeof(int32_t) : sizeof(long));
+        b->line_scores[m] = p;
+        b->line_diffs[m] = p + len;
+        p += 2 * len;
+    }
+}
+
+/* Move b to 64-bit columns, keeping its scores. Its diffs are not made yet.
+   Called from the compute thread only, between parallel steps. */
+void widen_batch(struct dataset *b)
+{
+    size_t bytes = column_bytes(1);
+    char *old = b->columns;
+    void *old_scores[NUM_METRICS];
+    int was_narrow[NUM_METRICS];
+
+    for (int m = 0; m < NUM_METRICS; m++)
+    {
+        old_scores[m] = b->line_scores[m];
+        was_narrow[m] = narrow_column(b, m);
+    }
+
+    b->columns = (char *)malloc(bytes);
+    b->columns_cap = bytes;
+    b->wide = 1;
+    b->overflow = 0;
+    lay_out_columns(b);
+
+    int n = b->num_entries + b->tail_line;
+    for (int m = 0; m < NUM_METRICS; m++)
+    {
+        if (old_scores[m] == NULL)
+            continue;
+        long *dst = (long *)b->line_scores[m];
+        if (was_narrow[m])
+            for (int i = 0; i < n; i++)
+                dst[i] = ((int32_t *)old_scores[m])[i];
+        else
+            memcpy(dst, old_scores[m], n * sizeof(long));
+    }
+    free(old);
+    run->batches_widened++;
+}
+
+/* Is metric m's column in b 32-bit? */
+int narrow_column(struct dataset *b, int m)
+{
+    return !b->wide && metric_table[m].diffable;
+}
+
+/* Score of line i of b in metric m, whatever the column's width. */
+long score_at(struct dataset *b, int m, int i)
+{
+    return narrow_column(b, m) ? ((int32_t *)b->line_scores[m])[i] : ((long *)b->line_scores[m])[i];
+}
+
+/* Copy n scores of metric m from line i of b into dst, as long. */
+void copy_scores(long *dst, struct dataset *b, int m, int i, int n)
+{
+    if (!narrow_column(b, m))
+    {
+        memcpy(dst, (long *)b->line_scores[m] + i, n * sizeof(long));
+        return;
+    }
+    for (int k = 0; k < n; k++)
+        dst[k] = ((int32_t *)b->line_scores[m])[i + k];
+}
+
+struct dataset *acquire_batch()
+{
+    /* Block until the output stage hands a dataset back. Bounds memory use. */
+    pthread_mutex_lock(&run->pool_lock);
+    while (run->batch_pool->count == 0)
+        pthread_cond_wait(&run->pool_cv, &run->pool_lock);
+    struct dataset *b = (struct dataset *)dequeue(run->batch_pool);
+    pthread_mutex_unlock(&run->pool_lock);
+
+    /* Every batch starts out with 32-bit columns; one widened on its last
+       use gives its 64-bit ones back, so the footprint stays what it needs. */
+    if (b->wide)
+    {
+        free(b->columns);
+        b->columns_cap = column_bytes(0);
+        b->columns = (char *)malloc(b->columns_cap);
+    }
+    b->wide = 0;
+    b->overflow = 0;
+    lay_out_columns(b);
+
+    return b;
+}
+
+void release_batch(struct dataset *b)
+{
+    pthread_mutex_lock(&run->pool_lock);
+    enqueue(run->batch_pool, (void *)b);
+    pthread_cond_signal(&run->pool_cv);
+    pthread_mutex_unlock(&run->pool_lock);
+}
+
+/* Parse a comma-separated list of up to max integers in [min, limit] into
+   out. Returns how many were read, or -1 if the list is malformed. */
+int parse_int_list(const char *list, int *out, int max, int min, int limit)
+{
+    int count = 0;
+    const char *p = list;
+
+    while (*p != '\0')
+    {
+        char *end;
+        long v = strtol(p, &end, 10);
+        if (end == p || v < min || v > limit || count == max)
+            return -1;
+        out[count++] = (int)v;
+
+        p = end;
+        if (*p == ',')
+            p++;
+        else if (*p != '\0')
+            return -1;
+    }
+
+    return count > 0 ? count : -1;
+}
+
+/* Read a run's options into run. Returns the index of its first positional
+   argument, or -1 if an option is bad. getopt() keeps its place in globals,
+   so the daemon's jobs take turns here. */
+int parse_options(int argc, char *argv[])
+{
+    int opt;
+    optind = 0;
+    opterr = !SERVING;
+    run->AFFINITY_MODE = AFFINITY_NONE;
+    run->METRICS = METRIC_SUM;
+    run->NUM_LAGS = 0;
+    run->NUM_WINDOWS = 0;
+    run->SUMMARY_MODE = 0;
+    run->num_sink_specs = 0;
+    run->metrics_out = run->console;
+    run->RESTART_NUMBERING = 0;
+    run->shard_dir = NULL;
+    run->ADAPTIVE = 0;
+    run->telemetry_spec = NULL;
+    run->telemetry_interval = TELEMETRY_INTERVAL_MS;
+    run->trace_path = NULL;
+    run->ENGINE = ENGINE_PIPELINE;
+    run->FILTER_MODE = 0;
+    run->PREFIX_MODE = PREFIX_NONE;
+    run->POSITIONED_WRITES = 0;
+    run->KERNEL_ISA = SERVING ? -1 : kernels_detect();
+    run->compare_path = NULL;
+    run->results = NULL;
+    while ((opt = getopt(argc, argv, "a:m:l:w:s:o:M:n:O:A:T:t:X:E:f:P:WI:C:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'a':
+            run->AFFINITY_MODE = parse_affinity_mode(optarg);
+            run->affinity_list = optarg;
+            break;
+        case 'm':
+            run->METRICS = parse_metrics(optarg);
+            if (run->METRICS < 0)
+            {
+                fprintf(run->console, "Invalid metrics - %s - given! Program exiting!\n", optarg);
+                return -1;
+            }
+            break;
+        case 'l':
+            run->NUM_LAGS = parse_int_list(optarg, run->lags, MAX_LAGS, 1, MAX_ENTRIES_PER_READ);
+            if (run->NUM_LAGS < 0)
+            {
+                fprintf(run->console, "Invalid lags - %s - given! Program exiting!\n", optarg);
+                return -1;
+            }
+            break;
+        case 'w':
+            run->NUM_WINDOWS = parse_int_list(optarg, run->windows, MAX_WINDOWS, 1, MAX_WINDOW_LEN);
+            if (run->NUM_WINDOWS < 0)
+            {
+                fprintf(run->console, "Invalid windows - %s - given! Program exiting!\n", optarg);
+                return -1;
+            }
+            break;
+        case 's':
+            run->SUMMARY_MODE = 1;
+            run->SUMMARY_K = (int)strtol(optarg, (char **)NULL, 10);
+            if (run->SUMMARY_K < 0 || run->SUMMARY_K > SUMMARY_MAX_TOP)
+            {
+                fprintf(run->console, "Invalid top K - %s - given! Program exiting!\n", optarg);
+                return -1;
+            }
+            break;
+        case 'o':
+            if (run->num_sink_specs == MAX_TEE_SINKS)
+            {
+                fprintf(run->console, "At most %d outputs can be given! Program exiting!\n", MAX_TEE_SINKS);
+                return -1;
+            }
+            run->sink_specs[run->num_sink_specs++] = optarg;
+            break;
+        case 'M':
+            if (strcmp(optarg, "stderr") == 0)
+                run->metrics_out = run->errors;
+            else if (strcmp(optarg, "stdout") != 0)
+            {
+                int fd = openat(run->cwd, optarg, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+                run->metrics_out = fd >= 0 ? fdopen(fd, "w") : NULL;
+            }
+            if (run->metrics_out == NULL)
+            {
+                fprintf(run->console, "Attempt to open file at - %s - failed! Program exiting!\n", optarg);
+                return -1;
+            }
+            break;
+        case 'n':
+            if (strcmp(optarg, "restart") == 0)
+                run->RESTART_NUMBERING = 1;
+            else if (strcmp(optarg, "continue") != 0)
+            {
+                fprintf(run->console, "Invalid numbering - %s - given! Program exiting!\n", optarg);
+                return -1;
+            }
+            break;
+        case 'O':
+            run->shard_dir = optarg;
+            break;
+        case 'A':
+            run->ADAPTIVE = 1;
+            if (sscanf(optarg, "%d:%d", &run->min_workers, &run->max_workers) != 2 || run->min_workers < 1 || run->max_workers < run->min_workers)
+            {
+                fprintf(run->console, "Invalid worker range - %s - given! Program exiting!\n", optarg);
+                return -1;
+            }
+            break;
+        case 'T':
+            run->telemetry_spec = optarg;
+            break;
+        case 'f':
+            /* "T" keeps |diff| >= T; "lo:hi" keeps lo <= diff <= hi. */
+            run->FILTER_MODE = 1;
+            run->filter_spec = optarg;
+            if (sscanf(optarg, "%ld:%ld", &run->filter_min, &run->filter_max) == 2 && run->filter_min <= run->filter_max)
+                run->filter_outside = 0;
+            else if (strchr(optarg, ':') == NULL && sscanf(optarg, "%ld", &run->filter_max) == 1 && run->filter_max >= 0)
+            {
+                /* Outside (-T, T) is |diff| >= T, with no overflow at the ends. */
+                run->filter_min = 1 - run->filter_max;
+                run->filter_max = run->filter_max - 1;
+                run->filter_outside = 1;
+            }
+            else
+            {
+                fprintf(run->console, "Invalid filter - %s - given! Program exiting!\n", optarg);
+                return -1;
+            }
+            break;
+        case 'P':
+            if (strcmp(optarg, "text") == 0)
+                run->PREFIX_MODE = PREFIX_TEXT;
+            else if (strcmp(optarg, "binary") == 0)
+                run->PREFIX_MODE = PREFIX_BINARY;
+            else
+            {
+                fprintf(run->console, "Invalid prefix format - %s - given! Program exiting!\n", optarg);
+                return -1;
+            }
+            break;
+        case 'W':
+            run->POSITIONED_WRITES = 1;
+            break;
+        case 'C':
+            run->compare_path = optarg;
+            break;
+        case 'I':
+            run->KERNEL_ISA = kernels_parse_isa(optarg);
+            if (run->KERNEL_ISA < 0)
+            {
+                fprintf(run->console, "Invalid kernel build - %s - given! Program exiting!\n", optarg);
+                return -1;
+            }
+            break;
+        case 'E':
+            run->ENGINE = -1;
+            for (int e = ENGINE_PIPELINE; e <= ENGINE_CALIBRATE; e++)
+                if (strcmp(optarg, engine_names[e]) == 0)
+                    run->ENGINE = e;
+            if (run->ENGINE < 0)
+            {
+                fprintf(run->console, "Invalid engine - %s - given! Program exiting!\n", optarg);
+                return -1;
+            }
+            break;
+        case 'X':
+#ifndef TRACE
+            fprintf(run->console, "Tracing needs a build with \"make TRACE=1\"! Program exiting!\n");
+            return -1;
+#endif
+            run->trace_path = optarg;
+            break;
+        case 't':
+            run->telemetry_interval = (int)strtol(optarg, (char **)NULL, 10);
+            if (run->telemetry_interval < 1)
+            {
+                fprintf(run->console, "Invalid telemetry interval - %s - given! Program exiting!\n", optarg);
+                return -1;
+            }
+            break;
+        default:
+            fprintf(run->console, "Usage: %s [-a none|compact|spread|<cpulist>] [-m sum,codepoints,chars,words,hash] [-l lags] [-w windows] [-s top_k] [-o stdout|null|<file>]... [-M stdout|stderr|<file>] [-n continue|restart] [-O dir] [-A min:max] [-T stderr|unix:<path>|<file>] [-t ms] [-X trace.json] [-E auto|fused|pool|pipeline|calibrate] [-f T|lo:hi] [-P text|binary] [-W] [-I base|avx2|avx512] [-C old_dump] [threads] [path|dir|glob]...\n", argv[0]);
+            return -1;
+        }
+    }
+    return optind;
+}
+
+/* One run of the scorecard with the given command line. Returns its exit
+   status; a run that cannot go ahead leaves through end_run(). */
+int run_job(int argc, char *argv[])
+{
+    /* Parse options. Positional arguments follow as before. glibc's getopt
+       starts over on a new argv when optind is 0, as each daemon job needs. */
+    static pthread_mutex_t getopt_lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&getopt_lock);
+    int first = parse_options(argc, argv);
+    pthread_mutex_unlock(&getopt_lock);
+    if (first < 0)
+        end_run(EXIT_FAILURE);
+
+    char *self = argv[0];
+    argc -= first - 1;
+    argv += first - 1;
+
+    /* The daemon placed its workers and threads and picked its kernels
+       when it started, and its one process cannot be traced or re-run per
+       job. Its jobs share the workers, so none may resize them either. */
+    if (SERVING && (run->AFFINITY_MODE != AFFINITY_NONE || run->ADAPTIVE || run->trace_path != NULL || run->ENGINE == ENGINE_CALIBRATE
+                    || run->KERNEL_ISA >= 0))
+    {
+        fprintf(run->console, "Daemon jobs take no -a, -A, -I, -X or -E calibrate; start the daemon with -a or -I! Program exiting!\n");
+        end_run(EXIT_FAILURE);
+    }
+
+    /* Open the result sinks. Several -o options write the same records to each. */
+    struct sink *opened[MAX_TEE_SINKS];
+    if (run->num_sink_specs == 0)
+        run->sink_specs[run->num_sink_specs++] = "stdout";
+    for (int i = 0; i < run->num_sink_specs; i++)
+    {
+        opened[i] = sink_open(run->cwd, run->sink_specs[i], run->fds[1]);
+        if (opened[i] == NULL)
+        {
+            for (int j = 0; j < i; j++)
+            {
+                sink_close(opened[j]);
+                sink_free(opened[j]);
+            }
+            fprintf(run->console, "Attempt to open file at - %s - failed! Program exiting!\n", run->sink_specs[i]);
+            end_run(EXIT_FAILURE);
+        }
+    }
+    run->results = run->num_sink_specs == 1 ? opened[0] : sink_tee(opened, run->num_sink_specs);
+
+    /* Positioned writes need one file to place the records in. */
+    if (run->POSITIONED_WRITES && (run->SUMMARY_MODE || (run->shard_dir == NULL && run->results->kind != SINK_FILE)))
+    {
+        fprintf(run->console, "-W writes records into a single file given with -o or -O! Program exiting!\n");
+        end_run(EXIT_FAILURE);
+    }
+
+    /* A build the CPU lacks would die on its first instruction. A daemon
+       picked its build when it started. */
+    if (!SERVING && kernels_use(run->KERNEL_ISA) != 0)
+    {
+        fprintf(run->console, "This CPU cannot run the %s kernels! Program exiting!\n", kernels_isa_name(run->KERNEL_ISA));
+        end_run(EXIT_FAILURE);
+    }
+
+    /* Pick the scan loop built for exactly this set of metrics. */
+    run->scan_kernel = select_scan_kernel(run->METRICS);
+    run->num_columns = 0;
+    for (int m = 0; m < NUM_METRICS; m++)
+    {
+        if (run->METRICS & metric_table[m].flag)
+        {
+            run->column_metric[run->num_columns] = m;
+            run->num_columns++;
+        }
+    }
+
+    /* Lags and windows follow the first metric that can be diffed. */
+    run->primary_metric = -1;
+    for (int m = NUM_METRICS - 1; m >= 0; m--)
+        if ((run->METRICS & metric_table[m].flag) && metric_table[m].diffable)
+            run->primary_metric = m;
+    if ((run->NUM_LAGS > 0 || run->NUM_WINDOWS > 0 || run->SUMMARY_MODE || run->FILTER_MODE || run->PREFIX_MODE || run->compare_path != NULL)
+        && run->primary_metric < 0)
+    {
+        fprintf(run->console, "Lags, windows, summaries, filters, prefix sums and comparisons need a metric other than hash! Program exiting!\n");
+        end_run(EXIT_FAILURE);
+    }
+    if (run->compare_path != NULL && (run->NUM_LAGS > 0 || run->NUM_WINDOWS > 0 || run->FILTER_MODE || run->PREFIX_MODE))
+    {
+        fprintf(run->console, "Comparisons write score changes, so they take no lags, windows, filter or prefix sums! Program exiting!\n");
+        end_run(EXIT_FAILURE);
+    }
+
+    /* A comparison scores only the primary metric, of both dumps. */
+    if (run->compare_path != NULL)
+        run->scan_kernel = select_scan_kernel(metric_table[run->primary_metric].flag);
+    if (run->SUMMARY_MODE && (run->NUM_LAGS > 0 || run->NUM_WINDOWS > 0))
+    {
+        fprintf(run->console, "Summary mode does not take lags or windows! Program exiting!\n");
+        end_run(EXIT_FAILURE);
+    }
+    if (run->SUMMARY_MODE && run->FILTER_MODE)
+    {
+        fprintf(run->console, "Summary mode does not take a filter! Program exiting!\n");
+        end_run(EXIT_FAILURE);
+    }
+    if (run->PREFIX_MODE && (run->NUM_LAGS > 0 || run->NUM_WINDOWS > 0 || run->SUMMARY_MODE || run->FILTER_MODE))
+    {
+        fprintf(run->console, "Prefix sums replace the diffs, so they take no lags, windows, summary or filter! Program exiting!\n");
+        end_run(EXIT_FAILURE);
+    }
+
+    /* Binary records would be mixed in with the report on stdout. */
+    if (run->PREFIX_MODE == PREFIX_BINARY && run->metrics_out == run->console)
+        run->metrics_out = run->errors;
+    if (run->SUMMARY_MODE && run->shard_dir != NULL)
+    {
+        fprintf(run->console, "Summary mode writes no per-shard outputs! Program exiting!\n");
+        end_run(EXIT_FAILURE);
+    }
+
+    run->max_lag = 0;
+    for (int i = 0; i < run->NUM_LAGS; i++)
+        if (run->lags[i] > run->max_lag)
+            run->max_lag = run->lags[i];
+    run->max_window = 1;
+    for (int i = 0; i < run->NUM_WINDOWS; i++)
+        if (run->windows[i] > run->max_window)
+            run->max_window = run->windows[i];
+    run->window_history = (long *)calloc(run->max_window, sizeof(long));
+    run->window_chunk = run->max_window > FORMAT_BLOCK ? run->max_window : FORMAT_BLOCK;
+    run->record_len = RECORD_PREFIX_LEN + (size_t)(run->num_columns + run->NUM_LAGS + 4 * run->NUM_WINDOWS) * MAX_FIELD_LEN;
+
+    /* Initialize number of compute threads. */
+    if (argc > 1)
+    {
+        run->NUM_COMPUTE_THREADS = (int)strtol(argv[1], (char **)NULL, 10);
+    }
+    else
+    {
+        run->NUM_COMPUTE_THREADS = 1;
+    }
+
+    /* A daemon job uses up to the workers the daemon started with. */
+    if (SERVING && (run->NUM_COMPUTE_THREADS < 1 || run->NUM_COMPUTE_THREADS > pool->num_workers))
+        run->NUM_COMPUTE_THREADS = pool->num_workers;
+
+    if (run->ENGINE == ENGINE_CALIBRATE)
+    {
+        calibrate_engines(self, argc > 1 ? argv[1] : "1");
+        return 0;
+    }
+
+    /* Grab file paths, directories or globs from cmdline arguments. Default to wiki_dump. */
+    shards_init(&run->shards);
+    if (argc > 2)
+    {
+        for (int i = 2; i < argc; i++)
+        {
+            if (shards_add(&run->shards, run->cwd, argv[i]) != 0)
+            {
+                fprintf(run->console, "No input files found for - %s - given! Program exiting!\n", argv[i]);
+                end_run(EXIT_FAILURE);
+            }
+        }
+    }
+    else
+    {
+        shards_add(&run->shards, run->cwd, "/homes/dan/625/wiki_dump.txt");
+    }
+    if (run->shards.count == 0)
+    {
+        fprintf(run->console, "No input files given! Program exiting!\n");
+        end_run(EXIT_FAILURE);
+    }
+
+    /* Both dumps are mapped, so both must be regular files. */
+    struct stat cmp_old, cmp_new;
+    if (run->compare_path != NULL && (run->shards.count != 1 || fstatat(run->cwd, run->compare_path, &cmp_old, 0) != 0
+                                      || !S_ISREG(cmp_old.st_mode) || fstatat(run->cwd, run->shards.shards[0].path, &cmp_new, 0) != 0
+                                      || !S_ISREG(cmp_new.st_mode)))
+    {
+        fprintf(run->console, "A comparison takes two regular files, -C old and one input! Program exiting!\n");
+        end_run(EXIT_FAILURE);
+    }
+
+    /* A file that will not open would end the daemon from the input thread, so check here. */
+    for (int i = 0; i < run->shards.count && SERVING; i++)
+    {
+        if (strcmp(run->shards.shards[i].path, "-") != 0 && faccessat(run->cwd, run->shards.shards[i].path, R_OK, 0) != 0)
+        {
+            fprintf(run->console, "Attempt to open file at - %s - failed! Program exiting!\n", run->shards.shards[i].path);
+            end_run(EXIT_FAILURE);
+        }
+    }
+
+    /* Pick how to run. Small inputs skip the threads and queues the pipeline needs. */
+    run->engine_used = run->ENGINE == ENGINE_AUTO ? choose_engine() : run->ENGINE;
+    if (run->ADAPTIVE && run->engine_used != ENGINE_PIPELINE)
+    {
+        if (run->ENGINE != ENGINE_AUTO)
+        {
+            fprintf(run->console, "Adaptive workers need the pipeline engine! Program exiting!\n");
+            end_run(EXIT_FAILURE);
+        }
+        run->engine_used = ENGINE_PIPELINE;
+    }
+    if (run->engine_used == ENGINE_FUSED)
+        run->NUM_COMPUTE_THREADS = 1;
+    else if (run->engine_used == ENGINE_POOL && run->NUM_COMPUTE_THREADS > POOL_ENGINE_WORKERS)
+        run->NUM_COMPUTE_THREADS = POOL_ENGINE_WORKERS;
+    run->STAGES_FUSED = run->engine_used != ENGINE_PIPELINE;
+
+    /* Perform variable initialization. */
+    init_vars();
+
+    /* Work out where each stage and worker should run. A daemon did this once. */
+    if (!SERVING)
+        detect_topology(&topology);
+
+    /* Adaptive runs never go past the CPUs the affinity mask and the
+       cgroup quota allow. threads picks the starting count. */
+    run->cgroup_limit = cgroup_cpu_limit();
+    run->active_workers = run->NUM_COMPUTE_THREADS;
+    if (run->ADAPTIVE)
+    {
+        int limit = topology.num_cpus > 0 ? topology.num_cpus : 1;
+        if (run->cgroup_limit > 0 && run->cgroup_limit < limit)
+            limit = run->cgroup_limit;
+        if (run->max_workers > limit)
+            run->max_workers = limit;
+        if (run->min_workers > run->max_workers)
+            run->min_workers = run->max_workers;
+
+        run->NUM_COMPUTE_THREADS = run->max_workers;
+        run->active_workers = argc > 1 ? run->active_workers : run->min_workers;
+        if (run->active_workers < run->min_workers)
+            run->active_workers = run->min_workers;
+        if (run->active_workers > run->max_workers)
+            run->active_workers = run->max_workers;
+    }
+    if (!SERVING && plan_placement(&topology, run->AFFINITY_MODE, run->affinity_list, run->NUM_COMPUTE_THREADS, &placement) != 0)
+    {
+        fprintf(run->console, "Invalid affinity - %s - given! Program exiting!\n", run->affinity_list);
+        end_run(EXIT_FAILURE);
+    }
+
+    /* Start overall timer. */
+    struct timeval overall_start, overall_end;
+    gettimeofday(&overall_start, NULL);
+    run->run_start = overall_start;
+
+    if (run->trace_path != NULL)
+        TRACE_START();
+
+    /* Sample progress from a thread of its own, off the pinned CPUs' critical path. */
+    run->telemetry = NULL;
+    if (run->telemetry_spec != NULL)
+    {
+        run->telemetry = telemetry_start(run->telemetry_spec, run->cwd, run->errors, run->telemetry_interval, &run->progress,
+                                         &run->input_queue->count, &run->output_queue->count);
+        if (run->telemetry == NULL)
+        {
+            fprintf(run->console, "Attempt to open telemetry output - %s - failed! Program exiting!\n", run->telemetry_spec);
+            end_run(EXIT_FAILURE);
+        }
+    }
+
+    /* Small inputs run the stages in turn rather than pay for the pipeline's threads. */
+    if (run->STAGES_FUSED)
+        run_stages_in_turn();
+    else
+        run_pipeline();
+
+    if (run->telemetry != NULL)
+        telemetry_stop(run->telemetry);
+    run->telemetry = NULL;
+
+    /* Every traced thread has stopped, so the rings can be read. */
+    if (run->trace_path != NULL && TRACE_WRITE(run->trace_path) != 0)
+        fprintf(run->console, "Attempt to write trace to - %s - failed!\n", run->trace_path);
+
+    /* Stop overall timer and calculate time elapsed. */
+    gettimeofday(&overall_end, NULL);
+    run->overall_elapsed = ((overall_end.tv_sec - overall_start.tv_sec) * 1000) + ((overall_end.tv_usec - overall_start.tv_usec) / 1000);
+
+    /* Output TIME and DATA measurements. Worker stats are freed by cleanup. */
+    output_performance();
+
+    /* Perform cleanup. */
+    cleanup_vars();
+
+    return run->run_failed ? EXIT_FAILURE : 0;
+}
+
+/* Leave a run that cannot go ahead with status. A daemon job goes back to
+   its thread in the daemon, which answers the client. */
+void end_run(int status)
+{
+    if (SERVING)
+        longjmp(run->job_abort, status);
+    exit(status);
+}
+
+/* Fail a run whose stages are already going. Those threads cannot leave
+   through end_run(), so a daemon job is marked failed instead: input stops,
+   the batches in flight drain, and the client is answered with status 1
+   once the run has wound down. A direct run just exits. */
+void fail_run()
+{
+    if (!SERVING)
+        exit(EXIT_FAILURE);
+    run->run_failed = 1;
+}
+
+/* Fail the run if a write to s, or to one of its copies, did not go
+   through, as when a client's pipe was closed under it. Later writes to
+   it are dropped by the sink. */
+void check_sink(struct sink *s)
+{
+    struct sink *bad = sink_failed(s);
+
+    if (bad == NULL || run->run_failed)
+        return;
+    fprintf(run->errors, "Attempt to write to - %s - failed: %s! Program exiting!\n", bad->name, strerror(bad->error));
+    fail_run();
+}
+
+/* Release what a daemon job had opened before it was turned down. Every
+   check comes before the stages start, so that is only its options. */
+void abandon_run()
+{
+    if (run->results != NULL)
+    {
+        sink_close(run->results);
+        sink_free(run->results);
+        run->results = NULL;
+    }
+    if (run->metrics_out != run->console && run->metrics_out != run->errors && run->metrics_out != NULL)
+        fclose(run->metrics_out);
+    shards_free(&run->shards);
+    free(run->window_history);
+    free(run->sniffed);
+    run->window_history = NULL;
+    run->sniffed = NULL;
+    run->sniffed_len = run->sniffed_pos = 0;
+    run->sniffed_eof = 0;
+}
+
+void stop_on_signal(int sig)
+{
+    (void)sig;
+    stop_serving = 1;
+}
+
+/* One daemon job, on a thread of its own so jobs run side by side. It
+   gets a run of its own, with the client's standard streams and working
+   directory, and shares the daemon's workers and warm batches. */
+void *serve_job(void *j)
+{
+    struct daemon_job *job = (struct daemon_job *)j;
+    int status = EXIT_FAILURE;
+
+    run = (struct run *)calloc(1, sizeof(struct run));
+    run->job_number = __atomic_add_fetch(&jobs_served, 1, __ATOMIC_RELAXED);
+    run->cwd = open(job->cwd, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    memcpy(run->fds, job->fds, sizeof(run->fds));
+    run->console = fdopen(dup(job->fds[1]), "w");
+    run->errors = fdopen(dup(job->fds[2]), "w");
+
+    if (run->cwd >= 0 && run->console != NULL && run->errors != NULL)
+    {
+        setvbuf(run->errors, NULL, _IONBF, 0);
+        status = setjmp(run->job_abort);
+        if (status == 0)
+            status = run_job(job->argc, job->argv);
+        else
+            abandon_run();
+    }
+
+    if (run->console != NULL)
+        fclose(run->console);
+    if (run->errors != NULL)
+        fclose(run->errors);
+    if (run->cwd >= 0)
+        close(run->cwd);
+    daemon_reply(job, status);
+    free(job);
+    free(run);
+    sem_post(&job_slots);
+    return NULL;
+}
+
+/* Block SIGINT and SIGTERM on this thread, or let them through again.
+   Threads started while they are blocked inherit that, so the signals
+   reach the daemon's accept() wait and not a job or a worker. */
+void block_stop_signals(int block)
+{
+    sigset_t stop;
+
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+    pthread_sigmask(block ? SIG_BLOCK : SIG_UNBLOCK, &stop, NULL);
+}
+
+/* Daemon mode: listen on a Unix socket and run up to DAEMON_MAX_JOBS
+   clients' jobs at once, each on a thread of its own, with the workers
+   and batches left warm from the jobs before. The workers take the jobs'
+   tasks in turn, so a small job is not held up behind a big one. The
+   arguments are the daemon's own: [-a affinity] [-I kernels] [threads]. */
+int serve(char *path, int argc, char *argv[])
+{
+    int opt;
+    run->AFFINITY_MODE = AFFINITY_NONE;
+    run->KERNEL_ISA = kernels_detect();
+    optind = 0;
+    while ((opt = getopt(argc, argv, "a:I:")) != -1)
+    {
+        if (opt == 'a')
+        {
+            run->AFFINITY_MODE = parse_affinity_mode(optarg);
+            run->affinity_list = optarg;
+        }
+        else if (opt == 'I' && (run->KERNEL_ISA = kernels_parse_isa(optarg)) < 0)
+        {
+            fprintf(run->console, "Invalid kernel build - %s - given! Program exiting!\n", optarg);
+            exit(EXIT_FAILURE);
+        }
+        else if (opt != 'I')
+        {
+            fprintf(run->console, "Usage: %s -D socket [-a none|compact|spread|<cpulist>] [-I base|avx2|avx512] [threads]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    run->NUM_COMPUTE_THREADS = optind < argc ? (int)strtol(argv[optind], (char **)NULL, 10) : 1;
+    if (run->NUM_COMPUTE_THREADS < 1)
+        run->NUM_COMPUTE_THREADS = 1;
+
+    /* Every job runs the same kernels, so they are picked once. */
+    if (kernels_use(run->KERNEL_ISA) != 0)
+    {
+        fprintf(run->console, "This CPU cannot run the %s kernels! Program exiting!\n", kernels_isa_name(run->KERNEL_ISA));
+        exit(EXIT_FAILURE);
+    }
+
+    /* Plan once, pin this thread where compute goes, and start the workers from it. */
+    detect_topology(&topology);
+    if (plan_placement(&topology, run->AFFINITY_MODE, run->affinity_list, run->NUM_COMPUTE_THREADS, &placement) != 0)
+    {
+        fprintf(run->console, "Invalid affinity - %s - given! Program exiting!\n", run->affinity_list);
+        exit(EXIT_FAILURE);
+    }
+    pin_self_to_cpu(placement.compute_cpu);
+    block_stop_signals(1);
+    pool = ws_create(run->NUM_COMPUTE_THREADS, placement.worker_cpus);
+    block_stop_signals(0);
+
+    /* Touch the batches now, sized for one column, so the first job finds them warm too. */
+    run->record_len = RECORD_PREFIX_LEN + MAX_FIELD_LEN;
+    make_batches();
+    for (int i = 0; i < BATCH_POOL_SIZE; i++)
+        enqueue(warm_batches, (void *)run->batches[i]);
+
+    int listener = daemon_listen(path);
+    if (listener < 0)
+    {
+        fprintf(run->console, "Attempt to listen on - %s - failed! Program exiting!\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Signals end the accept() wait rather than restart it. A client that
+       goes away must not take the daemon with it. */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    fprintf(run->console, "DATA, DAEMON, %s, %d workers, %d jobs at once\n", path, run->NUM_COMPUTE_THREADS, DAEMON_MAX_JOBS);
+    fflush(run->console);
+
+    /* Jobs compute on their own threads, where compute would go. */
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pin_attr_to_cpu(&attr, placement.compute_cpu);
+
+    SERVING = 1;
+    sem_init(&job_slots, 0, DAEMON_MAX_JOBS);
+    while (!stop_serving)
+    {
+        /* Wait for a job to end before taking more than DAEMON_MAX_JOBS. */
+        if (sem_wait(&job_slots) != 0)
+            continue;
+
+        struct daemon_job *job = (struct daemon_job *)malloc(sizeof(struct daemon_job));
+        pthread_t thread;
+        int rc = daemon_accept(listener, job);
+        if (rc == 0)
+        {
+            block_stop_signals(1);
+            rc = pthread_create(&thread, &attr, serve_job, job);
+            block_stop_signals(0);
+            if (rc != 0)
+                daemon_reply(job, EXIT_FAILURE);
+        }
+        if (rc != 0)
+        {
+            free(job);
+            sem_post(&job_slots);
+        }
+    }
+
+    /* The jobs still running share the workers and batches; let them finish. */
+    close(listener);
+    unlink(path);
+    for (int i = 0; i < DAEMON_MAX_JOBS; i++)
+        while (sem_wait(&job_slots) != 0)
+            ;
+    SERVING = 0;
+
+    pthread_attr_destroy(&attr);
+    sem_destroy(&job_slots);
+    ws_destroy(pool);
+    pool = NULL;
+    free_batches();
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    /* A direct run, or the daemon itself, uses this process's own streams and directory. */
+    static struct run direct;
+    direct.cwd = AT_FDCWD;
+    direct.fds[0] = STDIN_FILENO;
+    direct.fds[1] = STDOUT_FILENO;
+    direct.fds[2] = STDERR_FILENO;
+    direct.console = stdout;
+    direct.errors = stderr;
+    run = &direct;
+    warm_batches = create_queue();
+
+    /* "-D socket" starts a daemon there; "-U socket" sends the rest of the
+       command line to one, as a thin client that waits for the result. */
+    if (argc > 2 && (strcmp(argv[1], "-D") == 0 || strcmp(argv[1], "-U") == 0))
+    {
+        char *path = argv[2];
+        argv[2] = argv[0];
+        if (argv[1][1] == 'D')
+            return serve(path, argc - 2, argv + 2);
+
+        int status = daemon_submit(path, argc - 2, argv + 2);
+        if (status < 0)
+        {
+            fprintf(stderr, "Daemon at - %s - did not run the job! Program exiting!\n", path);
+            exit(EXIT_FAILURE);
+        }
+        return status;
+    }
+
+    return run_job(argc, argv);
+}
@@ -0,0 +1,157 @@
+/* Input shard lists. Each command-line input is a file, "-" for standard
+   input, a directory (its regular files, in name order) or a glob pattern
+   (its matches, sorted). Shards are scored in the order they were given.
+   Relative inputs are looked up from a directory descriptor rather than
+   the working directory, so threads serving different callers can each
+   have their own. */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "../include/shards.h"
+
+static double now_ms ()
+{
+    struct timeval tv;
+    gettimeofday (&tv, NULL);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+static void append (struct shard_set *set, const char *path)
+{
+    if (set->count == set->cap)
+    {
+        set->cap = set->cap ? set->cap * 2 : 16;
+        set->shards = (struct shard *) realloc (set->shards, set->cap * sizeof (struct shard));
+    }
+
+    struct shard *s = &set->shards[set->count++];
+    memset (s, 0, sizeof (struct shard));
+    s->path = strdup (path);
+}
+
+static int is_regular (int dir, const char *path)
+{
+    struct stat st;
+    return fstatat (dir, path, &st, 0) == 0 && S_ISREG (st.st_mode);
+}
+
+void shards_init (struct shard_set *set)
+{
+    memset (set, 0, sizeof (struct shard_set));
+}
+
+// Add the shards named by one input, relative to the directory dir
+// (AT_FDCWD for the working directory). Returns -1 if a directory cannot
+// be read or a pattern matches nothing. Plain paths are added as they are
+// and fail later, when opened.
+int shards_add (struct shard_set *set, int dir, const char *input)
+{
+    struct stat st;
+
+    if (strcmp (input, "-") != 0 && fstatat (dir, input, &st, 0) == 0 && S_ISDIR (st.st_mode))
+    {
+        struct dirent **names;
+        int n = scandirat (dir, input, &names, NULL, alphasort);
+        if (n < 0)
+            return -1;
+
+        for (int i = 0; i < n; i++)
+        {
+            /* Hidden files are left out, like a shell glob would. */
+            if (names[i]->d_name[0] != '.')
+            {
+                size_t len = strlen (input) + strlen (names[i]->d_name) + 2;
+                char *path = (char *) malloc (len);
+                snprintf (path, len, "%s/%s", input, names[i]->d_name);
+                if (is_regular (dir, path))
+                    append (set, path);
+                free (path);
+            }
+            free (names[i]);
+        }
+        free (names);
+        return 0;
+    }
+
+    if (strpbrk (input, "*?[") != NULL && fstatat (dir, input, &st, 0) != 0)
+    {
+        /* glob() has no *at() form. A relative pattern is matched under
+           the directory's /proc/self/fd entry, which is cut off again. */
+        char under[64] = "";
+        if (dir != AT_FDCWD && input[0] != '/')
+            snprintf (under, sizeof (under), "/proc/self/fd/%d/", dir);
+        char *pattern = (char *) malloc (strlen (under) + strlen (input) + 1);
+        strcat (strcpy (pattern, under), input);
+
+        glob_t g;
+        int rc = glob (pattern, 0, NULL, &g);
+        free (pattern);
+        if (rc != 0)
+            return -1;
+        for (size_t i = 0; i < g.gl_pathc; i++)
+        {
+            const char *path = g.gl_pathv[i] + strlen (under);
+            if (is_regular (dir, path))
+                append (set, path);
+        }
+        globfree (&g);
+        return 0;
+    }
+
+    append (set, input);
+    return 0;
+}
+
+void shards_free (struct shard_set *set)
+{
+    for (int i = 0; i < set->count; i++)
+    {
+        free (set->shards[i].path);
+        free (set->shards[i].out_path);
+    }
+    free (set->shards);
+    memset (set, 0, sizeof (struct shard_set));
+}
+
+void shard_start (struct shard *s)
+{
+    s->start_ms = now_ms ();
+}
+
+void shard_finish (struct shard *s)
+{
+    s->end_ms = now_ms ();
+}
+
+// Print aggregate throughput over elapsed_ms, then each shard's own.
+void shards_report (const struct shard_set *set, double elapsed_ms, FILE *out)
+{
+    long lines = 0, bytes = 0;
+
+    for (int i = 0; i < set->count; i++)
+    {
+        lines += set->shards[i].lines;
+        bytes += set->shards[i].bytes;
+    }
+    fprintf (out, "DATA, SHARDS, %d files, %ld lines, %ld bytes, %.1f MB/s\n", set->count, lines, bytes,
+             elapsed_ms > 0 ? bytes / (elapsed_ms * 1000.0) : 0.0);
+
+    /* A single input is already described by the totals. */
+    if (set->count < 2)
+        return;
+
+    for (int i = 0; i < set->count; i++)
+    {
+        const struct shard *s = &set->shards[i];
+        double ms = s->end_ms - s->start_ms;
+        fprintf (out, "DATA, SHARD %d, %s, %ld lines, %ld bytes, %.3f ms, %.1f MB/s\n", i, s->path, s->lines,
+                 s->bytes, ms, ms > 0 ? s->bytes / (ms * 1000.0) : 0.0);
+    }
+}
@@ -0,0 +1,225 @@
+/* Aggregates for summary-only runs: count, sum, min, max, a log-bucketed
+   histogram and the K largest jumps by magnitude. Ties are broken by line
+   number, so merging partials in any order gives the same top-K. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/summary.h"
+
+static unsigned long magnitude (long v)
+{
+    return v < 0 ? 0UL - (unsigned long) v : (unsigned long) v;
+}
+
+// Is a a bigger jump than b? Equal magnitudes favour the earlier line.
+static int ranks_above (const struct top_entry *a, const struct top_entry *b)
+{
+    unsigned long ma = magnitude (a->value), mb = magnitude (b->value);
+    return ma > mb || (ma == mb && a->line < b->line);
+}
+
+static void sift_down (struct top_entry *heap, int n, int i)
+{
+    for (;;)
+    {
+        int least = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < n && ranks_above (&heap[least], &heap[l]))
+            least = l;
+        if (r < n && ranks_above (&heap[least], &heap[r]))
+            least = r;
+        if (least == i)
+            return;
+
+        struct top_entry t = heap[i];
+        heap[i] = heap[least];
+        heap[least] = t;
+        i = least;
+    }
+}
+
+static void top_offer (struct summary *s, const struct top_entry *e)
+{
+    if (s->num_top < s->k)
+    {
+        /* Not full yet: sift the new entry up. */
+        int i = s->num_top++;
+        s->top[i] = *e;
+        while (i > 0 && ranks_above (&s->top[(i - 1) / 2], &s->top[i]))
+        {
+            struct top_entry t = s->top[i];
+            s->top[i] = s->top[(i - 1) / 2];
+            s->top[(i - 1) / 2] = t;
+            i = (i - 1) / 2;
+        }
+    }
+    else if (s->k > 0 && ranks_above (e, &s->top[0]))
+    {
+        s->top[0] = *e;
+        sift_down (s->top, s->num_top, 0);
+    }
+}
+
+static int bucket_of (long v)
+{
+    unsigned long m = magnitude (v);
+    if (m == 0)
+        return SUMMARY_ZERO;
+
+    int b = 64 - __builtin_clzl (m);
+    return v < 0 ? SUMMARY_ZERO - b : SUMMARY_ZERO + b;
+}
+
+void summary_init (struct summary *s, int k)
+{
+    memset (s, 0, sizeof (struct summary));
+    s->k = k < SUMMARY_MAX_TOP ? k : SUMMARY_MAX_TOP;
+}
+
+// Add one diff d of line. first is set for the first value a summary sees.
+// floor is the smallest magnitude in a full top-K list, kept up to date.
+static inline void add_diff (struct summary *s, long d, long line, int first, unsigned long *floor)
+{
+    s->histogram[bucket_of (d)]++;
+
+    /* Ties go to the lower line, as in summary_merge(), since a worker
+       may run a later range before an earlier one. */
+    if (first)
+    {
+        s->min = s->max = d;
+        s->min_line = s->max_line = line;
+    }
+    if (d < s->min || (d == s->min && line < s->min_line))
+    {
+        s->min = d;
+        s->min_line = line;
+    }
+    if (d > s->max || (d == s->max && line < s->max_line))
+    {
+        s->max = d;
+        s->max_line = line;
+    }
+
+    if (s->k > 0 && (s->num_top < s->k || magnitude (d) >= *floor))
+    {
+        struct top_entry e = { d, line };
+        top_offer (s, &e);
+        if (s->num_top == s->k)
+            *floor = magnitude (s->top[0].value);
+    }
+}
+
+// Add diffs[lo, hi), where diffs[i] belongs to line first_line + i.
+void summary_add (struct summary *s, const long *diffs, long first_line, int lo, int hi)
+{
+    long sum = 0;
+
+    /* Cheap test first; only candidates that could enter the list pay for a heap update. */
+    unsigned long floor = s->num_top == s->k && s->k > 0 ? magnitude (s->top[0].value) : 0;
+
+    for (int i = lo; i < hi; i++)
+    {
+        sum += diffs[i];
+        add_diff (s, diffs[i], first_line + i, s->count == 0 && i == lo, &floor);
+    }
+
+    s->count += hi - lo;
+    s->sum += sum;
+}
+
+// As summary_add(), for 32-bit diffs.
+void summary_add_narrow (struct summary *s, const int32_t *diffs, long first_line, int lo, int hi)
+{
+    long sum = 0;
+    unsigned long floor = s->num_top == s->k && s->k > 0 ? magnitude (s->top[0].value) : 0;
+
+    for (int i = lo; i < hi; i++)
+    {
+        sum += diffs[i];
+        add_diff (s, diffs[i], first_line + i, s->count == 0 && i == lo, &floor);
+    }
+
+    s->count += hi - lo;
+    s->sum += sum;
+}
+
+// Fold src into dst. Both must use the same k.
+void summary_merge (struct summary *dst, const struct summary *src)
+{
+    if (src->count == 0)
+        return;
+
+    if (dst->count == 0 || src->min < dst->min || (src->min == dst->min && src->min_line < dst->min_line))
+    {
+        dst->min = src->min;
+        dst->min_line = src->min_line;
+    }
+    if (dst->count == 0 || src->max > dst->max || (src->max == dst->max && src->max_line < dst->max_line))
+    {
+        dst->max = src->max;
+        dst->max_line = src->max_line;
+    }
+
+    dst->count += src->count;
+    dst->sum += src->sum;
+    for (int b = 0; b < SUMMARY_BUCKETS; b++)
+        dst->histogram[b] += src->histogram[b];
+    for (int i = 0; i < src->num_top; i++)
+        top_offer (dst, &src->top[i]);
+}
+
+static int compare_top (const void *a, const void *b)
+{
+    const struct top_entry *x = (const struct top_entry *) a;
+    const struct top_entry *y = (const struct top_entry *) b;
+    return ranks_above (x, y) ? -1 : ranks_above (y, x) ? 1 : 0;
+}
+
+// Print "line-(line+1): v", or "line: v" for per-line values.
+static void print_entry (const struct summary *s, FILE *out, long line, long v)
+{
+    if (s->per_line)
+        fprintf (out, "%ld: %ld\n", line, v);
+    else
+        fprintf (out, "%ld-%ld: %ld\n", line, line + 1, v);
+}
+
+void summary_print (const struct summary *s, FILE *out)
+{
+    fprintf (out, "SUMMARY, LINES, %ld\n", s->count);
+    fprintf (out, "SUMMARY, SUM, %ld\n", s->sum);
+    fprintf (out, "SUMMARY, MEAN, %.3f\n", s->count > 0 ? (double) s->sum / s->count : 0.0);
+    if (s->count > 0)
+    {
+        fprintf (out, "SUMMARY, MIN, ");
+        print_entry (s, out, s->min_line, s->min);
+        fprintf (out, "SUMMARY, MAX, ");
+        print_entry (s, out, s->max_line, s->max);
+    }
+
+    /* Largest jumps first. */
+    struct top_entry sorted[SUMMARY_MAX_TOP];
+    memcpy (sorted, s->top, s->num_top * sizeof (struct top_entry));
+    qsort (sorted, s->num_top, sizeof (struct top_entry), compare_top);
+    for (int i = 0; i < s->num_top; i++)
+    {
+        fprintf (out, "TOP, %d, ", i + 1);
+        print_entry (s, out, sorted[i].line, sorted[i].value);
+    }
+
+    /* Non-empty buckets, most negative first, as inclusive ranges. */
+    for (int b = 0; b < SUMMARY_BUCKETS; b++)
+    {
+        if (s->histogram[b] == 0)
+            continue;
+
+        int e = b < SUMMARY_ZERO ? SUMMARY_ZERO - b : b - SUMMARY_ZERO;
+        unsigned long lo = e == 0 ? 0 : 1UL << (e - 1);
+        unsigned long hi = e == 0 ? 0 : e == 64 ? ~0UL : (1UL << e) - 1;
+
+        if (b < SUMMARY_ZERO)
+            fprintf (out, "HIST, -%lu..-%lu, %ld\n", hi, lo, s->histogram[b]);
+        else
+            fprintf (out, "HIST, %lu..%lu, %ld\n", lo, hi, s->histogram[b]);
+    }
+}
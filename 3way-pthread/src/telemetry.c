@@ -0,0 +1,261 @@
+/* Progress telemetry for long runs. A thread of its own wakes every
+   interval, reads the stage counters and queue depths without taking any
+   lock, and publishes one line with the totals, the rates since the last
+   sample and their moving averages. The stages only pay for a relaxed
+   atomic add per read, batch or write. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../include/telemetry.h"
+
+static double now_ms ()
+{
+    struct timeval tv;
+    gettimeofday (&tv, NULL);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+static int open_file (struct telemetry *t)
+{
+    t->fd = openat (t->dir, t->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    t->file_bytes = t->fd >= 0 ? lseek (t->fd, 0, SEEK_END) : 0;
+    return t->fd;
+}
+
+static int open_socket (struct telemetry *t)
+{
+    struct sockaddr_un addr;
+
+    /* bind() has no *at() form; a relative path goes through the
+       directory's /proc/self/fd entry. */
+    int len;
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    if (t->dir != AT_FDCWD && t->path[0] != '/')
+        len = snprintf (addr.sun_path, sizeof (addr.sun_path), "/proc/self/fd/%d/%s", t->dir, t->path);
+    else
+        len = snprintf (addr.sun_path, sizeof (addr.sun_path), "%s", t->path);
+    if (len >= (int) sizeof (addr.sun_path))
+        return -1;
+
+    /* A socket file left by an earlier run would make bind() fail. */
+    unlinkat (t->dir, t->path, 0);
+    t->fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (t->fd < 0)
+        return -1;
+    if (bind (t->fd, (struct sockaddr *) &addr, sizeof (addr)) != 0 || listen (t->fd, TELEMETRY_MAX_CLIENTS) != 0)
+    {
+        close (t->fd);
+        t->fd = -1;
+    }
+    return t->fd;
+}
+
+static void publish_file (struct telemetry *t, const char *line, size_t len)
+{
+    if (t->file_bytes + (long) len > TELEMETRY_ROTATE_BYTES)
+    {
+        size_t n = strlen (t->path) + 3;
+        char *old = (char *) malloc (n);
+        snprintf (old, n, "%s.1", t->path);
+        close (t->fd);
+        renameat (t->dir, t->path, t->dir, old);
+        free (old);
+        if (open_file (t) < 0)
+            return;
+    }
+
+    if (write (t->fd, line, len) > 0)
+        t->file_bytes += (long) len;
+}
+
+// Take in any new clients, then send the line to each. A client that is
+// gone or too slow to take a whole line is dropped.
+static void publish_socket (struct telemetry *t, const char *line, size_t len)
+{
+    int c;
+
+    while (t->num_clients < TELEMETRY_MAX_CLIENTS && (c = accept4 (t->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+        t->clients[t->num_clients++] = c;
+
+    for (int i = 0; i < t->num_clients;)
+    {
+        if (send (t->clients[i], line, len, MSG_NOSIGNAL | MSG_DONTWAIT) == (ssize_t) len)
+        {
+            i++;
+            continue;
+        }
+        close (t->clients[i]);
+        t->clients[i] = t->clients[--t->num_clients];
+    }
+}
+
+// Send one line wherever samples go. Samples and notes come from different
+// threads, so lines are written one at a time.
+static void publish (struct telemetry *t, const char *line, size_t len)
+{
+    pthread_mutex_lock (&t->publish_lock);
+    switch (t->kind)
+    {
+    case TELEMETRY_STDERR:
+        fputs (line, t->err);
+        break;
+    case TELEMETRY_FILE:
+        publish_file (t, line, len);
+        break;
+    case TELEMETRY_SOCKET:
+        publish_socket (t, line, len);
+        break;
+    }
+    pthread_mutex_unlock (&t->publish_lock);
+}
+
+static void sample (struct telemetry *t)
+{
+    struct telemetry_counters now;
+    char line[256];
+    double at = now_ms ();
+    double secs = (at - t->last_ms) / 1000.0;
+
+    now.bytes_read = __atomic_load_n (&t->counters->bytes_read, __ATOMIC_RELAXED);
+    now.lines_scored = __atomic_load_n (&t->counters->lines_scored, __ATOMIC_RELAXED);
+    now.records_written = __atomic_load_n (&t->counters->records_written, __ATOMIC_RELAXED);
+
+    double byte_rate = secs > 0 ? (now.bytes_read - t->last.bytes_read) / secs : 0;
+    double line_rate = secs > 0 ? (now.lines_scored - t->last.lines_scored) / secs : 0;
+    if (t->samples++ == 0)
+    {
+        t->byte_rate_avg = byte_rate;
+        t->line_rate_avg = line_rate;
+    }
+    else
+    {
+        t->byte_rate_avg += TELEMETRY_AVERAGE_WEIGHT * (byte_rate - t->byte_rate_avg);
+        t->line_rate_avg += TELEMETRY_AVERAGE_WEIGHT * (line_rate - t->line_rate_avg);
+    }
+
+    /* Depths are read as they are; a sample can be a batch off. */
+    char in[16] = "-", out[16] = "-";
+    if (t->input_depth != NULL)
+        snprintf (in, sizeof (in), "%d", __atomic_load_n (t->input_depth, __ATOMIC_RELAXED));
+    if (t->output_depth != NULL)
+        snprintf (out, sizeof (out), "%d", __atomic_load_n (t->output_depth, __ATOMIC_RELAXED));
+
+    int len = snprintf (line, sizeof (line),
+                        "TELEMETRY, %.3f ms, %ld bytes, %ld lines, %ld records, input queue %s, output queue %s, "
+                        "%.1f MB/s, %.1f MB/s avg, %.0f lines/s, %.0f lines/s avg\n",
+                        at - t->start_ms, now.bytes_read, now.lines_scored, now.records_written, in, out,
+                        byte_rate / 1e6, t->byte_rate_avg / 1e6, line_rate, t->line_rate_avg);
+
+    publish (t, line, (size_t) len);
+
+    t->last = now;
+    t->last_ms = at;
+}
+
+static void *telemetry_main (void *arg)
+{
+    struct telemetry *t = (struct telemetry *) arg;
+    struct timespec wake;
+
+    pthread_mutex_lock (&t->lock);
+    while (!t->stop)
+    {
+        double next = now_ms () + t->interval_ms;
+        wake.tv_sec = (time_t) (next / 1000);
+        wake.tv_nsec = (long) ((next - wake.tv_sec * 1000.0) * 1e6);
+
+        /* Sleep out the interval unless told to stop. */
+        while (!t->stop && pthread_cond_timedwait (&t->cv, &t->lock, &wake) != ETIMEDOUT)
+            ;
+
+        pthread_mutex_unlock (&t->lock);
+        sample (t);
+        pthread_mutex_lock (&t->lock);
+    }
+    pthread_mutex_unlock (&t->lock);
+
+    return NULL;
+}
+
+// Start sampling counters every interval_ms into spec: "stderr", which
+// goes to err, "unix:<path>" or a file path, relative to the directory dir
+// (AT_FDCWD for the working directory). Either depth may be NULL. Returns
+// NULL if the file or socket cannot be opened.
+struct telemetry *telemetry_start (const char *spec, int dir, FILE *err, int interval_ms,
+                                   struct telemetry_counters *counters, const int *input_depth, const int *output_depth)
+{
+    struct telemetry *t = (struct telemetry *) calloc (1, sizeof (struct telemetry));
+
+    t->dir = dir;
+    t->err = err;
+    t->interval_ms = interval_ms;
+    t->counters = counters;
+    t->input_depth = input_depth;
+    t->output_depth = output_depth;
+    t->fd = -1;
+
+    if (strcmp (spec, "stderr") == 0)
+        t->kind = TELEMETRY_STDERR;
+    else if (strncmp (spec, "unix:", 5) == 0)
+    {
+        t->kind = TELEMETRY_SOCKET;
+        t->path = spec + 5;
+        open_socket (t);
+    }
+    else
+    {
+        t->kind = TELEMETRY_FILE;
+        t->path = spec;
+        open_file (t);
+    }
+    if (t->kind != TELEMETRY_STDERR && t->fd < 0)
+    {
+        free (t);
+        return NULL;
+    }
+
+    t->start_ms = t->last_ms = now_ms ();
+    pthread_mutex_init (&t->lock, NULL);
+    pthread_mutex_init (&t->publish_lock, NULL);
+    pthread_cond_init (&t->cv, NULL);
+    pthread_create (&t->thread, NULL, telemetry_main, t);
+    return t;
+}
+
+// Publish a line of the caller's, such as an event as it happens, between
+// samples. line ends in a newline.
+void telemetry_note (struct telemetry *t, const char *line)
+{
+    publish (t, line, strlen (line));
+}
+
+// Stop the sampler after one last sample, and close what it opened.
+void telemetry_stop (struct telemetry *t)
+{
+    pthread_mutex_lock (&t->lock);
+    t->stop = 1;
+    pthread_cond_signal (&t->cv);
+    pthread_mutex_unlock (&t->lock);
+    pthread_join (t->thread, NULL);
+
+    for (int i = 0; i < t->num_clients; i++)
+        close (t->clients[i]);
+    if (t->fd >= 0)
+        close (t->fd);
+    if (t->kind == TELEMETRY_SOCKET)
+        unlinkat (t->dir, t->path, 0);
+
+    pthread_mutex_destroy (&t->lock);
+    pthread_mutex_destroy (&t->publish_lock);
+    pthread_cond_destroy (&t->cv);
+    free (t);
+}
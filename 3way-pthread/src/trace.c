@@ -0,0 +1,135 @@
+/* Event tracing for the pipeline stages. Each thread records into a ring
+   of its own, found through a thread-local pointer, so an event costs a
+   timestamp read and a few stores. Rings are linked onto a global list
+   with a compare-and-swap the first time a thread records anything, and
+   are only walked by trace_write() after the other threads have finished.
+   Timestamps are TSC ticks on x86, converted to microseconds against the
+   monotonic clock measured over the whole run. */
+
+#ifdef TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../include/trace.h"
+
+int trace_enabled;
+
+static struct trace_ring *rings;
+static int next_tid;
+static __thread struct trace_ring *my_ring;
+static unsigned long start_ticks;
+static double start_ns;
+
+static double monotonic_ns ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static inline unsigned long ticks ()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((unsigned long) hi << 32) | lo;
+#else
+    return (unsigned long) monotonic_ns ();
+#endif
+}
+
+static struct trace_ring *ring ()
+{
+    if (my_ring != NULL)
+        return my_ring;
+
+    struct trace_ring *r = (struct trace_ring *) calloc (1, sizeof (struct trace_ring));
+    r->tid = __atomic_fetch_add (&next_tid, 1, __ATOMIC_RELAXED);
+    snprintf (r->name, TRACE_NAME_LEN, "thread %d", r->tid);
+
+    r->next = __atomic_load_n (&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n (&rings, &r->next, r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    my_ring = r;
+    return r;
+}
+
+// Turn recording on. Events before this are dropped.
+void trace_start ()
+{
+    start_ns = monotonic_ns ();
+    start_ticks = ticks ();
+    trace_enabled = 1;
+}
+
+// Name the calling thread's track, with id appended if it is not negative.
+void trace_thread_name (const char *name, int id)
+{
+    if (!trace_enabled)
+        return;
+
+    struct trace_ring *r = ring ();
+    if (id >= 0)
+        snprintf (r->name, TRACE_NAME_LEN, "%s %d", name, id);
+    else
+        snprintf (r->name, TRACE_NAME_LEN, "%s", name);
+}
+
+void trace_event (const char *name, char phase, int batch)
+{
+    struct trace_ring *r = ring ();
+    struct trace_event *e = &r->events[r->count++ & (TRACE_RING_EVENTS - 1)];
+
+    e->ticks = ticks ();
+    e->name = name;
+    e->batch = batch;
+    e->phase = phase;
+}
+
+// Write every ring to path as Chrome trace-event JSON. Call only once the
+// traced threads have stopped. Returns -1 if the file cannot be written.
+int trace_write (const char *path)
+{
+    FILE *f = fopen (path, "w");
+    if (f == NULL)
+        return -1;
+
+    double ns_per_tick = 1.0;
+    unsigned long end_ticks = ticks ();
+    if (end_ticks > start_ticks)
+        ns_per_tick = (monotonic_ns () - start_ns) / (double) (end_ticks - start_ticks);
+
+    fprintf (f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf (f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"scorecard\"}}");
+
+    for (struct trace_ring *r = __atomic_load_n (&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next)
+    {
+        fprintf (f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", r->tid,
+                 r->name);
+
+        /* A ring that wrapped starts at its oldest kept event. Ends whose
+           begin was overwritten are left for the viewer to drop. */
+        unsigned long first = r->count > TRACE_RING_EVENTS ? r->count - TRACE_RING_EVENTS : 0;
+        for (unsigned long i = first; i < r->count; i++)
+        {
+            struct trace_event *e = &r->events[i & (TRACE_RING_EVENTS - 1)];
+            double us = (double) (long) (e->ticks - start_ticks) * ns_per_tick / 1000.0;
+
+            fprintf (f, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%d", e->name, e->phase, us,
+                     r->tid);
+            if (e->phase == 'i')
+                fprintf (f, ",\"s\":\"t\"");
+            if (e->batch >= 0)
+                fprintf (f, ",\"args\":{\"batch\":%d}", e->batch);
+            fprintf (f, "}");
+        }
+    }
+
+    fprintf (f, "\n]}\n");
+    return fclose (f);
+}
+
+#endif
@@ -0,0 +1,435 @@
+/* Work-stealing scheduler for parallel loops over batch lines.
+ *
+ * Each worker owns a Chase-Lev deque (Le, Pop, Cohen and Zappa Nardelli,
+ * "Correct and Efficient Work-Stealing for Weak Memory Models", PPoPP'13).
+ * A loop starts as one range on the calling thread's deque. Whoever runs a
+ * range keeps splitting it in half, pushing the upper half, until it is
+ * small enough to run, so idle workers always find something to steal.
+ *
+ * Several clients can share one pool, each with its own deques and its
+ * own loop at a time. Pool threads go to the clients with a loop under
+ * way in turn, and move on after WS_SLICE_TASKS ranges, or when they find
+ * nothing to do, while another client is waiting, so no client's loops
+ * starve behind a bigger one's.
+ */
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../include/affinity.h"
+#include "../include/wsched.h"
+#include "../include/trace.h"
+
+#define WS_EMPTY ((uint64_t) -1)
+#define WS_SPINS_BEFORE_YIELD 64
+
+// Index of the worker running on this thread, for per-worker accumulators.
+static __thread int current_worker;
+
+static double now_ms ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static uint64_t pack_range (int lo, int hi)
+{
+    return ((uint64_t) (uint32_t) lo << 32) | (uint32_t) hi;
+}
+
+static void unpack_range (uint64_t r, int *lo, int *hi)
+{
+    *lo = (int) (uint32_t) (r >> 32);
+    *hi = (int) (uint32_t) r;
+}
+
+// Owner only. Returns 0 if the deque is full.
+static int deque_push (struct ws_deque *d, uint64_t r)
+{
+    int64_t b = __atomic_load_n (&d->bottom, __ATOMIC_RELAXED);
+    int64_t t = __atomic_load_n (&d->top, __ATOMIC_ACQUIRE);
+
+    if (b - t >= WS_DEQUE_SIZE)
+        return 0;
+
+    __atomic_store_n (&d->ranges[b % WS_DEQUE_SIZE], r, __ATOMIC_RELAXED);
+    __atomic_thread_fence (__ATOMIC_RELEASE);
+    __atomic_store_n (&d->bottom, b + 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// Owner only. Takes the most recently pushed range.
+static uint64_t deque_pop (struct ws_deque *d)
+{
+    int64_t b = __atomic_load_n (&d->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n (&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    int64_t t = __atomic_load_n (&d->top, __ATOMIC_RELAXED);
+
+    if (t > b)
+    {
+        /* Deque was already empty. */
+        __atomic_store_n (&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return WS_EMPTY;
+    }
+
+    uint64_t r = __atomic_load_n (&d->ranges[b % WS_DEQUE_SIZE], __ATOMIC_RELAXED);
+    if (t == b)
+    {
+        /* Last entry. Race any thief for it. */
+        if (!__atomic_compare_exchange_n (&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            r = WS_EMPTY;
+        __atomic_store_n (&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+
+    return r;
+}
+
+// Any thread. Takes the oldest, and therefore largest, range.
+static uint64_t deque_steal (struct ws_deque *d)
+{
+    int64_t t = __atomic_load_n (&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n (&d->bottom, __ATOMIC_ACQUIRE);
+
+    if (t >= b)
+        return WS_EMPTY;
+
+    uint64_t r = __atomic_load_n (&d->ranges[t % WS_DEQUE_SIZE], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n (&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return WS_EMPTY;
+
+    return r;
+}
+
+static int range_too_big (struct ws_job *job, int lo, int hi)
+{
+    if (hi - lo <= 1)
+        return 0;
+    if (job->cost == NULL)
+        return hi - lo > job->grain_cost;
+    return job->cost (job->ctx, lo, hi) > job->grain_cost;
+}
+
+static void run_range (struct ws_client *c, int id, uint64_t r)
+{
+    struct ws_job *job = &c->job;
+    struct ws_stats *st = &c->stats[id];
+    int lo, hi;
+    unpack_range (r, &lo, &hi);
+
+    /* Keep the lower half, offer the upper half to thieves. */
+    while (range_too_big (job, lo, hi))
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (!deque_push (&c->deques[id], pack_range (mid, hi)))
+            break;
+        st->splits++;
+        hi = mid;
+    }
+
+    double start = now_ms ();
+    job->run (job->ctx, lo, hi);
+    st->busy_ms += now_ms () - start;
+    st->tasks++;
+    st->items += hi - lo;
+
+    __atomic_fetch_sub (&job->remaining, hi - lo, __ATOMIC_ACQ_REL);
+}
+
+static uint64_t try_steal (struct ws_client *c, int id, unsigned int *seed)
+{
+    struct ws_stats *st = &c->stats[id];
+    int n = c->job.num_workers;
+
+    for (int i = 0; i < n - 1; i++)
+    {
+        int victim = rand_r (seed) % n;
+        if (victim == id)
+            continue;
+
+        st->steal_attempts++;
+        uint64_t r = deque_steal (&c->deques[victim]);
+        if (r != WS_EMPTY)
+        {
+            st->steals++;
+            return r;
+        }
+    }
+
+    return WS_EMPTY;
+}
+
+// Run and steal ranges of c's current loop as worker id until every index
+// has been run. A pool thread (share set) leaves early, once its own deque
+// is empty, if another client has a loop under way and it has either had
+// its slice of this one or found nothing in it to do.
+static void work_until_done (struct ws_client *c, int id, unsigned int *seed, int share)
+{
+    struct ws_job *job = &c->job;
+    double start = now_ms ();
+    int spins = 0, ran = 0;
+
+    while (__atomic_load_n (&job->remaining, __ATOMIC_ACQUIRE) > 0 && id < job->num_workers)
+    {
+        int waiting = share && __atomic_load_n (&c->pool->busy, __ATOMIC_RELAXED) > 1;
+        uint64_t r = deque_pop (&c->deques[id]);
+
+        if (r == WS_EMPTY && waiting && ran >= WS_SLICE_TASKS)
+            break;
+        if (r == WS_EMPTY && job->num_workers > 1)
+            r = try_steal (c, id, seed);
+
+        if (r != WS_EMPTY)
+        {
+            run_range (c, id, r);
+            ran++;
+            spins = 0;
+        }
+        else if (++spins >= WS_SPINS_BEFORE_YIELD)
+        {
+            if (waiting)
+                break;
+            sched_yield ();
+            spins = 0;
+        }
+    }
+
+    c->stats[id].active_ms += now_ms () - start;
+}
+
+// The next client after the cursor, round the list, with a loop under way
+// that worker id takes part in, or NULL. Call with the pool's lock held.
+static struct ws_client *pick_client (struct ws_pool *pool, int id)
+{
+    struct ws_client *c = pool->cursor != NULL && pool->cursor->next != NULL ? pool->cursor->next : pool->clients;
+
+    for (int i = 0; i < pool->num_clients; i++)
+    {
+        /* The loop's fields are published by the store to remaining. */
+        if (__atomic_load_n (&c->job.remaining, __ATOMIC_ACQUIRE) > 0 && id < c->job.num_workers)
+        {
+            pool->cursor = c;
+            return c;
+        }
+        c = c->next != NULL ? c->next : pool->clients;
+    }
+
+    return NULL;
+}
+
+static void *worker_main (void *arg)
+{
+    struct ws_worker *w = (struct ws_worker *) arg;
+    struct ws_pool *pool = w->pool;
+
+    current_worker = w->id;
+    TRACE_THREAD ("worker", w->id);
+
+    pthread_mutex_lock (&pool->lock);
+    for (;;)
+    {
+        /* Sleep while no client has work for this worker, so idle workers
+           cost nothing while input is slow. */
+        struct ws_client *c = NULL;
+        while (!pool->shutdown && (c = pick_client (pool, w->id)) == NULL)
+            pthread_cond_wait (&pool->wake, &pool->lock);
+        if (pool->shutdown)
+            break;
+
+        /* A client cannot detach while a worker is inside it. */
+        c->visitors++;
+        pthread_mutex_unlock (&pool->lock);
+
+        work_until_done (c, w->id, &w->seed, 1);
+
+        pthread_mutex_lock (&pool->lock);
+        if (--c->visitors == 0)
+            pthread_cond_broadcast (&pool->left);
+    }
+    pthread_mutex_unlock (&pool->lock);
+
+    return NULL;
+}
+
+// Create a pool of num_workers workers. Worker 0 of each client is the
+// thread that attached it; the rest are started here and pinned to
+// cpus[i] when cpus[i] >= 0.
+struct ws_pool *ws_create (int num_workers, int *cpus)
+{
+    struct ws_pool *pool = (struct ws_pool *) calloc (1, sizeof (struct ws_pool));
+    pthread_attr_t attr;
+
+    if (num_workers < 1)
+        num_workers = 1;
+
+    pool->num_workers = num_workers;
+    if (posix_memalign ((void **) &pool->workers, 64, num_workers * sizeof (struct ws_worker)) != 0)
+    {
+        free (pool);
+        return NULL;
+    }
+    memset (pool->workers, 0, num_workers * sizeof (struct ws_worker));
+    pthread_mutex_init (&pool->lock, NULL);
+    pthread_cond_init (&pool->wake, NULL);
+    pthread_cond_init (&pool->left, NULL);
+
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_JOINABLE);
+
+    for (int i = 0; i < num_workers; i++)
+    {
+        struct ws_worker *w = &pool->workers[i];
+        w->pool = pool;
+        w->id = i;
+        w->cpu = cpus != NULL ? cpus[i] : -1;
+        w->seed = 0x9e3779b9u * (i + 1);
+
+        if (i == 0)
+            continue;
+
+        pin_attr_to_cpu (&attr, w->cpu);
+        int rc = pthread_create (&w->thread, &attr, worker_main, w);
+        if (rc)
+        {
+            printf ("ERROR: Return code from pthread_create() was %d.\n", rc);
+            exit (-1);
+        }
+    }
+
+    pthread_attr_destroy (&attr);
+    return pool;
+}
+
+// Attach a client to pool, with every worker active. The calling thread
+// becomes its worker 0 and must be the one to run its loops.
+struct ws_client *ws_attach (struct ws_pool *pool)
+{
+    struct ws_client *c = (struct ws_client *) calloc (1, sizeof (struct ws_client));
+    int n = pool->num_workers;
+
+    if (posix_memalign ((void **) &c->deques, 64, n * sizeof (struct ws_deque)) != 0)
+    {
+        free (c);
+        return NULL;
+    }
+    memset (c->deques, 0, n * sizeof (struct ws_deque));
+    c->stats = (struct ws_stats *) calloc (n, sizeof (struct ws_stats));
+    c->pool = pool;
+    c->active = n;
+    c->seed = 0x9e3779b9u;
+
+    pthread_mutex_lock (&pool->lock);
+    struct ws_client **tail = &pool->clients;
+    while (*tail != NULL)
+        tail = &(*tail)->next;
+    *tail = c;
+    pool->num_clients++;
+    pthread_mutex_unlock (&pool->lock);
+
+    current_worker = 0;
+    return c;
+}
+
+// Index of the calling worker within the pool, 0 for a client's own
+// thread. Lets tasks keep per-worker partial results without locking.
+int ws_worker_id ()
+{
+    return current_worker;
+}
+
+// Run run(ctx, lo, hi) over [lo, hi) on c's active workers and wait for it.
+// Must always be called from the thread that attached c.
+void ws_parallel_for (struct ws_client *c, int lo, int hi, long grain_cost,
+                      long (*cost) (void *, int, int), void (*run) (void *, int, int), void *ctx)
+{
+    struct ws_pool *pool = c->pool;
+    struct ws_job *job = &c->job;
+
+    if (hi <= lo)
+        return;
+
+    job->run = run;
+    job->cost = cost;
+    job->ctx = ctx;
+    job->grain_cost = grain_cost > 0 ? grain_cost : 1;
+    job->num_workers = c->active;
+    __atomic_store_n (&job->remaining, (long) (hi - lo), __ATOMIC_RELEASE);
+
+    deque_push (&c->deques[0], pack_range (lo, hi));
+
+    if (job->num_workers > 1)
+    {
+        pthread_mutex_lock (&pool->lock);
+        __atomic_add_fetch (&pool->busy, 1, __ATOMIC_RELAXED);
+        pthread_cond_broadcast (&pool->wake);
+        pthread_mutex_unlock (&pool->lock);
+    }
+
+    work_until_done (c, 0, &c->seed, 0);
+
+    if (job->num_workers > 1)
+        __atomic_sub_fetch (&pool->busy, 1, __ATOMIC_RELAXED);
+}
+
+// Use only workers 0 .. n - 1 for c's later loops, clamped to
+// [1, num_workers]. Call from the thread that attached c, between loops.
+void ws_set_active (struct ws_client *c, int n)
+{
+    if (n < 1)
+        n = 1;
+    if (n > c->pool->num_workers)
+        n = c->pool->num_workers;
+    c->active = n;
+}
+
+// Detach c once no pool thread is inside it. If stats is not NULL, each
+// worker's counters for c's loops are copied into it.
+void ws_detach (struct ws_client *c, struct ws_stats *stats)
+{
+    struct ws_pool *pool = c->pool;
+
+    pthread_mutex_lock (&pool->lock);
+    struct ws_client **link = &pool->clients;
+    struct ws_client *prev = NULL;
+    while (*link != c)
+    {
+        prev = *link;
+        link = &(*link)->next;
+    }
+    *link = c->next;
+    pool->num_clients--;
+    if (pool->cursor == c)
+        pool->cursor = prev;
+    while (c->visitors > 0)
+        pthread_cond_wait (&pool->left, &pool->lock);
+    pthread_mutex_unlock (&pool->lock);
+
+    if (stats != NULL)
+        memcpy (stats, c->stats, pool->num_workers * sizeof (struct ws_stats));
+    free (c->deques);
+    free (c->stats);
+    free (c);
+}
+
+// Stop the workers. Every client must have detached.
+void ws_destroy (struct ws_pool *pool)
+{
+    pthread_mutex_lock (&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast (&pool->wake);
+    pthread_mutex_unlock (&pool->lock);
+
+    for (int i = 1; i < pool->num_workers; i++)
+        pthread_join (pool->workers[i].thread, NULL);
+
+    pthread_mutex_destroy (&pool->lock);
+    pthread_cond_destroy (&pool->wake);
+    pthread_cond_destroy (&pool->left);
+    free (pool->workers);
+    free (pool);
+}
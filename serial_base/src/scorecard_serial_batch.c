@@ -53,6 +53,9 @@ int main (int argc, char *argv[])
 
 FILE *try_open_file (char *path)
 {
+    /* "-" reads from standard input, so the scorecard can sit in a pipeline. */
+    if (strcmp (path, "-") == 0)
+        return stdin;
     return fopen (path, "r");
 }
 
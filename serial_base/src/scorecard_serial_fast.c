@@ -0,0 +1,200 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define READ_BLOCK_SIZE (1 << 20)
+#define WRITE_BUFFER_SIZE (1 << 20)
+#define MAX_RECORD_LEN 48
+
+/* Constant memory regardless of input size: one input block, one output buffer. */
+static char in_buf[READ_BLOCK_SIZE];
+static char out_buf[WRITE_BUFFER_SIZE + MAX_RECORD_LEN];
+static size_t out_len;
+
+int try_open_file (char *);
+void try_close_file (int);
+long calculate_scorecard (int);
+long sum_bytes (const unsigned char *, size_t);
+int format_long (char *, long);
+void emit_record (int, long);
+void flush_output ();
+void print_time_elapsed (struct timespec *, struct timespec *, long);
+
+int main (int argc, char *argv[])
+{
+    struct timespec start, end;
+
+    /* Grab file path from cmdline argument. Default to wiki_dump. */
+    char *path = "/homes/dan/625/wiki_dump.txt";
+    if (argc > 1)
+    {
+        path = argv[1];
+    }
+
+    /* Try opening file. If file does not exist, exit. */
+    int fd = try_open_file (path);
+    if (fd < 0)
+    {
+        printf ("Attempt to open file at - %s - failed! Program exiting!\n", path);
+        exit (EXIT_FAILURE);
+    }
+
+    /* Get start time. */
+    clock_gettime (CLOCK_MONOTONIC, &start);
+
+    /* Calculate "scorecard" for file. */
+    long bytes = calculate_scorecard (fd);
+
+    /* Get end time. */
+    clock_gettime (CLOCK_MONOTONIC, &end);
+
+    /* Close file. Ignore any errors. */
+    try_close_file (fd);
+
+    /* Print time elapsed during calculation to stdout. */
+    print_time_elapsed (&start, &end, bytes);
+
+    return 0;
+}
+
+int try_open_file (char *path)
+{
+    /* "-" reads from standard input, so the scorecard can sit in a pipeline. */
+    if (strcmp (path, "-") == 0)
+        return STDIN_FILENO;
+    return open (path, O_RDONLY);
+}
+
+void try_close_file (int fd)
+{
+    close (fd);
+}
+
+/* Read the file in large blocks and, in the same pass, score each line,
+   diff it against the previous one and format the record. Produces the
+   same output as the linear version. Returns the number of bytes read. */
+long calculate_scorecard (int fd)
+{
+    long bytes = 0;
+    long score = 0;      // Running score of the line being read.
+    long prev_score = 0; // Score of the last complete line.
+    int line_num = 0;    // Number of complete lines seen.
+    ssize_t n;
+
+    while ((n = read (fd, in_buf, READ_BLOCK_SIZE)) > 0)
+    {
+        const char *p = in_buf;
+        const char *end = in_buf + n;
+        bytes += n;
+
+        while (p < end)
+        {
+            const char *nl = memchr (p, '\n', end - p);
+            if (nl == NULL)
+            {
+                /* Line continues into the next block. */
+                score += sum_bytes ((const unsigned char *) p, end - p);
+                break;
+            }
+
+            score += sum_bytes ((const unsigned char *) p, nl - p);
+            if (line_num > 0)
+                emit_record (line_num - 1, prev_score - score);
+            prev_score = score;
+            score = 0;
+            ++line_num;
+            p = nl + 1;
+        }
+
+        /* A short read means a pipe ran dry for now: pass on what is done
+           rather than hold it until the buffer fills. */
+        if (n < READ_BLOCK_SIZE)
+            flush_output ();
+    }
+
+    /* Last line is compared against whatever followed it: a partial line or nothing. */
+    if (line_num > 0)
+        emit_record (line_num - 1, prev_score - score);
+
+    flush_output ();
+    return bytes;
+}
+
+long sum_bytes (const unsigned char *p, size_t n)
+{
+    long sum = 0;
+    for (size_t i = 0; i < n; i++)
+        sum += p[i];
+    return sum;
+}
+
+/* Write v in decimal without a terminator. Returns the number of bytes. */
+int format_long (char *dst, long v)
+{
+    char tmp[24];
+    int n = 0, len = 0;
+    unsigned long u = (unsigned long) v;
+
+    if (v < 0)
+    {
+        dst[len++] = '-';
+        u = 0UL - u;
+    }
+
+    do
+    {
+        tmp[n++] = (char) ('0' + u % 10);
+        u /= 10;
+    } while (u != 0);
+
+    while (n > 0)
+        dst[len++] = tmp[--n];
+
+    return len;
+}
+
+/* Append "line-(line+1): diff\n" to the output buffer, flushing when full. */
+void emit_record (int line, long diff)
+{
+    char *p = out_buf + out_len;
+
+    p += format_long (p, line);
+    *p++ = '-';
+    p += format_long (p, (long) line + 1);
+    *p++ = ':';
+    *p++ = ' ';
+    p += format_long (p, diff);
+    *p++ = '\n';
+
+    out_len = p - out_buf;
+    if (out_len >= WRITE_BUFFER_SIZE)
+        flush_output ();
+}
+
+void flush_output ()
+{
+    size_t done = 0;
+
+    while (done < out_len)
+    {
+        ssize_t w = write (STDOUT_FILENO, out_buf + done, out_len - done);
+        if (w <= 0)
+        {
+            perror ("write");
+            exit (EXIT_FAILURE);
+        }
+        done += w;
+    }
+
+    out_len = 0;
+}
+
+void print_time_elapsed (struct timespec *s, struct timespec *e, long bytes)
+{
+    double elapsed_ms = (e->tv_sec - s->tv_sec) * 1000.0 + (e->tv_nsec - s->tv_nsec) / 1000000.0;
+    printf ("DATA: %.3f ms\n", elapsed_ms);
+    printf ("DATA: %ld bytes, %.1f MB/s\n", bytes, elapsed_ms > 0 ? bytes / (elapsed_ms * 1000.0) : 0.0);
+}